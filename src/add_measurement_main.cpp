@@ -1,7 +1,6 @@
-#include "database.h"
 #include <iostream>
 
-#include "database.h"
+#include "sharded_database.h"
 
 int main(int argc, char **argv) {
   if (argc != 4) {
@@ -10,10 +9,14 @@ int main(int argc, char **argv) {
               << std::endl;
     return 1;
   }
-  smartwater::Database db;
+  smartwater::ShardedDatabase db(
+      "./db.sqlite", smartwater::ShardedDatabase::configuredShards());
   uint64_t id = std::atol(argv[1]);
   smartwater::Measurement m;
   m.timestamp = std::atol(argv[2]);
   m.height = std::atof(argv[3]);
-  db.addMeasurement(id, m);
+  if (!db.addMeasurement(id, m)) {
+    std::cout << "The measurement was rejected" << std::endl;
+    return 1;
+  }
 }
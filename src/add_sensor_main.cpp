@@ -1,7 +1,6 @@
-#include "database.h"
 #include <iostream>
 
-#include "database.h"
+#include "sharded_database.h"
 
 int main(int argc, char **argv) {
   if (argc != 6) {
@@ -10,9 +9,9 @@ int main(int argc, char **argv) {
               << " <lat> <long> <name> <loc_name> <dev-uid>" << std::endl;
     return 1;
   }
-  smartwater::Database db;
+  smartwater::ShardedDatabase db(
+      "./db.sqlite", smartwater::ShardedDatabase::configuredShards());
   smartwater::Sensor s;
-  s.id = db.getNumSensors();
   s.latitude = std::atof(argv[1]);
   s.longitude = std::atof(argv[2]);
   s.name = argv[3];
@@ -0,0 +1,133 @@
+#include "aggregation.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace smartwater {
+
+namespace {
+uint64_t readTimestamp(const char *data, size_t i) {
+  uint64_t t;
+  std::memcpy(&t, data + i * sizeof(Measurement), sizeof(uint64_t));
+  return t;
+}
+
+double readHeight(const char *data, size_t i) {
+  double h;
+  std::memcpy(&h, data + i * sizeof(Measurement) + sizeof(uint64_t),
+              sizeof(double));
+  return h;
+}
+} // namespace
+
+Aggregation parseAggregation(const std::string &name) {
+  if (name == "min") {
+    return Aggregation::MIN;
+  } else if (name == "max") {
+    return Aggregation::MAX;
+  } else if (name == "avg") {
+    return Aggregation::AVG;
+  } else if (name == "last") {
+    return Aggregation::LAST;
+  } else if (name == "count") {
+    return Aggregation::COUNT;
+  }
+  throw std::runtime_error("Unknown aggregation " + name);
+}
+
+void Rollup::init(uint64_t bucket_start, const Measurement &m) {
+  start = bucket_start;
+  count = 1;
+  min = m.height;
+  max = m.height;
+  sum = m.height;
+  last = m.height;
+}
+
+void Rollup::add(const Measurement &m) {
+  count++;
+  min = std::min(min, m.height);
+  max = std::max(max, m.height);
+  sum += m.height;
+  last = m.height;
+}
+
+void Rollup::merge(const Rollup &other) {
+  count += other.count;
+  min = std::min(min, other.min);
+  max = std::max(max, other.max);
+  sum += other.sum;
+  last = other.last;
+}
+
+double Rollup::value(Aggregation aggregation) const {
+  switch (aggregation) {
+  case Aggregation::MIN:
+    return min;
+  case Aggregation::MAX:
+    return max;
+  case Aggregation::AVG:
+    return sum / count;
+  case Aggregation::LAST:
+    return last;
+  case Aggregation::COUNT:
+    return count;
+  }
+  return 0;
+}
+
+BucketAggregator::BucketAggregator(uint64_t bucket_size)
+    : _bucket_size(bucket_size) {}
+
+void BucketAggregator::add(const MeasurementRange &measurements) {
+  for (const MeasurementRange::Segment &segment : measurements.segments()) {
+    const char *data = segment.data;
+    size_t i = 0;
+    while (i < segment.size) {
+      uint64_t t = readTimestamp(data, i);
+      uint64_t start = t - t % _bucket_size;
+      uint64_t end = start + _bucket_size;
+      // Find the run of measurements within the bucket
+      size_t j = i + 1;
+      while (j < segment.size && readTimestamp(data, j) < end) {
+        j++;
+      }
+      // Reduce the run in a single branch free pass
+      double min = readHeight(data, i);
+      double max = min;
+      double sum = 0;
+      for (size_t k = i; k < j; k++) {
+        double h = readHeight(data, k);
+        min = std::min(min, h);
+        max = std::max(max, h);
+        sum += h;
+      }
+      Rollup r;
+      r.start = start;
+      r.count = j - i;
+      r.min = min;
+      r.max = max;
+      r.sum = sum;
+      r.last = readHeight(data, j - 1);
+      add(r);
+      i = j;
+    }
+  }
+}
+
+void BucketAggregator::add(const Rollup &rollup) {
+  uint64_t start = rollup.start - rollup.start % _bucket_size;
+  if (!_buckets.empty() && _buckets.back().start == start) {
+    _buckets.back().merge(rollup);
+  } else {
+    _buckets.push_back(rollup);
+    _buckets.back().start = start;
+  }
+}
+
+const std::vector<Rollup> &BucketAggregator::buckets() const {
+  return _buckets;
+}
+
+} // namespace smartwater
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "measurement_range.h"
+#include "sensor.h"
+
+namespace smartwater {
+
+enum class Aggregation { MIN, MAX, AVG, LAST, COUNT };
+
+// Parses min, max, avg, last or count. Throws on any other input.
+Aggregation parseAggregation(const std::string &name);
+
+// The aggregate of all measurements in a time bucket
+struct Rollup {
+  uint64_t start;
+  uint64_t count;
+  double min;
+  double max;
+  double sum;
+  double last;
+
+  void init(uint64_t bucket_start, const Measurement &m);
+  void add(const Measurement &m);
+  void merge(const Rollup &other);
+  double value(Aggregation aggregation) const;
+};
+
+// Aggregates measurements and rollups of a finer tier into buckets of a
+// fixed size. Input has to be added in timestamp order.
+class BucketAggregator {
+public:
+  explicit BucketAggregator(uint64_t bucket_size);
+
+  void add(const MeasurementRange &measurements);
+  // The rollup has to lie entirely within one of the buckets.
+  void add(const Rollup &rollup);
+
+  const std::vector<Rollup> &buckets() const;
+
+private:
+  std::vector<Rollup> _buckets;
+  uint64_t _bucket_size;
+};
+
+} // namespace smartwater
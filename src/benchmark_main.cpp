@@ -0,0 +1,245 @@
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "database.h"
+#include "json_writer.h"
+#include "qgram.h"
+#include "server.h"
+#include "util.h"
+
+namespace {
+using smartwater::Database;
+using smartwater::Measurement;
+using smartwater::Sensor;
+typedef std::chrono::steady_clock Clock;
+
+// Results are added up here so the compiler can not drop the work
+volatile size_t sink = 0;
+
+// Splits a comma separated list of numbers. Empty fields (as in "1,,2" or a
+// trailing comma) are dropped.
+std::vector<size_t> parseList(const std::string &s) {
+  std::vector<size_t> values;
+  std::stringstream in(s);
+  std::string value;
+  while (std::getline(in, value, ',')) {
+    if (value.empty()) {
+      continue;
+    }
+    values.push_back(std::stoul(value));
+  }
+  return values;
+}
+
+double randomDouble(unsigned int *seed) {
+  return rand_r(seed) / static_cast<double>(RAND_MAX);
+}
+
+// Names made of a few syllables, so that the q-grams are shared like the
+// ones of real place names
+std::string randomName(unsigned int *seed) {
+  static const char *SYLLABLES[] = {"ber", "lin", "ham", "burg", "mün",
+                                    "chen", "kö", "ln", "frank", "furt",
+                                    "stutt", "gart", "dres", "den", "ha",
+                                    "no", "ver", "brem", "en", "lei",
+                                    "pzig", "ro", "stock", "bach", "au"};
+  const size_t num_syllables = sizeof(SYLLABLES) / sizeof(SYLLABLES[0]);
+  std::string name;
+  size_t length = 2 + rand_r(seed) % 3;
+  for (size_t i = 0; i < length; i++) {
+    name += SYLLABLES[rand_r(seed) % num_syllables];
+  }
+  name[0] = std::toupper(name[0]);
+  return name;
+}
+
+Sensor randomSensor(unsigned int *seed) {
+  Sensor s;
+  s.name = randomName(seed);
+  s.location_name = randomName(seed);
+  s.dev_uid = std::to_string(rand_r(seed)) + std::to_string(rand_r(seed));
+  // The area of the generated data
+  s.longitude = 6 + 9 * randomDouble(seed);
+  s.latitude = 47 + 6 * randomDouble(seed);
+  return s;
+}
+
+void report(const std::string &name, size_t ops, Clock::duration elapsed) {
+  double seconds = std::chrono::duration<double>(elapsed).count();
+  double ns_per_op = ops == 0 ? 0 : seconds * 1e9 / ops;
+  std::cout << "  " << std::left << std::setw(28) << name << std::right
+            << std::setw(12) << ops << " ops " << std::fixed
+            << std::setprecision(1) << std::setw(12) << ns_per_op << " ns/op "
+            << std::setprecision(0) << std::setw(12)
+            << (seconds > 0 ? ops / seconds : 0) << " ops/s" << std::endl;
+}
+
+void removeDatabase(const std::string &path) {
+  unlink(path.c_str());
+  unlink((path + ".wal").c_str());
+  unlink((path + ".snapshot").c_str());
+}
+
+void runBenchmarks(size_t num_sensors, size_t history_length,
+                   const std::string &path) {
+  std::cout << num_sensors << " sensors, " << history_length
+            << " measurements each" << std::endl;
+  removeDatabase(path);
+  unsigned int seed = 42;
+  std::vector<Sensor> sensors;
+  for (size_t i = 0; i < num_sensors; i++) {
+    sensors.push_back(randomSensor(&seed));
+  }
+
+  // Writing
+  {
+    Database db(path);
+    // Like generate_data, a sync per measurement would dominate the numbers
+    db.enableGroupCommit(4096, std::chrono::milliseconds(1000));
+    Clock::time_point start = Clock::now();
+    for (Sensor &sensor : sensors) {
+      sensor.id = db.addSensor(sensor);
+    }
+    report("addSensor", num_sensors, Clock::now() - start);
+
+    // The sensors report in turns, like the uplinks of a deployment
+    uint64_t now = time(nullptr);
+    start = Clock::now();
+    for (size_t j = 0; j < history_length; j++) {
+      for (const Sensor &sensor : sensors) {
+        Measurement m;
+        m.timestamp = now - 15 * 60 * (history_length - 1 - j);
+        m.height = randomDouble(&seed);
+        db.addMeasurement(sensor.id, m);
+      }
+    }
+    report("addMeasurement", num_sensors * history_length,
+           Clock::now() - start);
+  }
+
+  // Loading, ops are the measurements loaded
+  size_t num_measurements = num_sensors * history_length;
+  {
+    Clock::time_point start = Clock::now();
+    Database db(path);
+    report("load (cached)", num_measurements, Clock::now() - start);
+  }
+  {
+    Clock::time_point start = Clock::now();
+    Database db(path, smartwater::HistoryMode::MAPPED);
+    report("load (mapped)", num_measurements, Clock::now() - start);
+    // Writes a snapshot when closed
+    db.enableCheckpoints(std::chrono::hours(1));
+  }
+  {
+    Clock::time_point start = Clock::now();
+    Database db(path, smartwater::HistoryMode::MAPPED);
+    report("load (mapped, snapshot)", num_measurements, Clock::now() - start);
+  }
+
+  // Reading
+  Database db(path, smartwater::HistoryMode::MAPPED);
+  const size_t num_queries = 1000;
+
+  QGramIndex<3> index;
+  for (const Sensor &sensor : sensors) {
+    index.addMapping(sensor.name, sensor.id);
+    index.addMapping(sensor.location_name, sensor.id);
+  }
+  std::vector<std::string> queries;
+  for (size_t i = 0; i < num_queries; i++) {
+    // Prefixes of names, as typed into the search box
+    const std::string &name = sensors[rand_r(&seed) % num_sensors].name;
+    queries.push_back(name.substr(0, 3 + rand_r(&seed) % name.size()));
+  }
+  Clock::time_point start = Clock::now();
+  for (const std::string &query : queries) {
+    sink += index.query(query, 10).size();
+  }
+  report("QGramIndex::query", num_queries, Clock::now() - start);
+
+  // ops are the distances computed
+  const size_t num_scans = std::max<size_t>(1, 1000000 / num_sensors);
+  start = Clock::now();
+  for (size_t i = 0; i < num_scans; i++) {
+    const Sensor &center = sensors[i % num_sensors];
+    size_t within = 0;
+    for (const Sensor &sensor : sensors) {
+      within += smartwater::greatCircleDist(center.longitude, center.latitude,
+                                            sensor.longitude,
+                                            sensor.latitude) <= 50000;
+    }
+    sink += within;
+  }
+  report("greatCircleDist", num_scans * num_sensors, Clock::now() - start);
+
+  start = Clock::now();
+  for (size_t i = 0; i < num_queries; i++) {
+    const Sensor &center = sensors[i % num_sensors];
+    sink +=
+        db.getSensorsInRadius(center.latitude, center.longitude, 50000).size();
+  }
+  report("getSensorsInRadius (50km)", num_queries, Clock::now() - start);
+
+  // ops are the sensors or measurements encoded
+  smartwater::JsonWriter writer;
+  start = Clock::now();
+  std::vector<Sensor> all = db.getSensorsCached();
+  writer.beginArray();
+  for (const Sensor &sensor : all) {
+    smartwater::Server::writeSensor(&writer, sensor,
+                                    db.getLastMeasurement(sensor.id));
+  }
+  writer.endArray();
+  sink += writer.size();
+  report("encodeSensors", all.size(), Clock::now() - start);
+
+  size_t num_encoded = 0;
+  start = Clock::now();
+  for (size_t i = 0; i < std::min<size_t>(num_queries, num_sensors); i++) {
+    writer.clear();
+    writer.beginArray();
+    smartwater::MeasurementRange range = db.getMeasurementsInRange(
+        sensors[i].id, 0, std::numeric_limits<uint64_t>::max(),
+        std::numeric_limits<size_t>::max());
+    for (const Measurement &measurement : range) {
+      smartwater::Server::writeMeasurement(&writer, measurement);
+    }
+    writer.endArray();
+    num_encoded += range.size();
+    sink += writer.size();
+  }
+  report("encodeHistory", num_encoded, Clock::now() - start);
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 3 && argc != 4) {
+    std::cout << "Expected 2 or 3 arguments, but got " << (argc - 1)
+              << std::endl;
+    std::cout << "Usage: " << argv[0]
+              << " <num_sensors,...> <history_length,...> [database]"
+              << std::endl;
+    return 1;
+  }
+  std::vector<size_t> sensor_counts = parseList(argv[1]);
+  std::vector<size_t> history_lengths = parseList(argv[2]);
+  std::string path = argc == 4 ? argv[3] : "./benchmark.db";
+  for (size_t num_sensors : sensor_counts) {
+    for (size_t history_length : history_lengths) {
+      if (num_sensors == 0) {
+        continue;
+      }
+      runBenchmarks(num_sensors, history_length, path);
+    }
+  }
+  removeDatabase(path);
+}
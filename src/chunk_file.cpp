@@ -0,0 +1,127 @@
+#include "chunk_file.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+namespace smartwater {
+
+ChunkFile::ChunkFile(const std::string &path)
+    : _path(path), _fd(-1), _base(nullptr), _file_size(0), _num_chunks(0) {
+  _fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (_fd < 0) {
+    throw std::runtime_error("Unable to open the file at " + path);
+  }
+  struct stat s;
+  if (fstat(_fd, &s) != 0) {
+    close(_fd);
+    throw std::runtime_error("Unable to stat the file at " + path);
+  }
+  // Files that were not closed cleanly still contain the zeroed tail of
+  // their last extent. Those chunks are unused but count towards the size.
+  _num_chunks = (s.st_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+  void *base = mmap(nullptr, MAX_FILE_SIZE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    close(_fd);
+    throw std::runtime_error("Unable to reserve address space for " + path);
+  }
+  _base = reinterpret_cast<char *>(base);
+  grow(_num_chunks * CHUNK_SIZE);
+}
+
+ChunkFile::~ChunkFile() {
+  sync();
+  // Drop the unused part of the last extent
+  if (ftruncate(_fd, _num_chunks * CHUNK_SIZE) != 0) {
+    LOG_WARN << "Unable to truncate " << _path << LOG_END;
+  }
+  munmap(_base, MAX_FILE_SIZE);
+  close(_fd);
+}
+
+uint64_t ChunkFile::numChunks() const { return _num_chunks; }
+
+char *ChunkFile::chunk(uint64_t idx) { return _base + idx * CHUNK_SIZE; }
+
+const char *ChunkFile::chunk(uint64_t idx) const {
+  return _base + idx * CHUNK_SIZE;
+}
+
+void ChunkFile::read(uint64_t idx, void *data) const {
+  std::memcpy(data, chunk(idx), CHUNK_SIZE);
+}
+
+void ChunkFile::write(uint64_t idx, const void *data) {
+  std::memcpy(chunk(idx), data, CHUNK_SIZE);
+}
+
+namespace {
+Counter &allocated_chunks = MetricsRegistry::global().counter(
+    "smartwater_chunks_allocated_total",
+    "The number of chunks allocated in database files");
+} // namespace
+
+uint64_t ChunkFile::allocate(uint64_t num_chunks) {
+  uint64_t idx = _num_chunks;
+  grow((idx + num_chunks) * CHUNK_SIZE);
+  _num_chunks += num_chunks;
+  allocated_chunks.add(num_chunks);
+  return idx;
+}
+
+void ChunkFile::truncate(uint64_t num_chunks) {
+  if (num_chunks >= _num_chunks) {
+    return;
+  }
+  // Shrinking the file discards the chunks, growing it back to the mapped
+  // size zeroes them for the next allocation.
+  if (ftruncate(_fd, num_chunks * CHUNK_SIZE) != 0 ||
+      ftruncate(_fd, _file_size) != 0) {
+    throw std::runtime_error("Unable to truncate the file at " + _path);
+  }
+  _num_chunks = num_chunks;
+}
+
+void ChunkFile::sync() {
+  if (_num_chunks > 0 && msync(_base, _num_chunks * CHUNK_SIZE, MS_SYNC)) {
+    LOG_ERROR << "Unable to sync " << _path << LOG_END;
+  }
+}
+
+void ChunkFile::sync(uint64_t idx) {
+  if (msync(chunk(idx), CHUNK_SIZE, MS_SYNC) != 0) {
+    LOG_ERROR << "Unable to sync chunk " << idx << " of " << _path << LOG_END;
+  }
+}
+
+void ChunkFile::grow(size_t min_size) {
+  if (min_size <= _file_size) {
+    return;
+  }
+  const size_t extent_size = EXTENT_CHUNKS * CHUNK_SIZE;
+  size_t new_size = ((min_size + extent_size - 1) / extent_size) * extent_size;
+  if (new_size > MAX_FILE_SIZE) {
+    throw std::runtime_error("The file at " + _path + " is too large");
+  }
+  if (ftruncate(_fd, new_size) != 0) {
+    throw std::runtime_error("Unable to grow the file at " + _path);
+  }
+  // Map the new part of the file directly behind the existing mapping
+  void *mapped = mmap(_base + _file_size, new_size - _file_size,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, _fd,
+                      _file_size);
+  if (mapped == MAP_FAILED) {
+    throw std::runtime_error("Unable to map the file at " + _path);
+  }
+  _file_size = new_size;
+}
+
+} // namespace smartwater
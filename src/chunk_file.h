@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace smartwater {
+
+// A file of fixed size chunks that is memory mapped. The file grows in large
+// extents, which are mapped into a single address range that is reserved up
+// front. Pointers returned by chunk() thus stay valid while the file grows.
+class ChunkFile {
+public:
+  static const size_t CHUNK_SIZE = 4096;
+  // The file grows by this many chunks (64MiB) at a time
+  static const size_t EXTENT_CHUNKS = 16384;
+  // The address space reserved for the mapping
+  static const size_t MAX_FILE_SIZE = size_t(1) << 40;
+
+  // Opens the file at path, creating it if it does not exist.
+  explicit ChunkFile(const std::string &path);
+  ~ChunkFile();
+
+  ChunkFile(const ChunkFile &other) = delete;
+  ChunkFile &operator=(const ChunkFile &other) = delete;
+
+  // The number of chunks in use
+  uint64_t numChunks() const;
+
+  char *chunk(uint64_t idx);
+  const char *chunk(uint64_t idx) const;
+
+  void read(uint64_t idx, void *data) const;
+  void write(uint64_t idx, const void *data);
+
+  // Appends num_chunks contiguous zeroed chunks and returns the index of the
+  // first one.
+  uint64_t allocate(uint64_t num_chunks = 1);
+  // Drops all chunks from num_chunks on.
+  void truncate(uint64_t num_chunks);
+
+  // Writes all modified chunks back to disk and waits for the writes to
+  // complete.
+  void sync();
+  // Only syncs a single chunk.
+  void sync(uint64_t idx);
+
+private:
+  void grow(size_t min_size);
+
+  std::string _path;
+  int _fd;
+  char *_base;
+  // The size of the file on disk, a multiple of the extent size.
+  size_t _file_size;
+  uint64_t _num_chunks;
+};
+
+} // namespace smartwater
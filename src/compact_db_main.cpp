@@ -0,0 +1,16 @@
+#include <iostream>
+
+#include "sharded_database.h"
+
+int main(int argc, char **argv) {
+  if (argc != 2 && argc != 3) {
+    std::cout << "Expected 1 or 2 arguments, but got " << (argc - 1)
+              << std::endl;
+    std::cout << "Usage: " << argv[0] << " <database> [shards]" << std::endl;
+    return 1;
+  }
+  size_t num_shards = argc == 3
+                          ? std::stoul(argv[2])
+                          : smartwater::ShardedDatabase::configuredShards();
+  smartwater::ShardedDatabase::compact(argv[1], num_shards);
+}
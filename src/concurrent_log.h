@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace smartwater {
+
+// An append only sequence for a single writer and any number of concurrent
+// readers. Elements are stored in blocks of doubling size and never move once
+// added. Readers see every element added before the size they loaded, without
+// taking any locks.
+template <typename T, size_t FIRST_BLOCK_BITS = 3> class ConcurrentLog {
+  static const size_t FIRST_BLOCK_SIZE = size_t(1) << FIRST_BLOCK_BITS;
+  static const size_t MAX_BLOCKS = 40;
+
+public:
+  ConcurrentLog() : _size(0) {
+    for (size_t i = 0; i < MAX_BLOCKS; i++) {
+      _blocks[i] = nullptr;
+    }
+  }
+
+  ~ConcurrentLog() {
+    for (size_t i = 0; i < MAX_BLOCKS; i++) {
+      delete[] _blocks[i];
+    }
+  }
+
+  ConcurrentLog(const ConcurrentLog &other) = delete;
+  ConcurrentLog &operator=(const ConcurrentLog &other) = delete;
+
+  // Only one thread may add elements at a time.
+  void push_back(T value) {
+    size_t i = _size.load(std::memory_order_relaxed);
+    size_t b = blockOf(i);
+    if (_blocks[b] == nullptr) {
+      _blocks[b] = new T[blockSize(b)];
+    }
+    _blocks[b][i - blockStart(b)] = std::move(value);
+    // Publish the element
+    _size.store(i + 1, std::memory_order_release);
+  }
+
+  size_t size() const { return _size.load(std::memory_order_acquire); }
+  bool empty() const { return size() == 0; }
+
+  // i has to be smaller than a size previously loaded by the reader.
+  const T &operator[](size_t i) const {
+    size_t b = blockOf(i);
+    return _blocks[b][i - blockStart(b)];
+  }
+
+  // Only the writer may modify published elements, readers must only access
+  // members that are safe to access concurrently (e.g. atomics).
+  T &mutableAt(size_t i) {
+    size_t b = blockOf(i);
+    return _blocks[b][i - blockStart(b)];
+  }
+
+  const T &back() const { return (*this)[size() - 1]; }
+
+  // Elements are stored contiguously within a block
+  static size_t blockOf(size_t i) {
+    // The position of the highest set bit
+    return 63 - __builtin_clzll((i >> FIRST_BLOCK_BITS) + 1);
+  }
+  static size_t blockStart(size_t b) {
+    return ((size_t(1) << b) - 1) << FIRST_BLOCK_BITS;
+  }
+  static size_t blockSize(size_t b) { return FIRST_BLOCK_SIZE << b; }
+  const T *blockData(size_t b) const { return _blocks[b]; }
+
+private:
+  T *_blocks[MAX_BLOCKS];
+  std::atomic<size_t> _size;
+};
+
+} // namespace smartwater
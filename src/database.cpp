@@ -1,46 +1,171 @@
 #include "database.h"
 
 #include "logger.h"
-#include <fstream>
+#include "metrics.h"
+#include "snapshot.h"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <functional>
 #include <iostream>
-#include <sys/stat.h>
+#include <limits>
+#include <thread>
+#include <unistd.h>
 
 namespace smartwater {
-Database::Database(const std::string &filename) : _use_journaling(false) {
-  bool is_db_initialized = true;
-  struct stat s;
-  int r = 0;
-  if ((r = stat(filename.c_str(), &s)) != 0) {
-    is_db_initialized = false;
-    // Ensure the file exists
-    std::ofstream out(filename);
+
+namespace {
+// The first bytes of every snapshot, the last two identify the version
+const char SNAPSHOT_MAGIC[8] = {'S', 'W', 'S', 'N', 'A', 'P', '0', '3'};
+// The snapshot and the log are stored next to the database file
+const char *SNAPSHOT_SUFFIX = ".snapshot";
+const char *LOG_SUFFIX = ".wal";
+
+template <typename T> void appendValue(std::vector<char> *buffer, T value) {
+  size_t offset = buffer->size();
+  buffer->resize(offset + sizeof(T));
+  std::memcpy(buffer->data() + offset, &value, sizeof(T));
+}
+
+template <typename T> T readValue(const std::vector<char> &buffer,
+                                  size_t *offset) {
+  T value;
+  std::memcpy(&value, buffer.data() + *offset, sizeof(T));
+  *offset += sizeof(T);
+  return value;
+}
+
+// Sets the gauge of every phase of a load to its duration
+class LoadPhaseTimer {
+public:
+  LoadPhaseTimer() : _start(std::chrono::steady_clock::now()) {}
+
+  void endPhase(const std::string &phase) {
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    MetricsRegistry::global()
+        .gauge("smartwater_load_phase_seconds",
+               "The duration of the phases of the last database load",
+               "phase=\"" + phase + "\"")
+        .set(std::chrono::duration<double>(now - _start).count());
+    _start = now;
   }
 
-  LOG_INFO << "operating on " << filename << LOG_END;
-  _db_file.open(filename, std::ios::in | std::ios::out | std::ios::binary);
-  if (!_db_file.is_open()) {
-    throw std::runtime_error("Unable to open the file at " + filename);
+private:
+  std::chrono::steady_clock::time_point _start;
+};
+
+Histogram &search_candidates = MetricsRegistry::global().histogram(
+    "smartwater_qgram_candidates",
+    "The number of sensors considered by a name search",
+    HistogramUnit::COUNT, "search=\"qgram\"");
+Histogram &fuzzy_search_candidates = MetricsRegistry::global().histogram(
+    "smartwater_qgram_candidates",
+    "The number of sensors considered by a name search",
+    HistogramUnit::COUNT, "search=\"fuzzy\"");
+Histogram &checkpoint_time = MetricsRegistry::global().histogram(
+    "smartwater_checkpoint_seconds",
+    "The time it takes to sync the database file and start a new log",
+    HistogramUnit::NANOSECONDS);
+Histogram &snapshot_time = MetricsRegistry::global().histogram(
+    "smartwater_snapshot_seconds",
+    "The time it takes to write a snapshot, including its checkpoint",
+    HistogramUnit::NANOSECONDS);
+
+template <typename T, size_t B>
+void writeLog(SnapshotWriter *writer, const ConcurrentLog<T, B> &log) {
+  typedef ConcurrentLog<T, B> Log;
+  size_t size = log.size();
+  writer->write<uint64_t>(size);
+  // Every block of the log is contiguous
+  for (size_t b = 0; Log::blockStart(b) < size; b++) {
+    size_t n = std::min(Log::blockSize(b), size - Log::blockStart(b));
+    writer->write(log.blockData(b), n * sizeof(T));
+  }
+}
+
+template <typename T, size_t B>
+void readLog(SnapshotReader *reader, ConcurrentLog<T, B> *log) {
+  uint64_t size = reader->read<uint64_t>();
+  for (uint64_t i = 0; i < size; i++) {
+    log->push_back(reader->read<T>());
   }
+}
+} // namespace
 
-  if (!is_db_initialized) {
+const uint64_t Database::ROLLUP_BUCKET_SIZES[NUM_ROLLUP_TIERS] = {86400};
+
+Database::Database(const std::string &filename, HistoryMode history_mode)
+    : _file(filename), _history_mode(history_mode),
+      _index(std::make_shared<SensorIndex>()), _loading(false),
+      _log(filename + LOG_SUFFIX), _compress(false), _group_commit(false),
+      _max_pending(0), _max_delay(0), _num_pending(0), _stop_flusher(false),
+      _snapshot_path(filename + SNAPSHOT_SUFFIX), _checkpoint_interval(0),
+      _last_checkpoint(std::chrono::steady_clock::now()) {
+  LOG_INFO << "operating on " << filename << LOG_END;
+  if (_file.numChunks() == 0) {
     init_db();
   } else {
     load();
   }
 }
 
-Database::~Database() {}
+Database::~Database() {
+  if (_flusher.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(_write_mutex);
+      _stop_flusher = true;
+    }
+    _flusher_wake.notify_one();
+    _flusher.join();
+  }
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  if (_checkpoint_interval.count() > 0) {
+    // Allows the next start to skip loading the tables
+    autoCheckpoint();
+    return;
+  }
+  try {
+    // Leaves the next start nothing to replay
+    checkpointLog();
+  } catch (const std::exception &e) {
+    LOG_ERROR << "Unable to checkpoint the log: " << e.what() << LOG_END;
+  }
+}
 
 double Database::getLastMeasurement(uint64_t id) {
-  if (id < _measurements.size() && _measurements[id].size() > 0) {
-    return _measurements[id].back().height;
-  } else {
+  if (id >= _measurements.size()) {
+    return 0;
+  }
+  const MeasurementSeries &series = *_measurements[id];
+  uint64_t count = series.count.load(std::memory_order_acquire);
+  if (count == 0) {
     return 0;
   }
+  return seriesRange(series, count, count - 1, count)[0].height;
 }
 
-std::vector<Sensor> Database::searchForSensors(std::string name, size_t limit) {
-  std::vector<uint64_t> ids = _sensor_search_index.query(name, limit);
+uint64_t Database::getLastTimestamp(uint64_t id) {
+  if (id >= _measurements.size()) {
+    return 0;
+  }
+  const MeasurementSeries &series = *_measurements[id];
+  uint64_t count = series.count.load(std::memory_order_acquire);
+  if (count == 0) {
+    return 0;
+  }
+  return seriesRange(series, count, count - 1, count)[0].timestamp;
+}
+
+std::vector<Sensor>
+Database::searchForSensors(std::string name, size_t limit,
+                           std::vector<size_t> *num_shared) {
+  std::vector<uint64_t> ids;
+  size_t num_candidates = 0;
+  ids = sensorIndex()->search_index.query(name, limit, &num_candidates,
+                                          num_shared);
+  search_candidates.record(num_candidates);
   std::vector<Sensor> filtered;
   filtered.reserve(std::min(ids.size(), limit));
   for (uint64_t id : ids) {
@@ -52,17 +177,501 @@ std::vector<Sensor> Database::searchForSensors(std::string name, size_t limit) {
   return filtered;
 }
 
-const std::vector<Sensor> &Database::getSensorsCached() { return _sensors; }
+std::vector<Sensor>
+Database::searchForSensorsFuzzy(const std::string &name, int max_distance,
+                                size_t limit, std::vector<size_t> *distances,
+                                std::vector<uint64_t> *counts) {
+  if (max_distance < 0) {
+    // Allow about one typo every four characters
+    max_distance = std::min<int>(3, name.size() / 4);
+  }
+  std::vector<std::pair<uint64_t, size_t>> matches;
+  size_t num_candidates = 0;
+  matches = sensorIndex()->search_index.fuzzyQuery(name, max_distance,
+                                                   &num_candidates);
+  fuzzy_search_candidates.record(num_candidates);
+  // Rank by the distance, then by the number of measurements
+  struct Match {
+    size_t distance;
+    uint64_t popularity;
+    uint64_t id;
+  };
+  std::vector<Match> ranked;
+  ranked.reserve(matches.size());
+  for (const std::pair<uint64_t, size_t> &match : matches) {
+    uint64_t count =
+        _measurements[match.first]->count.load(std::memory_order_acquire);
+    ranked.push_back(Match{match.second, count, match.first});
+  }
+  limit = std::min(limit, ranked.size());
+  std::partial_sort(ranked.begin(), ranked.begin() + limit, ranked.end(),
+                    [](const Match &m1, const Match &m2) {
+                      if (m1.distance != m2.distance) {
+                        return m1.distance < m2.distance;
+                      }
+                      if (m1.popularity != m2.popularity) {
+                        return m1.popularity > m2.popularity;
+                      }
+                      return m1.id < m2.id;
+                    });
+  std::vector<Sensor> sensors;
+  sensors.reserve(limit);
+  for (size_t i = 0; i < limit; i++) {
+    sensors.push_back(_sensors[ranked[i].id]);
+    if (distances != nullptr) {
+      distances->push_back(ranked[i].distance);
+    }
+    if (counts != nullptr) {
+      counts->push_back(ranked[i].popularity);
+    }
+  }
+  return sensors;
+}
+
+std::vector<PrefixIndex::Completion>
+Database::completeSensorNames(const std::string &prefix, size_t limit) {
+  return sensorIndex()->names.complete(prefix, limit);
+}
+
+std::vector<Sensor> Database::getSensorsInRadius(double latitude,
+                                                double longitude, double dist) {
+  std::vector<uint64_t> ids =
+      sensorIndex()->positions.queryRadius(latitude, longitude, dist);
+  // Keep the order of getSensorsCached
+  std::sort(ids.begin(), ids.end());
+  std::vector<Sensor> filtered;
+  filtered.reserve(ids.size());
+  for (uint64_t id : ids) {
+    filtered.push_back(_sensors[id]);
+  }
+  return filtered;
+}
+
+std::vector<Sensor> Database::getNearestSensors(double latitude,
+                                               double longitude, size_t k) {
+  std::vector<uint64_t> ids =
+      sensorIndex()->positions.queryNearest(latitude, longitude, k);
+  std::vector<Sensor> nearest;
+  nearest.reserve(ids.size());
+  for (uint64_t id : ids) {
+    nearest.push_back(_sensors[id]);
+  }
+  return nearest;
+}
+
+std::vector<TileIndex::Marker>
+Database::getSensorMarkers(double min_latitude, double min_longitude,
+                           double max_latitude, double max_longitude,
+                           int zoom) {
+  return sensorIndex()->tiles.query(min_latitude, min_longitude,
+                                    max_latitude, max_longitude, zoom);
+}
+
+std::vector<Sensor> Database::getSensorsCached() {
+  size_t num_sensors = _sensors.size();
+  std::vector<Sensor> sensors;
+  sensors.reserve(num_sensors);
+  for (size_t i = 0; i < num_sensors; i++) {
+    sensors.push_back(_sensors[i]);
+  }
+  return sensors;
+}
 
 const Sensor &Database::getSensorByIdCached(uint64_t id) {
   return _sensors[id];
 }
 
-const std::vector<Measurement> &Database::getMeasurementsCached(uint64_t id) {
-  return _measurements[id];
+MeasurementRange Database::getMeasurementsCached(uint64_t id) {
+  if (id >= _measurements.size()) {
+    return MeasurementRange();
+  }
+  const MeasurementSeries &series = *_measurements[id];
+  uint64_t count = series.count.load(std::memory_order_acquire);
+  return seriesRange(series, count, 0, count);
+}
+
+MeasurementRange Database::getMeasurementsInRange(uint64_t id, uint64_t from,
+                                                  uint64_t to, size_t limit) {
+  MeasurementRange range;
+  if (id >= _measurements.size() || from > to) {
+    return range;
+  }
+  const MeasurementSeries &series = *_measurements[id];
+  uint64_t count = series.count.load(std::memory_order_acquire);
+  if (!series.sorted.load(std::memory_order_acquire)) {
+    // Materialize the matching measurements
+    std::shared_ptr<std::vector<Measurement>> matches =
+        std::make_shared<std::vector<Measurement>>();
+    for (const Measurement &m : seriesRange(series, count, 0, count)) {
+      if (m.timestamp >= from && m.timestamp <= to) {
+        matches->push_back(m);
+      }
+    }
+    size_t skip = matches->size() > limit ? matches->size() - limit : 0;
+    range.append(matches->data() + skip, matches->size() - skip);
+    range.hold(matches);
+    return range;
+  }
+
+  uint64_t begin = searchSeries(series, count, from, false);
+  uint64_t end = searchSeries(series, count, to, true);
+  if (end <= begin) {
+    return range;
+  }
+  if (end - begin > limit) {
+    begin = end - limit;
+  }
+  return seriesRange(series, count, begin, end);
+}
+
+std::vector<Rollup> Database::getAggregatedMeasurements(uint64_t id,
+                                                       uint64_t from,
+                                                       uint64_t to,
+                                                       uint64_t bucket_size,
+                                                       size_t limit) {
+  BucketAggregator aggregator(bucket_size);
+  if (id >= _measurements.size() || from > to || bucket_size == 0) {
+    return aggregator.buckets();
+  }
+  const MeasurementSeries &series = *_measurements[id];
+  const size_t no_limit = std::numeric_limits<size_t>::max();
+  // Load the state of the rollups before checking the order, rollups are only
+  // published while the series is sorted.
+  size_t num_closed[NUM_ROLLUP_TIERS];
+  for (int i = 0; i < NUM_ROLLUP_TIERS; i++) {
+    num_closed[i] = series.rollups[i].size();
+  }
+  if (!series.sorted.load(std::memory_order_acquire)) {
+    // The aggregator requires ordered input
+    std::shared_ptr<std::vector<Measurement>> sorted =
+        std::make_shared<std::vector<Measurement>>();
+    MeasurementRange range = getMeasurementsInRange(id, from, to, no_limit);
+    sorted->assign(range.begin(), range.end());
+    std::stable_sort(sorted->begin(), sorted->end(),
+                     [](const Measurement &m1, const Measurement &m2) {
+                       return m1.timestamp < m2.timestamp;
+                     });
+    MeasurementRange sorted_range;
+    sorted_range.append(sorted->data(), sorted->size());
+    aggregator.add(sorted_range);
+  } else {
+    // Use the coarsest rollup tier that evenly divides the buckets
+    int tier = -1;
+    for (int i = NUM_ROLLUP_TIERS - 1; i >= 0 && tier < 0; i--) {
+      if (bucket_size % ROLLUP_BUCKET_SIZES[i] == 0 && num_closed[i] > 0) {
+        tier = i;
+      }
+    }
+    MeasurementRange all = getMeasurementsCached(id);
+    if (tier < 0 || all.empty()) {
+      aggregator.add(getMeasurementsInRange(id, from, to, no_limit));
+    } else {
+      // Clamp the range to the actual data to avoid overflows
+      from = std::max(from, all.front().timestamp);
+      to = std::min(to, all.back().timestamp);
+      uint64_t t = ROLLUP_BUCKET_SIZES[tier];
+      const ConcurrentLog<Rollup> &rollups = series.rollups[tier];
+      // Only complete rollups that lie entirely within the range can be used,
+      // the partial buckets at both ends are aggregated from the raw data.
+      uint64_t head_end = from % t == 0 ? from : from + (t - from % t);
+      uint64_t tail_start = (to + 1) - (to + 1) % t;
+      tail_start =
+          std::min(tail_start, rollups[num_closed[tier] - 1].start + t);
+      if (from > to) {
+        // There is no data in the range
+      } else if (head_end >= tail_start) {
+        aggregator.add(getMeasurementsInRange(id, from, to, no_limit));
+      } else {
+        if (from < head_end) {
+          aggregator.add(getMeasurementsInRange(id, from, head_end - 1,
+                                                no_limit));
+        }
+        // Find the first rollup starting at or after head_end
+        size_t lo = 0;
+        size_t hi = num_closed[tier];
+        while (lo < hi) {
+          size_t mid = (lo + hi) / 2;
+          if (rollups[mid].start < head_end) {
+            lo = mid + 1;
+          } else {
+            hi = mid;
+          }
+        }
+        for (; lo < num_closed[tier] && rollups[lo].start < tail_start; lo++) {
+          aggregator.add(rollups[lo]);
+        }
+        if (tail_start <= to) {
+          aggregator.add(getMeasurementsInRange(id, tail_start, to, no_limit));
+        }
+      }
+    }
+  }
+
+  const std::vector<Rollup> &buckets = aggregator.buckets();
+  size_t skip = buckets.size() > limit ? buckets.size() - limit : 0;
+  return std::vector<Rollup>(buckets.begin() + skip, buckets.end());
+}
+
+MeasurementRange Database::seriesRange(const MeasurementSeries &series,
+                                       uint64_t count, uint64_t begin,
+                                       uint64_t end) {
+  MeasurementRange range;
+  end = std::min(end, count);
+  if (begin >= end) {
+    return range;
+  }
+  if (_history_mode == HistoryMode::CACHED) {
+    // Every block of the log is contiguous
+    typedef ConcurrentLog<Measurement> Log;
+    size_t b = Log::blockOf(begin);
+    while (begin < end) {
+      size_t block_start = Log::blockStart(b);
+      size_t block_end =
+          std::min<uint64_t>(block_start + Log::blockSize(b), end);
+      range.append(series.cached.blockData(b) + (begin - block_start),
+                   block_end - begin);
+      begin = block_end;
+      b++;
+    }
+    return range;
+  }
+
+  // Every chunk is contiguous
+  size_t num_chunks = numSeriesChunks(series, count);
+  // Find the chunk holding begin
+  size_t lo = 0;
+  size_t hi = num_chunks;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (series.chunks[mid].first_index <= begin) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  for (size_t c = lo; c < num_chunks && begin < end; c++) {
+    const ChunkEntry &entry = series.chunks[c];
+    uint64_t chunk_end =
+        c + 1 < num_chunks ? series.chunks[c + 1].first_index : count;
+    chunk_end = std::min(chunk_end, end);
+    const DataChunk *chunk = dataChunk(entry.idx);
+    if (entry.compressed) {
+      std::shared_ptr<std::vector<Measurement>> decoded =
+          decodeChunk(chunk, chunk_end - entry.first_index);
+      range.append(decoded->data() + (begin - entry.first_index),
+                   chunk_end - begin);
+      range.hold(decoded);
+    } else {
+      range.append(chunk->data +
+                       (begin - entry.first_index) * sizeof(Measurement),
+                   chunk_end - begin);
+    }
+    begin = chunk_end;
+  }
+  return range;
+}
+
+uint64_t Database::searchSeries(const MeasurementSeries &series,
+                                uint64_t count, uint64_t timestamp,
+                                bool upper) {
+  uint64_t lo = 0;
+  uint64_t hi = count;
+  if (_history_mode == HistoryMode::MAPPED) {
+    // Use the directory to find the only chunk that has to be searched, the
+    // last one starting before the timestamp.
+    size_t num_chunks = numSeriesChunks(series, count);
+    size_t c_lo = 0;
+    size_t c_hi = num_chunks;
+    while (c_lo < c_hi) {
+      size_t mid = (c_lo + c_hi) / 2;
+      uint64_t t = series.chunks[mid].first_timestamp;
+      if (t < timestamp || (upper && t == timestamp)) {
+        c_lo = mid + 1;
+      } else {
+        c_hi = mid;
+      }
+    }
+    if (c_lo == 0) {
+      return 0;
+    }
+    const ChunkEntry &entry = series.chunks[c_lo - 1];
+    lo = entry.first_index;
+    hi = c_lo < num_chunks ? series.chunks[c_lo].first_index : count;
+    const DataChunk *chunk = dataChunk(entry.idx);
+    if (entry.compressed) {
+      // Compressed chunks can only be decoded front to back
+      MeasurementCodec codec;
+      size_t offset = 0;
+      for (; lo < hi; lo++) {
+        Measurement m;
+        offset += codec.decode(chunk->data + offset, &m);
+        if (!(m.timestamp < timestamp || (upper && m.timestamp == timestamp))) {
+          break;
+        }
+      }
+      return lo;
+    }
+    while (lo < hi) {
+      uint64_t mid = (lo + hi) / 2;
+      uint64_t t = readMeasurement(chunk, mid - entry.first_index).timestamp;
+      if (t < timestamp || (upper && t == timestamp)) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  while (lo < hi) {
+    uint64_t mid = (lo + hi) / 2;
+    uint64_t t = series.cached[mid].timestamp;
+    if (t < timestamp || (upper && t == timestamp)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+size_t Database::numSeriesChunks(const MeasurementSeries &series,
+                                 uint64_t count) {
+  // The writer may already have published a chunk for measurements that are
+  // not part of count yet.
+  size_t num_chunks = series.chunks.size();
+  while (num_chunks > 0 && series.chunks[num_chunks - 1].first_index >= count) {
+    num_chunks--;
+  }
+  return num_chunks;
+}
+
+Measurement Database::readMeasurement(const DataChunk *chunk, size_t i) {
+  Measurement m;
+  std::memcpy(&m, chunk->data + i * sizeof(Measurement), sizeof(Measurement));
+  return m;
+}
+
+std::shared_ptr<std::vector<Measurement>>
+Database::decodeChunk(const DataChunk *chunk, size_t num_measurements) {
+  std::shared_ptr<std::vector<Measurement>> decoded =
+      std::make_shared<std::vector<Measurement>>(num_measurements);
+  MeasurementCodec codec;
+  size_t offset = 0;
+  for (size_t i = 0; i < num_measurements; i++) {
+    offset += codec.decode(chunk->data + offset, &(*decoded)[i]);
+  }
+  return decoded;
+}
+
+void Database::recordMeasurement(MeasurementSeries *series, uint64_t chunk_idx,
+                                 const Measurement &m) {
+  uint64_t count = series->count.load(std::memory_order_relaxed);
+  if (count > 0 && m.timestamp < series->last_timestamp) {
+    series->sorted.store(false, std::memory_order_release);
+  }
+  series->last_timestamp = m.timestamp;
+  addToRollups(series, m);
+  if (_history_mode == HistoryMode::CACHED) {
+    series->cached.push_back(m);
+  }
+  if (series->chunks.empty() || series->chunks.back().idx != chunk_idx) {
+    ChunkEntry entry;
+    entry.idx = chunk_idx;
+    entry.first_index = count;
+    entry.first_timestamp = m.timestamp;
+    entry.compressed =
+        (dataChunk(chunk_idx)->bytes_used & COMPRESSED_CHUNK) != 0;
+    series->chunks.push_back(entry);
+  }
+  // Publish the measurement
+  series->count.store(count + 1, std::memory_order_release);
+}
+
+void Database::addToRollups(MeasurementSeries *series, const Measurement &m) {
+  if (!series->sorted.load(std::memory_order_relaxed)) {
+    return;
+  }
+  for (int i = 0; i < NUM_ROLLUP_TIERS; i++) {
+    uint64_t start = m.timestamp - m.timestamp % ROLLUP_BUCKET_SIZES[i];
+    Rollup &open = series->open_rollups[i];
+    if (open.count == 0) {
+      open.init(start, m);
+    } else if (open.start == start) {
+      open.add(m);
+    } else {
+      // The bucket is complete
+      series->rollups[i].push_back(open);
+      open.init(start, m);
+    }
+  }
+}
+
+void Database::SensorIndex::insert(const Sensor &sensor) {
+  uuid_to_id[sensor.dev_uid] = sensor.id;
+  search_index.addMapping(sensor.name, sensor.id);
+  search_index.addMapping(sensor.location_name, sensor.id);
+  names.insert(sensor.name, sensor.id);
+  names.insert(sensor.location_name, sensor.id);
+  positions.insert(sensor.id, sensor.latitude, sensor.longitude);
+  tiles.insert(sensor.id, sensor.latitude, sensor.longitude);
+}
+
+void Database::indexSensor(const Sensor &sensor) {
+  if (_loading) {
+    _index->insert(sensor);
+    return;
+  }
+  std::shared_ptr<SensorIndex> index;
+  for (size_t i = 0; i < _retired_indices.size(); i++) {
+    if (_retired_indices[i].index.use_count() != 1) {
+      continue;
+    }
+    // No query holds the index and none can get it anymore, so it is safe to
+    // change. Pairs with the release by the last query.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    index = std::move(_retired_indices[i].index);
+    for (const Sensor &missing : _retired_indices[i].missing) {
+      index->insert(missing);
+    }
+    index->tiles.copyLastMeasurements(_index->tiles);
+    _retired_indices.erase(_retired_indices.begin() + i);
+    break;
+  }
+  if (!index) {
+    // Costs time linear in the number of sensors
+    index = std::make_shared<SensorIndex>(*_index);
+  }
+  index->insert(sensor);
+  for (RetiredIndex &retired : _retired_indices) {
+    retired.missing.push_back(sensor);
+  }
+  RetiredIndex previous;
+  previous.index = std::atomic_exchange(&_index, index);
+  previous.missing.push_back(sensor);
+  _retired_indices.push_back(std::move(previous));
+  if (_retired_indices.size() > MAX_RETIRED_INDICES) {
+    _retired_indices.erase(_retired_indices.begin());
+  }
+}
+
+std::shared_ptr<const Database::SensorIndex> Database::sensorIndex() const {
+  return std::atomic_load(&_index);
+}
+
+uint64_t Database::addSensor(const Sensor &new_sensor) {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  Sensor sensor = new_sensor;
+  sensor.id = _sensors.size();
+  std::vector<char> record;
+  serializeSensor(sensor, &record);
+  logRecord(WriteAheadLog::ADD_SENSOR, record.data(), record.size());
+  storeSensor(sensor);
+  commitStaged();
+  return sensor.id;
 }
 
-void Database::addSensor(const Sensor &sensor) {
+void Database::storeSensor(const Sensor &sensor) {
   // serialize the string
   std::vector<char> serialized;
   std::vector<char> buff;
@@ -72,151 +681,433 @@ void Database::addSensor(const Sensor &sensor) {
   std::memcpy(serialized.data(), &s_len, 4);
   std::memcpy(serialized.data() + 4, buff.data(), buff.size());
 
-  size_t to_write = serialized.size();
-  char *src = serialized.data();
+  LOG_TRACE << "Writing a sensor with " << buff.size() << " bytes" << LOG_END;
 
-  LOG_DEBUG << "Writing a sensor with " << buff.size() << " bytes" << std::endl;
-
-  // Get the data chunk the sensor should be written to
-  PositionedDataChunk *dc = &_table_last_chunks[0];
-  while (to_write > 0) {
-    LOG_DEBUG << to_write << " bytes left to write" << LOG_END;
-    // Figure out how many bytes we want to write into the current chunk
-    size_t num_remaining = NUM_DATA_BYTES - dc->data.bytes_used;
-    size_t write_size = std::min(num_remaining, to_write);
-    LOG_DEBUG << "Wrote " << write_size << " bytes at pos "
-              << dc->data.bytes_used << LOG_END;
-    std::memcpy(dc->data.data + dc->data.bytes_used, src, write_size);
-
-    // Update the various values tracking write progress
-    src += write_size;
-    to_write -= write_size;
-    dc->data.bytes_used += write_size;
-    writeFileChunk(&dc->data, dc->idx);
-    if (to_write > 0) {
-      // We need a new chunk for the rest of the data
-      DataChunk new_chunk;
-      new_chunk.bytes_used = 0;
-      new_chunk.next_chunk = 0;
-      size_t block_idx = newFileBlock(&new_chunk);
-      // Build the link
-      dc->data.next_chunk = block_idx;
-      writeFileChunk(&dc->data, dc->idx);
-      // Update the latest entry in the linked list
-      dc->data = new_chunk;
-      dc->idx = block_idx;
-    }
-  }
+  appendToTable(0, serialized.data(), serialized.size());
 
   // Add a new table to store the sensors measurements
   addTable();
 
+  // Publish the sensor before making it findable through the indices
+  _measurements.push_back(
+      std::unique_ptr<MeasurementSeries>(new MeasurementSeries()));
   _sensors.push_back(sensor);
+  indexSensor(sensor);
+}
 
-  _uuid_to_id[sensor.dev_uid] = sensor.id;
-  _sensor_search_index.addMapping(sensor.name, sensor.id);
-  _sensor_search_index.addMapping(sensor.location_name, sensor.id);
+bool Database::addMeasurement(uint64_t id, const Measurement &measurement) {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  if (!stageMeasurement(id, measurement)) {
+    return false;
+  }
+  commitStaged();
+  return true;
 }
 
-void Database::addMeasurement(uint64_t id, const Measurement &measurement) {
+std::vector<bool> Database::addMeasurements(
+    const std::vector<std::pair<uint64_t, Measurement>> &measurements) {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  std::vector<bool> added(measurements.size());
+  // Late measurements within the batch are reordered instead of rejected.
+  // Unstamped measurements are ordered as if they were stamped now.
+  uint64_t now = time(NULL);
+  std::vector<uint64_t> timestamps(measurements.size());
+  std::vector<size_t> order(measurements.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    uint64_t timestamp = measurements[i].second.timestamp;
+    timestamps[i] = timestamp == UNSTAMPED ? now : timestamp;
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&timestamps](size_t a, size_t b) {
+                     return timestamps[a] < timestamps[b];
+                   });
+  for (size_t i : order) {
+    added[i] = stageMeasurement(measurements[i].first, measurements[i].second);
+  }
+  commitStaged();
+  return added;
+}
 
-  uint64_t table_id = id + 1;
-  if (table_id >= _table_last_chunks.size()) {
+bool Database::stageMeasurement(uint64_t id, Measurement measurement) {
+  if (id >= _sensors.size()) {
     LOG_ERROR << "There is no table for measurements for the sensor with id "
               << id << LOG_END;
-    return;
+    return false;
+  }
+  const MeasurementSeries &series = *_measurements[id];
+  bool has_measurements = series.count.load(std::memory_order_relaxed) > 0;
+  if (measurement.timestamp == UNSTAMPED) {
+    // Stamped under the write lock, so concurrent writers of a sensor can
+    // not overtake each other, and never before the last measurement
+    measurement.timestamp = time(NULL);
+    if (has_measurements) {
+      measurement.timestamp =
+          std::max(measurement.timestamp, series.last_timestamp);
+    }
+  } else if (has_measurements &&
+             measurement.timestamp < series.last_timestamp) {
+    LOG_LIMITED(WARN, 1) << "Rejecting a measurement of the sensor with id "
+                         << id << " older than its last one" << LOG_END;
+    return false;
   }
-  PositionedDataChunk *dc = &_table_last_chunks[table_id];
-  if (NUM_DATA_BYTES < sizeof(Measurement) + dc->data.bytes_used) {
-    // We need a new chunk for the table
-    DataChunk new_chunk;
-    new_chunk.bytes_used = 0;
-    new_chunk.next_chunk = 0;
-    size_t block_idx = newFileBlock(&new_chunk);
+  char record[sizeof(uint64_t) + sizeof(Measurement)];
+  std::memcpy(record, &id, sizeof(uint64_t));
+  std::memcpy(record + sizeof(uint64_t), &measurement, sizeof(Measurement));
+  logRecord(WriteAheadLog::ADD_MEASUREMENT, record, sizeof(record));
+  storeMeasurement(id, measurement);
+  return true;
+}
+
+void Database::storeMeasurement(uint64_t id, const Measurement &measurement) {
+  MeasurementSeries *series = _measurements.mutableAt(id).get();
+  appendMeasurement(id + 1, series, measurement);
+  recordMeasurement(series, _table_last_chunks[id + 1], measurement);
+  // Only the writer changes the structure of the tile index, and the last
+  // measurements are safe to update while it is read.
+  _index->tiles.setLastMeasurement(id, measurement.height);
+}
+
+void Database::logRecord(WriteAheadLog::RecordType type, const void *data,
+                         size_t size) {
+  _log.append(type, data, size);
+  if (_group_commit) {
+    if (_num_pending == 0) {
+      _first_pending = std::chrono::steady_clock::now();
+      _flusher_wake.notify_one();
+    }
+    _num_pending++;
+  }
+}
+
+void Database::commitStaged() {
+  // Written records survive a crash of the process, group commit only
+  // batches the syncs that make them survive a crash of the system
+  _log.flush();
+  if (!_group_commit || _num_pending >= _max_pending ||
+      std::chrono::steady_clock::now() - _first_pending >= _max_delay) {
+    syncFile();
+  }
+  if (_log.size() >= MAX_LOG_SIZE) {
+    checkpointLog();
+  }
+  if (_checkpoint_interval.count() > 0 &&
+      std::chrono::steady_clock::now() - _last_checkpoint >=
+          _checkpoint_interval) {
+    autoCheckpoint();
+  }
+}
+
+void Database::enableGroupCommit(size_t max_pending,
+                                 std::chrono::milliseconds max_delay) {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  _group_commit = true;
+  _max_pending = max_pending;
+  _max_delay = max_delay;
+  if (!_flusher.joinable()) {
+    _flusher = std::thread([this]() { runFlusher(); });
+  }
+}
+
+void Database::runFlusher() {
+  std::unique_lock<std::mutex> lock(_write_mutex);
+  while (!_stop_flusher) {
+    if (_num_pending == 0) {
+      _flusher_wake.wait(lock);
+      continue;
+    }
+    std::chrono::steady_clock::time_point deadline =
+        _first_pending + _max_delay;
+    if (std::chrono::steady_clock::now() < deadline) {
+      _flusher_wake.wait_until(lock, deadline);
+      continue;
+    }
+    try {
+      syncFile();
+    } catch (const std::exception &e) {
+      LOG_ERROR << "Unable to sync the log: " << e.what() << LOG_END;
+    }
+  }
+}
+
+void Database::enableCompression() {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  _compress = true;
+}
+
+void Database::enableCheckpoints(std::chrono::seconds interval) {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  _checkpoint_interval = interval;
+}
+
+void Database::checkpoint() {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  writeSnapshot();
+}
+
+void Database::flush() {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  syncFile();
+}
+
+void Database::syncFile() {
+  if (_num_pending > 0) {
+    LOG_DEBUG << "Flushing " << _num_pending << " changes" << LOG_END;
+  }
+  _num_pending = 0;
+  _log.sync();
+}
+
+void Database::checkpointLog() {
+  ScopedTimer timer(&checkpoint_time);
+  // The log is synced first, so the checkpoint never covers changes that
+  // would be lost by a crash before the new log is in place.
+  syncFile();
+  _file.sync();
+  std::vector<char> checkpoint;
+  appendValue<uint64_t>(&checkpoint, _file.numChunks());
+  appendValue<uint64_t>(&checkpoint, _table_last_chunks.size());
+  for (uint64_t idx : _table_last_chunks) {
+    appendValue(&checkpoint, idx);
+    appendValue(&checkpoint, dataChunk(idx)->bytes_used);
+  }
+  _log.reset(checkpoint.data(), checkpoint.size());
+  LOG_DEBUG << "Checkpointed the log" << LOG_END;
+}
+
+bool Database::rollbackToCheckpoint() {
+  std::vector<char> checkpoint;
+  if (!_log.readCheckpoint(&checkpoint)) {
+    return false;
+  }
+  size_t offset = 0;
+  const size_t table_size = sizeof(uint64_t) + sizeof(uint16_t);
+  uint64_t num_chunks = 0;
+  uint64_t num_tables = 0;
+  if (checkpoint.size() >= 2 * sizeof(uint64_t)) {
+    num_chunks = readValue<uint64_t>(checkpoint, &offset);
+    num_tables = readValue<uint64_t>(checkpoint, &offset);
+  }
+  if (num_chunks < 3 || num_chunks > _file.numChunks() ||
+      checkpoint.size() - offset != num_tables * table_size) {
+    throw std::runtime_error("The log does not match the database");
+  }
+
+  // Chunks are only written to again when they are at the end of a chain, so
+  // cutting the chains of the index and of every table behind their state at
+  // the checkpoint restores it. Only values that differ are written, so a
+  // clean database is not modified.
+  uint64_t remaining = num_tables;
+  for (uint64_t idx = 0;;) {
+    IndexChunk *index = reinterpret_cast<IndexChunk *>(_file.chunk(idx));
+    if (index->num_tables > remaining) {
+      index->num_tables = remaining;
+    }
+    remaining -= index->num_tables;
+    if (index->next_chunk >= num_chunks) {
+      index->next_chunk = 0;
+    }
+    idx = index->next_chunk;
+    if (idx == 0) {
+      break;
+    }
+  }
+  for (uint64_t i = 0; i < num_tables; i++) {
+    uint64_t tail = readValue<uint64_t>(checkpoint, &offset);
+    uint16_t bytes_used = readValue<uint16_t>(checkpoint, &offset);
+    if (tail >= num_chunks) {
+      throw std::runtime_error("The log does not match the database");
+    }
+    for (uint64_t idx = tail; idx != 0;) {
+      DataChunk *chunk = dataChunk(idx);
+      // The chunks behind the tail are reserved and empty
+      uint16_t used = idx == tail ? bytes_used : 0;
+      if (chunk->bytes_used != used) {
+        chunk->bytes_used = used;
+      }
+      if (chunk->next_chunk >= num_chunks) {
+        chunk->next_chunk = 0;
+      }
+      idx = chunk->next_chunk;
+    }
+  }
+  if (_file.numChunks() > num_chunks) {
+    LOG_DEBUG << "Dropping " << _file.numChunks() - num_chunks
+              << " chunks allocated after the last checkpoint" << LOG_END;
+  }
+  _file.truncate(num_chunks);
+  return true;
+}
+
+void Database::replayLog() {
+  _log.replay([this](WriteAheadLog::RecordType type, const char *data,
+                     size_t size) {
+    if (type == WriteAheadLog::ADD_SENSOR) {
+      Sensor sensor;
+      deserializeSensor(&sensor, data);
+      if (sensor.id != _sensors.size()) {
+        throw std::runtime_error("The log does not match the database");
+      }
+      storeSensor(sensor);
+    } else if (type == WriteAheadLog::ADD_MEASUREMENT &&
+               size == sizeof(uint64_t) + sizeof(Measurement)) {
+      uint64_t id;
+      Measurement measurement;
+      std::memcpy(&id, data, sizeof(uint64_t));
+      std::memcpy(&measurement, data + sizeof(uint64_t), sizeof(Measurement));
+      if (id >= _sensors.size()) {
+        throw std::runtime_error("The log does not match the database");
+      }
+      storeMeasurement(id, measurement);
+    } else {
+      throw std::runtime_error("Unknown record in the log");
+    }
+  });
+}
+
+void Database::appendToTable(uint64_t table_id, const void *data,
+                             size_t size) {
+  const char *src = reinterpret_cast<const char *>(data);
+  size_t to_write = size;
+  uint64_t idx = _table_last_chunks[table_id];
+  DataChunk *dc = dataChunk(idx);
+  while (to_write > 0) {
+    if (dc->bytes_used == NUM_DATA_BYTES ||
+        (table_id != 0 && NUM_DATA_BYTES < to_write + dc->bytes_used)) {
+      // We need a new chunk for the table. Measurements never span chunks,
+      // sensors are split across as many chunks as required.
+      idx = extendTable(table_id);
+      dc = dataChunk(idx);
+    }
+    // Figure out how many bytes we want to write into the current chunk
+    size_t num_remaining = NUM_DATA_BYTES - dc->bytes_used;
+    size_t write_size = std::min(num_remaining, to_write);
+    std::memcpy(dc->data + dc->bytes_used, src, write_size);
+    dc->bytes_used += write_size;
+
+    // Update the various values tracking write progress
+    src += write_size;
+    to_write -= write_size;
+  }
+}
+
+void Database::appendMeasurement(uint64_t table_id, MeasurementSeries *series,
+                                 const Measurement &m) {
+  uint64_t idx = _table_last_chunks[table_id];
+  DataChunk *dc = dataChunk(idx);
+  size_t used = dc->bytes_used & ~COMPRESSED_CHUNK;
+  // Empty chunks take the format of new chunks, all others keep theirs
+  bool compressed =
+      used == 0 ? _compress : (dc->bytes_used & COMPRESSED_CHUNK) != 0;
+  // The codec is only updated once the measurement is written
+  MeasurementCodec codec = series->codec;
+  char encoded[MeasurementCodec::MAX_ENCODED_SIZE];
+  size_t size = compressed ? codec.encode(m, encoded) : sizeof(Measurement);
+  if (used + size > NUM_DATA_BYTES) {
+    // Measurements never span chunks
+    idx = extendTable(table_id);
+    dc = dataChunk(idx);
+    used = 0;
+    compressed = _compress;
+    codec.reset();
+    size = compressed ? codec.encode(m, encoded) : sizeof(Measurement);
+  }
+  if (!compressed) {
+    std::memcpy(encoded, &m, sizeof(Measurement));
+  }
+  std::memcpy(dc->data + used, encoded, size);
+  dc->bytes_used = (compressed ? COMPRESSED_CHUNK : 0) | (used + size);
+  series->codec = codec;
+}
+
+uint64_t Database::extendTable(uint64_t table_id) {
+  uint64_t idx = _table_last_chunks[table_id];
+  uint64_t next_idx = dataChunk(idx)->next_chunk;
+  if (next_idx == 0) {
+    // Reserve a run of contiguous chunks, so the table can be read
+    // sequentially. They are linked right away, which keeps the reservation
+    // in the file. Unused chunks at the end of a table are simply empty.
+    uint64_t num_chunks = extentSize(table_id);
+    next_idx = _file.allocate(num_chunks);
+    for (uint64_t i = next_idx; i + 1 < next_idx + num_chunks; i++) {
+      dataChunk(i)->next_chunk = i + 1;
+    }
     // Build the link
-    dc->data.next_chunk = block_idx;
-    writeFileChunk(&dc->data, dc->idx);
-    // Update the latest entry in the linked list
-    dc->data = new_chunk;
-    dc->idx = block_idx;
+    dataChunk(idx)->next_chunk = next_idx;
   }
-  std::memcpy(dc->data.data + dc->data.bytes_used, &measurement,
-              sizeof(Measurement));
-  dc->data.bytes_used += sizeof(Measurement);
-  writeFileChunk(&dc->data, dc->idx);
+  // Update the latest entry in the linked list
+  _table_last_chunks[table_id] = next_idx;
+  return next_idx;
+}
 
-  if (_measurements.size() < id + 1) {
-    _measurements.resize(id + 1);
+uint64_t Database::extentSize(uint64_t table_id) {
+  if (table_id == 0) {
+    return MAX_EXTENT_CHUNKS;
   }
-  _measurements[id].push_back(measurement);
+  // Extents grow with the table, so the tables of sensors that rarely report
+  // do not waste space.
+  uint64_t num_chunks = _measurements[table_id - 1]->chunks.size();
+  return std::max<uint64_t>(1,
+                            std::min<uint64_t>(num_chunks, MAX_EXTENT_CHUNKS));
+}
+
+Database::DataChunk *Database::dataChunk(uint64_t idx) {
+  return reinterpret_cast<DataChunk *>(_file.chunk(idx));
 }
 
 void Database::init_db() {
   LOG_INFO << "Initializing the database" << LOG_END;
+  // A snapshot left behind by a previous database does not apply, the log is
+  // replaced below
+  unlink(_snapshot_path.c_str());
   // Create the first index chunk
   _index_chunks.emplace_back();
   _index_chunks.back().idx = 0;
   _index_chunks.back().data.next_chunk = 0;
   _index_chunks.back().data.num_tables = 0;
 
-  // Manually init three chunks to enable journaling
-  {
-    // One chunk is for the base index, the other two are used for journaling
-    std::vector<char> buff(CHUNK_SIZE * 3, 0);
-    _db_file.seekp(0);
-    _db_file.write(buff.data(), buff.size());
+  // One chunk is for the base index, the other two are reserved (they used to
+  // hold a journal)
+  for (int i = 0; i < 3; i++) {
+    _file.allocate();
   }
 
-  writeFileChunk(&_index_chunks[0].data, 0);
+  _file.write(0, &_index_chunks[0].data);
 
   addTable();
-  _db_file.flush();
+  checkpointLog();
   LOG_INFO << "Database initialized" << LOG_END;
 }
 
 uint64_t Database::sensorFromUID(const std::string &dev_uuid) {
-  std::unordered_map<std::string, uint64_t>::iterator it =
-      _uuid_to_id.find(dev_uuid);
-  if (it == _uuid_to_id.end()) {
+  std::shared_ptr<const SensorIndex> index = sensorIndex();
+  std::unordered_map<std::string, uint64_t>::const_iterator it =
+      index->uuid_to_id.find(dev_uuid);
+  if (it == index->uuid_to_id.end()) {
     return -1;
   }
   return it->second;
 }
 
-uint64_t Database::newFileBlock(void *data) {
-  _db_file.seekg(0, std::ios::end);
-  uint64_t new_block_index =
-      (static_cast<size_t>(_db_file.tellg()) + 1) / CHUNK_SIZE;
-  if (data != nullptr) {
-    writeFileChunk(data, new_block_index);
-  } else {
-    std::vector<char> buf(CHUNK_SIZE, 0);
-    writeFileChunk(buf.data(), new_block_index);
+std::vector<uint64_t>
+Database::sensorsFromUIDs(const std::vector<std::string> &dev_uuids) {
+  std::shared_ptr<const SensorIndex> index = sensorIndex();
+  std::vector<uint64_t> ids(dev_uuids.size());
+  for (size_t i = 0; i < dev_uuids.size(); i++) {
+    std::unordered_map<std::string, uint64_t>::const_iterator it =
+        index->uuid_to_id.find(dev_uuids[i]);
+    ids[i] = it == index->uuid_to_id.end() ? -1 : it->second;
   }
-  return new_block_index;
+  return ids;
 }
 
-void Database::writeFileChunk(void *data, uint64_t idx) {
-  if (_use_journaling) {
-    // Copy the current state into the journal cache
-    char data[CHUNK_SIZE];
-    _db_file.seekg(idx * CHUNK_SIZE);
-    _db_file.read(data, CHUNK_SIZE);
-    _db_file.seekp(2 * CHUNK_SIZE);
-    _db_file.write(data, CHUNK_SIZE);
-
-    // Mark the chunk as dirty
-    _journal_chunk.dirty_chunk = idx;
-    writeFileChunk(&_journal_chunk, 1);
-  }
-  // Write the changse
-  _db_file.seekp(idx * CHUNK_SIZE);
-  _db_file.write(reinterpret_cast<char *>(data), CHUNK_SIZE);
-  if (_use_journaling) {
-    // Clear the journal
-    _journal_chunk.dirty_chunk = 1;
-    writeFileChunk(&_journal_chunk, 1);
+uint64_t Database::newFileBlock(const void *data) {
+  // Newly allocated chunks are zeroed, which is a valid empty data chunk
+  uint64_t new_block_index = _file.allocate();
+  if (data != nullptr) {
+    _file.write(new_block_index, data);
   }
+  return new_block_index;
 }
 
 uint64_t Database::addTable() {
@@ -230,54 +1121,37 @@ uint64_t Database::addTable() {
     PositionedIndexChunk *last_chunk = &_index_chunks[last_chunk_idx];
     _index_chunks.back().data.num_tables = 0;
     _index_chunks.back().data.next_chunk = 0;
-    _db_file.seekp(0, std::ios::end);
     uint64_t new_block_index = newFileBlock(&_index_chunks.back().data);
     last_chunk->data.next_chunk = new_block_index;
     LOG_DEBUG << "Set a new block idx " << new_block_index << " for index "
               << last_chunk->idx << LOG_END;
-    writeFileChunk(&last_chunk->data, last_chunk->idx);
+    _file.write(last_chunk->idx, &last_chunk->data);
     _index_chunks.back().idx = new_block_index;
   }
   PositionedIndexChunk *last_chunk = &_index_chunks.back();
 
-  _table_last_chunks.emplace_back();
-  _table_last_chunks.back().data.bytes_used = 0;
-  std::memset(_table_last_chunks.back().data.data, 0, NUM_DATA_BYTES);
-  _table_last_chunks.back().data.next_chunk = 0;
-
-  uint64_t new_id = newFileBlock(&_table_last_chunks.back().data);
-  _table_last_chunks.back().idx = new_id;
+  uint64_t new_id = newFileBlock();
+  _table_last_chunks.push_back(new_id);
   last_chunk->data.tables[last_chunk->data.num_tables] = new_id;
   last_chunk->data.num_tables++;
   // Update the index on disk
-  writeFileChunk(&last_chunk->data, last_chunk->idx);
+  _file.write(last_chunk->idx, &last_chunk->data);
   return (_index_chunks.size() - 1) * NUM_TABLES_INDEX +
          last_chunk->data.num_tables - 1;
 }
 
 void Database::load() {
   LOG_INFO << "Loading the database" << LOG_END;
-  if (_use_journaling) {
-    LOG_DEBUG << "Checking the Journal" << LOG_END;
-    _db_file.seekg(CHUNK_SIZE);
-    _db_file.read(reinterpret_cast<char *>(&_journal_chunk), CHUNK_SIZE);
-    if (_journal_chunk.dirty_chunk != 1) {
-      LOG_WARN << "The journal is not clean, fixing..." << LOG_END;
-      char data[CHUNK_SIZE];
-      _db_file.read(data, CHUNK_SIZE);
-      _db_file.seekp(_journal_chunk.dirty_chunk * CHUNK_SIZE);
-      _db_file.write(data, CHUNK_SIZE);
-      _journal_chunk.dirty_chunk = 1;
-      _db_file.seekp(CHUNK_SIZE);
-      _db_file.write(reinterpret_cast<char *>(&_journal_chunk), CHUNK_SIZE);
-      LOG_WARN << "Reset chunk " << _journal_chunk.dirty_chunk << LOG_END;
-    }
-  }
-
-  _db_file.seekg(0);
+  LoadPhaseTimer phases;
+  _loading = true;
+  if (!rollbackToCheckpoint()) {
+    LOG_INFO << "There is no log, loading the file as is" << LOG_END;
+  }
+  phases.endPhase("rollback");
+
   _index_chunks.clear();
   _index_chunks.resize(1);
-  _db_file.read(reinterpret_cast<char *>(&_index_chunks[0].data), CHUNK_SIZE);
+  _file.read(0, &_index_chunks[0].data);
   _index_chunks[0].idx = 0;
   uint64_t num_tables = _index_chunks.back().data.num_tables;
 
@@ -287,10 +1161,8 @@ void Database::load() {
               << " is followed by " << _index_chunks.back().data.next_chunk
               << LOG_END;
     uint64_t idx = _index_chunks.back().data.next_chunk;
-    _db_file.seekg(_index_chunks.back().data.next_chunk * CHUNK_SIZE);
     _index_chunks.emplace_back();
-    _db_file.read(reinterpret_cast<char *>(&_index_chunks.back().data),
-                  CHUNK_SIZE);
+    _file.read(idx, &_index_chunks.back().data);
     _index_chunks.back().idx = idx;
     num_tables += _index_chunks.back().data.num_tables;
   }
@@ -298,46 +1170,129 @@ void Database::load() {
 
   _table_last_chunks.resize(num_tables);
   if (num_tables > 0) {
-    _sensors.reserve(num_tables - 1);
-    _measurements.resize(num_tables - 1);
+    for (uint64_t i = 0; i + 1 < num_tables; i++) {
+      _measurements.push_back(
+          std::unique_ptr<MeasurementSeries>(new MeasurementSeries()));
+    }
   } else {
     LOG_WARN << "no tables found (there should always be at least one)"
              << LOG_END;
   }
 
-  for (size_t idx_id = 0; idx_id < _index_chunks.size(); idx_id++) {
-    IndexChunk &idx = _index_chunks[idx_id].data;
-    for (size_t table_offset = 0; table_offset < idx.num_tables;
-         table_offset++) {
-      // This buffer is used for loading block spanning data;
-      std::vector<char> buffer;
-      // Load the table
-      uint64_t table_id = (idx_id * 510) + table_offset;
-      uint64_t block_id = idx.tables[table_offset];
-      LOG_DEBUG << "Loading table " << table_id << " block id" << block_id
-                << LOG_END;
-      // Load all of the linked chunks that make up the table
-      while (block_id != 0) {
-        _db_file.seekg(block_id * CHUNK_SIZE);
-        _db_file.read(
-            reinterpret_cast<char *>(&_table_last_chunks[table_id].data),
-            CHUNK_SIZE);
-        _table_last_chunks[table_id].idx = block_id;
-        if (table_id == 0) {
-          onSensorBlockLoaded(_table_last_chunks[table_id].data, &buffer);
-        } else {
-          onMeasurementBlockLoaded(_table_last_chunks[table_id].data, table_id);
-        }
-        block_id = _table_last_chunks[table_id].data.next_chunk;
+  // The chunk and offset every table is loaded from. Without a snapshot that
+  // is the beginning of every table, otherwise only data appended after the
+  // snapshot is replayed.
+  std::vector<uint64_t> start_chunks;
+  start_chunks.reserve(num_tables);
+  for (const PositionedIndexChunk &idx : _index_chunks) {
+    start_chunks.insert(start_chunks.end(), idx.data.tables,
+                        idx.data.tables + idx.data.num_tables);
+  }
+  std::vector<size_t> start_offsets(num_tables, 0);
+  phases.endPhase("index");
+  if (restoreSnapshot(&start_chunks, &start_offsets)) {
+    LOG_INFO << "Restored " << _sensors.size() << " sensors from the snapshot"
+             << LOG_END;
+  }
+  phases.endPhase("snapshot");
+
+  // Tables are independent once the index is read. The measurement tables are
+  // distributed over a pool of workers that read the chunks directly from the
+  // mapping. The sensor table is loaded by this thread first, so the sensors
+  // and their indices are built in the same order as by a serial load.
+  std::atomic<uint64_t> next_table(1);
+  // The first error of any thread, rethrown once all workers are done
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  std::function<void()> fail = [&start_chunks, &next_table, &error,
+                                &error_mutex]() {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!error) {
+      error = std::current_exception();
+    }
+    // The other workers stop after their current table
+    next_table = start_chunks.size();
+  };
+  std::function<void()> work = [this, &start_chunks, &start_offsets,
+                                &next_table, &fail]() {
+    try {
+      for (uint64_t table_id = next_table++; table_id < start_chunks.size();
+           table_id = next_table++) {
+        loadTable(table_id, start_chunks[table_id], start_offsets[table_id]);
       }
+    } catch (...) {
+      fail();
+    }
+  };
+  size_t num_workers = std::max(1u, std::thread::hardware_concurrency()) - 1;
+  num_workers = std::min<size_t>(num_workers, start_chunks.size() / 2);
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < num_workers; i++) {
+    workers.emplace_back(work);
+  }
+  try {
+    if (!start_chunks.empty()) {
+      loadTable(0, start_chunks[0], start_offsets[0]);
+    }
+  } catch (...) {
+    fail();
+  }
+  work();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  for (uint64_t id = 0; id < _measurements.size(); id++) {
+    if (_measurements[id]->count.load(std::memory_order_relaxed) > 0) {
+      _index->tiles.setLastMeasurement(id, getLastMeasurement(id));
     }
   }
+  phases.endPhase("tables");
+  // Redo the changes since the checkpoint and make them part of the file
+  replayLog();
+  _loading = false;
+  phases.endPhase("replay");
+  checkpointLog();
+  phases.endPhase("checkpoint");
   LOG_INFO << "Done Loading" << LOG_END;
 }
 
-void Database::onSensorBlockLoaded(const DataChunk &chunk,
+void Database::loadTable(uint64_t table_id, uint64_t start_chunk,
+                         size_t offset) {
+  if (table_id > 0 && _history_mode == HistoryMode::CACHED) {
+    MeasurementSeries *series = _measurements.mutableAt(table_id - 1).get();
+    if (series->cached.size() < series->count.load(std::memory_order_relaxed)) {
+      // The series was restored from the snapshot
+      fillCache(series);
+    }
+  }
+  // This buffer is used for loading block spanning data;
+  std::vector<char> buffer;
+  uint64_t block_id = start_chunk;
+  LOG_DEBUG << "Loading table " << table_id << " block id" << block_id
+            << LOG_END;
+  // Walk the linked chunks that make up the table in the mapped file
+  while (block_id != 0) {
+    const DataChunk *chunk = dataChunk(block_id);
+    // Empty chunks behind the tail are reserved for the table
+    if (block_id == start_chunk ||
+        (chunk->bytes_used & ~COMPRESSED_CHUNK) != 0) {
+      _table_last_chunks[table_id] = block_id;
+    }
+    if (table_id == 0) {
+      onSensorBlockLoaded(*chunk, offset, &buffer);
+    } else {
+      onMeasurementBlockLoaded(*chunk, block_id, table_id, offset);
+    }
+    offset = 0;
+    block_id = chunk->next_chunk;
+  }
+}
+
+void Database::onSensorBlockLoaded(const DataChunk &chunk, size_t offset,
                                    std::vector<char> *buffer) {
-  size_t offset = 0;
 
   while (offset < chunk.bytes_used) {
     LOG_DEBUG << "Loop offset " << offset << LOG_END;
@@ -375,12 +1330,10 @@ void Database::onSensorBlockLoaded(const DataChunk &chunk,
       LOG_DEBUG << "Found a sensor with " << buffer->size()
                 << "bytes in the buffer" << LOG_END;
       // We read the entire sensor
-      _sensors.emplace_back();
-      deserializeSensor(&_sensors.back(), buffer->data() + 4);
-      const Sensor &s = _sensors.back();
-      _uuid_to_id[s.dev_uid] = s.id;
-      _sensor_search_index.addMapping(s.name, s.id);
-      _sensor_search_index.addMapping(s.location_name, s.id);
+      Sensor s;
+      deserializeSensor(&s, buffer->data() + 4);
+      _sensors.push_back(s);
+      indexSensor(s);
       buffer->clear();
     } else {
       // We reached the end of the data
@@ -390,15 +1343,285 @@ void Database::onSensorBlockLoaded(const DataChunk &chunk,
 }
 
 void Database::onMeasurementBlockLoaded(const DataChunk &chunk,
-                                        uint64_t table_id) {
+                                        uint64_t block_id, uint64_t table_id,
+                                        size_t offset) {
+  MeasurementSeries *series = _measurements.mutableAt(table_id - 1).get();
+  if (chunk.bytes_used & COMPRESSED_CHUNK) {
+    size_t size = chunk.bytes_used & ~COMPRESSED_CHUNK;
+    // Leaves the codec in the state for appending to the chunk. When
+    // replaying after a snapshot the codec state was restored.
+    if (offset == 0) {
+      series->codec.reset();
+    }
+    while (offset < size) {
+      Measurement m;
+      offset += series->codec.decode(chunk.data + offset, &m);
+      recordMeasurement(series, block_id, m);
+    }
+    return;
+  }
   uint16_t num_measurements = chunk.bytes_used / sizeof(Measurement);
-  std::vector<Measurement> &measurements = _measurements[table_id - 1];
-  size_t measurement_offset = measurements.size();
-  measurements.resize(measurements.size() + num_measurements);
-  for (size_t i = 0; i < num_measurements; i++) {
-    measurements[measurement_offset + i] =
-        *reinterpret_cast<const Measurement *>(chunk.data +
-                                               (i * sizeof(Measurement)));
+  // The chunk is a single page, which is already loaded for reading its
+  // header, so checking the order is cheap.
+  for (size_t i = offset / sizeof(Measurement); i < num_measurements; i++) {
+    recordMeasurement(series, block_id, readMeasurement(&chunk, i));
+  }
+}
+
+void Database::fillCache(MeasurementSeries *series) {
+  uint64_t count = series->count.load(std::memory_order_relaxed);
+  size_t num_chunks = series->chunks.size();
+  for (size_t c = 0; c < num_chunks; c++) {
+    const ChunkEntry &entry = series->chunks[c];
+    uint64_t end =
+        c + 1 < num_chunks ? series->chunks[c + 1].first_index : count;
+    const DataChunk *chunk = dataChunk(entry.idx);
+    if (entry.compressed) {
+      std::shared_ptr<std::vector<Measurement>> decoded =
+          decodeChunk(chunk, end - entry.first_index);
+      for (const Measurement &m : *decoded) {
+        series->cached.push_back(m);
+      }
+    } else {
+      for (size_t i = 0; i < end - entry.first_index; i++) {
+        series->cached.push_back(readMeasurement(chunk, i));
+      }
+    }
+  }
+}
+
+void Database::writeSnapshot() {
+  ScopedTimer timer(&snapshot_time);
+  // Everything in the snapshot has to be durable in the database file
+  checkpointLog();
+  SnapshotWriter writer(_snapshot_path);
+  writer.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+
+  // The tail of every table
+  writer.write<uint64_t>(_table_last_chunks.size());
+  for (uint64_t idx : _table_last_chunks) {
+    writer.write(idx);
+    writer.write(dataChunk(idx)->bytes_used);
+  }
+
+  // The sensors and their indices. Only the writer modifies them, so they
+  // can be read without locking.
+  writer.write<uint64_t>(_sensors.size());
+  std::vector<char> buffer;
+  for (size_t i = 0; i < _sensors.size(); i++) {
+    serializeSensor(_sensors[i], &buffer);
+    writer.write<uint64_t>(buffer.size());
+    writer.write(buffer.data(), buffer.size());
+  }
+  writer.write<uint64_t>(_index->uuid_to_id.size());
+  for (const std::pair<const std::string, uint64_t> &p : _index->uuid_to_id) {
+    writer.writeString(p.first);
+    writer.write(p.second);
+  }
+  _index->search_index.serialize(&writer);
+
+  // The in memory state of every series, except for the cached measurements
+  for (size_t i = 0; i < _measurements.size(); i++) {
+    const MeasurementSeries &series = *_measurements[i];
+    writer.write(series.count.load(std::memory_order_relaxed));
+    writer.write<uint8_t>(series.sorted.load(std::memory_order_relaxed));
+    writer.write(series.last_timestamp);
+    writer.write(series.codec);
+    writer.write(series.open_rollups);
+    for (int t = 0; t < NUM_ROLLUP_TIERS; t++) {
+      writeLog(&writer, series.rollups[t]);
+    }
+    writeLog(&writer, series.chunks);
+  }
+  writer.commit();
+  _last_checkpoint = std::chrono::steady_clock::now();
+  LOG_INFO << "Wrote a snapshot of " << _sensors.size() << " sensors"
+           << LOG_END;
+}
+
+void Database::autoCheckpoint() {
+  try {
+    writeSnapshot();
+  } catch (const std::exception &e) {
+    // The data itself is safe in the database file
+    LOG_ERROR << "Checkpoint failed: " << e.what() << LOG_END;
+    _last_checkpoint = std::chrono::steady_clock::now();
+  }
+}
+
+bool Database::restoreSnapshot(std::vector<uint64_t> *start_chunks,
+                               std::vector<size_t> *start_offsets) {
+  SnapshotReader reader(_snapshot_path);
+  if (!reader.valid()) {
+    return false;
+  }
+  char magic[sizeof(SNAPSHOT_MAGIC)];
+  reader.read(magic, sizeof(magic));
+  if (std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+    LOG_WARN << "Unknown snapshot format, loading all tables" << LOG_END;
+    return false;
+  }
+
+  // The tables may only have grown since the snapshot was taken
+  uint64_t num_tables = reader.read<uint64_t>();
+  if (num_tables == 0 || num_tables > start_chunks->size()) {
+    LOG_WARN << "The snapshot does not match the database" << LOG_END;
+    return false;
+  }
+  std::vector<uint64_t> tails(num_tables);
+  std::vector<uint16_t> tails_used(num_tables);
+  for (uint64_t i = 0; i < num_tables; i++) {
+    tails[i] = reader.read<uint64_t>();
+    tails_used[i] = reader.read<uint16_t>();
+    if (tails[i] >= _file.numChunks()) {
+      LOG_WARN << "The snapshot does not match the database" << LOG_END;
+      return false;
+    }
+    uint16_t used = dataChunk(tails[i])->bytes_used;
+    uint16_t was_used = tails_used[i];
+    bool format_changed =
+        (used & COMPRESSED_CHUNK) != (was_used & COMPRESSED_CHUNK);
+    // Empty chunks take their format with the first write
+    if ((format_changed && (was_used & ~COMPRESSED_CHUNK) != 0) ||
+        (used & ~COMPRESSED_CHUNK) < (was_used & ~COMPRESSED_CHUNK)) {
+      LOG_WARN << "The snapshot does not match the database" << LOG_END;
+      return false;
+    }
+  }
+
+  // From here on the snapshot is known to match, errors are fatal
+  uint64_t num_sensors = reader.read<uint64_t>();
+  if (num_sensors != num_tables - 1) {
+    throw std::runtime_error("The snapshot " + _snapshot_path +
+                             " is inconsistent");
+  }
+  std::vector<char> buffer;
+  for (uint64_t i = 0; i < num_sensors; i++) {
+    buffer.resize(reader.read<uint64_t>());
+    reader.read(buffer.data(), buffer.size());
+    Sensor s;
+    deserializeSensor(&s, buffer.data());
+    _sensors.push_back(s);
+    // The spatial indices and the prefix index are cheap to rebuild
+    _index->positions.insert(s.id, s.latitude, s.longitude);
+    _index->tiles.insert(s.id, s.latitude, s.longitude);
+    _index->names.insert(s.name, s.id);
+    _index->names.insert(s.location_name, s.id);
+  }
+  uint64_t num_uids = reader.read<uint64_t>();
+  _index->uuid_to_id.reserve(num_uids);
+  for (uint64_t i = 0; i < num_uids; i++) {
+    std::string uid = reader.readString();
+    _index->uuid_to_id[uid] = reader.read<uint64_t>();
+  }
+  _index->search_index.deserialize(&reader);
+
+  for (uint64_t i = 0; i + 1 < num_tables; i++) {
+    MeasurementSeries *series = _measurements.mutableAt(i).get();
+    series->count.store(reader.read<uint64_t>(), std::memory_order_relaxed);
+    series->sorted.store(reader.read<uint8_t>() != 0,
+                         std::memory_order_relaxed);
+    series->last_timestamp = reader.read<uint64_t>();
+    series->codec = reader.read<MeasurementCodec>();
+    reader.read(series->open_rollups, sizeof(series->open_rollups));
+    for (int t = 0; t < NUM_ROLLUP_TIERS; t++) {
+      readLog(&reader, &series->rollups[t]);
+    }
+    readLog(&reader, &series->chunks);
+  }
+
+  for (uint64_t i = 0; i < num_tables; i++) {
+    (*start_chunks)[i] = tails[i];
+    (*start_offsets)[i] = tails_used[i] & ~COMPRESSED_CHUNK;
+  }
+  return true;
+}
+
+void Database::compact(const std::string &filename) {
+  if (access(filename.c_str(), F_OK) != 0) {
+    throw std::runtime_error("There is no database at " + filename);
+  }
+  {
+    // Opening and closing the database applies the log
+    Database db(filename, HistoryMode::MAPPED);
+  }
+  std::string compacted_filename = filename + ".compact";
+  unlink(compacted_filename.c_str());
+  {
+    ChunkFile source(filename);
+    if (source.numChunks() == 0) {
+      throw std::runtime_error("There is no database at " + filename);
+    }
+    ChunkFile target(compacted_filename);
+
+    // Read the first chunk of every table from the index
+    std::vector<uint64_t> first_chunks;
+    uint64_t idx = 0;
+    do {
+      IndexChunk index;
+      source.read(idx, &index);
+      first_chunks.insert(first_chunks.end(), index.tables,
+                          index.tables + index.num_tables);
+      idx = index.next_chunk;
+    } while (idx != 0);
+    LOG_INFO << "Compacting " << first_chunks.size() << " tables" << LOG_END;
+
+    // The first index chunk and the reserved chunks keep their place, the
+    // other index chunks follow right behind them.
+    size_t num_index_chunks =
+        std::max<size_t>(1, (first_chunks.size() + NUM_TABLES_INDEX - 1) /
+                                NUM_TABLES_INDEX);
+    std::vector<uint64_t> index_chunks(1, 0);
+    target.allocate(3);
+    for (size_t i = 1; i < num_index_chunks; i++) {
+      index_chunks.push_back(target.allocate());
+    }
+
+    // Copy every table into a contiguous run of chunks
+    std::vector<uint64_t> new_first_chunks(first_chunks.size());
+    for (size_t t = 0; t < first_chunks.size(); t++) {
+      uint64_t prev_idx = 0;
+      for (uint64_t src_idx = first_chunks[t]; src_idx != 0;) {
+        DataChunk chunk;
+        source.read(src_idx, &chunk);
+        src_idx = chunk.next_chunk;
+        // Reserved chunks are dropped, but every table keeps a chunk
+        if ((chunk.bytes_used & ~COMPRESSED_CHUNK) == 0 && prev_idx != 0) {
+          continue;
+        }
+        chunk.next_chunk = 0;
+        uint64_t dst_idx = target.allocate();
+        target.write(dst_idx, &chunk);
+        if (prev_idx == 0) {
+          new_first_chunks[t] = dst_idx;
+        } else {
+          reinterpret_cast<DataChunk *>(target.chunk(prev_idx))->next_chunk =
+              dst_idx;
+        }
+        prev_idx = dst_idx;
+      }
+    }
+
+    for (size_t i = 0; i < num_index_chunks; i++) {
+      IndexChunk index;
+      size_t first_table = i * NUM_TABLES_INDEX;
+      index.num_tables = std::min<size_t>(NUM_TABLES_INDEX,
+                                          first_chunks.size() - first_table);
+      std::copy(new_first_chunks.begin() + first_table,
+                new_first_chunks.begin() + first_table + index.num_tables,
+                index.tables);
+      index.next_chunk = i + 1 < num_index_chunks ? index_chunks[i + 1] : 0;
+      target.write(index_chunks[i], &index);
+    }
+    LOG_INFO << "Compacted " << source.numChunks() << " chunks into "
+             << target.numChunks() << LOG_END;
+  }
+  // The snapshot and the checkpoint of the log refer to the old chunks. The
+  // log is empty, so the old file is still consistent without it.
+  unlink((filename + SNAPSHOT_SUFFIX).c_str());
+  unlink((filename + LOG_SUFFIX).c_str());
+  if (rename(compacted_filename.c_str(), filename.c_str()) != 0) {
+    throw std::runtime_error("Unable to replace " + filename);
   }
 }
 
@@ -1,22 +1,75 @@
 #pragma once
 
+#include "aggregation.h"
+#include "chunk_file.h"
+#include "concurrent_log.h"
+#include "measurement_codec.h"
+#include "measurement_range.h"
+#include "octree.h"
+#include "prefix_index.h"
 #include "qgram.h"
 #include "sensor.h"
-#include <fstream>
+#include "tile_index.h"
+#include "write_ahead_log.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace smartwater {
+
+// How the measurement history of the sensors is kept in memory
+enum class HistoryMode {
+  // Every measurement is copied into memory when loading
+  CACHED,
+  // Only the locations of the chunks of every table are kept in memory, the
+  // measurements are read from the mapped file.
+  MAPPED
+};
+
 class Database {
   // The database is stored in a custom file. The file is composed of 4k chunks.
   // The first chunk is an index. A data chunk contains entries for exactly one
-  // table.
+  // table. The file is memory mapped, data is appended by writing directly
+  // into the mapped tail chunk of a table.
+  //
+  // Every change is first appended to a write ahead log of logical records.
+  // The mapped file is only synced at checkpoints, which start a new log that
+  // records the tail of every table. On startup the file is rolled back to
+  // the last checkpoint, dropping any chunks the system wrote back since,
+  // and the records of the log are applied again.
+  //
+  // The database supports a single writer and any number of concurrent
+  // readers. Writers are serialized by a mutex. Sensors and measurements are
+  // kept in append only logs that publish new entries atomically, so reading
+  // them never blocks. The sensor indices are published as immutable
+  // snapshots. Adding a sensor extends a copy and swaps it in, so queries
+  // never wait for the writer and the writer never waits for queries.
 
-  static const int CHUNK_SIZE = 4096;
+  static const int CHUNK_SIZE = ChunkFile::CHUNK_SIZE;
   static const int NUM_TABLES_INDEX = CHUNK_SIZE / 8 - 2;
   static const int NUM_DATA_BYTES = CHUNK_SIZE - 8 - 2;
+  // Set in bytes_used of measurement chunks that store their measurements
+  // compressed with a MeasurementCodec instead of as raw records.
+  static const uint16_t COMPRESSED_CHUNK = 0x8000;
+  // Tables reserve runs of up to this many contiguous chunks at a time
+  static constexpr uint64_t MAX_EXTENT_CHUNKS = 16;
+  // The file is checkpointed once the log holds this many bytes
+  static constexpr uint64_t MAX_LOG_SIZE = uint64_t(64) << 20;
+  // Every sensor keeps precomputed rollups of its history for each of these
+  // bucket sizes (daily). The rollups stay in memory, so finer buckets like
+  // hours are aggregated from the measurements, which keeps the rollups small
+  // next to the history that HistoryMode::MAPPED leaves on disk.
+  static const int NUM_ROLLUP_TIERS = 1;
+  static const uint64_t ROLLUP_BUCKET_SIZES[NUM_ROLLUP_TIERS];
 
   struct IndexChunk {
     uint64_t num_tables = 0;
@@ -24,6 +77,55 @@ class Database {
     uint64_t next_chunk = 0;
   };
 
+  // An entry in the time directory of a table
+  struct ChunkEntry {
+    uint64_t idx;
+    // The position of the first measurement of the chunk in the series
+    uint64_t first_index;
+    uint64_t first_timestamp;
+    bool compressed;
+  };
+
+  // The in memory history of a single sensor. New measurements become visible
+  // to readers once count is updated.
+  struct MeasurementSeries {
+    std::atomic<uint64_t> count{0};
+    // The data chunks of the table and the time their data starts at
+    ConcurrentLog<ChunkEntry> chunks;
+    // A copy of all measurements (HistoryMode::CACHED)
+    ConcurrentLog<Measurement> cached;
+    // Whether the measurements are ordered by their timestamps. Range queries
+    // on unordered series fall back to a linear scan, and the rollups are no
+    // longer maintained.
+    std::atomic<bool> sorted{true};
+    // The rollups of all completed buckets
+    ConcurrentLog<Rollup> rollups[NUM_ROLLUP_TIERS];
+
+    // Only accessed by the writer
+    Rollup open_rollups[NUM_ROLLUP_TIERS] = {};
+    uint64_t last_timestamp = 0;
+    // The state of the codec after the last measurement of a compressed tail
+    // chunk
+    MeasurementCodec codec;
+  };
+
+  // The indices over the sensors
+  struct SensorIndex {
+    std::unordered_map<std::string, uint64_t> uuid_to_id;
+    QGramIndex<3> search_index;
+    PrefixIndex names;
+    Octree positions;
+    TileIndex tiles;
+
+    void insert(const Sensor &sensor);
+  };
+
+  struct RetiredIndex {
+    std::shared_ptr<SensorIndex> index;
+    std::vector<Sensor> missing;
+  };
+  static constexpr size_t MAX_RETIRED_INDICES = 4;
+
   struct PositionedIndexChunk {
     uint64_t idx = 0;
     IndexChunk data;
@@ -35,39 +137,170 @@ class Database {
     uint64_t next_chunk = 0;
   };
 
-  struct JournalChunk {
-    uint64_t dirty_chunk;
-    char data[4088];
-  };
-
-  struct PositionedDataChunk {
-    uint64_t idx = 0;
-    DataChunk data;
-  };
-
 public:
-  Database(const std::string &filename = "./db.sqlite");
+  Database(const std::string &filename = "./db.sqlite",
+           HistoryMode history_mode = HistoryMode::CACHED);
   virtual ~Database();
 
   double getLastMeasurement(uint64_t id);
+  // 0 if the sensor has no measurements
+  uint64_t getLastTimestamp(uint64_t id);
 
-  const std::vector<Measurement> &getMeasurementsCached(uint64_t id);
+  // The returned view stays valid for the lifetime of the database, but does
+  // not include measurements added after the call. All of the reading methods
+  // are safe to call concurrently with each other and with a writer.
+  MeasurementRange getMeasurementsCached(uint64_t id);
+  // Returns the measurements with from <= timestamp <= to. If there are more
+  // than limit of them only the most recent limit measurements are returned.
+  MeasurementRange getMeasurementsInRange(uint64_t id, uint64_t from,
+                                          uint64_t to, size_t limit);
+  // Aggregates the measurements with from <= timestamp <= to into buckets of
+  // bucket_size seconds. Only the most recent limit buckets are returned.
+  std::vector<Rollup> getAggregatedMeasurements(uint64_t id, uint64_t from,
+                                                uint64_t to,
+                                                uint64_t bucket_size,
+                                                size_t limit);
 
-  const std::vector<Sensor> &getSensorsCached();
+  std::vector<Sensor> getSensorsCached();
   const Sensor &getSensorByIdCached(uint64_t id);
-  std::vector<Sensor> searchForSensors(std::string name, size_t limit);
+  // Returns the sensors sharing the most q-grams with name. The number of
+  // shared q-grams of every sensor is stored in num_shared if given.
+  std::vector<Sensor>
+  searchForSensors(std::string name, size_t limit,
+                   std::vector<size_t> *num_shared = nullptr);
+  // Returns the sensors whose name or location name is within max_distance
+  // edits of name, ignoring case. The closest sensors come first, sensors at
+  // the same distance are ordered by their number of measurements. A negative
+  // max_distance is chosen from the length of the name. The distance and the
+  // number of measurements of every sensor are stored in distances and counts
+  // if given.
+  std::vector<Sensor>
+  searchForSensorsFuzzy(const std::string &name, int max_distance,
+                        size_t limit, std::vector<size_t> *distances = nullptr,
+                        std::vector<uint64_t> *counts = nullptr);
+  // Returns up to limit sensor and location names starting with prefix,
+  // ignoring case, together with the ids of their sensors. Shorter names come
+  // first.
+  std::vector<PrefixIndex::Completion>
+  completeSensorNames(const std::string &prefix, size_t limit);
+  // Returns all sensors within dist meters of the given position.
+  std::vector<Sensor> getSensorsInRadius(double latitude, double longitude,
+                                         double dist);
+  // Returns the k sensors closest to the given position, closest first.
+  std::vector<Sensor> getNearestSensors(double latitude, double longitude,
+                                        size_t k);
+  // Returns the markers a map showing the bounding box at the zoom level
+  // needs. Nearby sensors are clustered unless the map is zoomed in far
+  // enough, see TileIndex::query.
+  std::vector<TileIndex::Marker>
+  getSensorMarkers(double min_latitude, double min_longitude,
+                   double max_latitude, double max_longitude, int zoom);
 
-  void addSensor(const Sensor &sensor);
-  void addMeasurement(uint64_t id, const Measurement &measurement);
+  // The id of the sensor is assigned by the database and returned.
+  uint64_t addSensor(const Sensor &sensor);
+  // The timestamp of measurements that the database stamps when adding them
+  static constexpr uint64_t UNSTAMPED = 0;
+  // Measurements older than the last measurement of their sensor are
+  // rejected, which keeps the history ordered for range queries. Unstamped
+  // measurements get the current time, or the time of the last measurement
+  // if that is later, so they are never rejected. Returns whether the
+  // measurement was added.
+  bool addMeasurement(uint64_t id, const Measurement &measurement);
+  // Adds all measurements in the order of their timestamps, writing every
+  // chunk touched by the batch only once. Returns for every measurement
+  // whether it could be added.
+  std::vector<bool> addMeasurements(
+      const std::vector<std::pair<uint64_t, Measurement>> &measurements);
+
+  // Without group commit the log is synced to disk on every commit, so every
+  // change is durable once it returns. In group commit mode changes are only
+  // written to the log right away, which protects them from crashes of the
+  // process. The log is synced once the number of unsynced changes reaches
+  // max_pending, once the oldest unsynced change is older than max_delay or
+  // when flush is called. A background thread syncs changes that are left
+  // unsynced for max_delay when no more changes arrive. A crash of the system
+  // therefore loses up to max_delay or max_pending of acknowledged changes.
+  void enableGroupCommit(size_t max_pending,
+                         std::chrono::milliseconds max_delay);
+  // Stores new measurement chunks compressed. Existing chunks keep their
+  // format, both formats can be mixed within a table.
+  void enableCompression();
+  // Writes a snapshot of the in memory state whenever interval has passed
+  // since the last one, and when the database is closed. The next start only
+  // has to replay the chunks that were appended after the snapshot.
+  void enableCheckpoints(std::chrono::seconds interval);
+  // Writes a snapshot now. Throws if it can not be written.
+  void checkpoint();
+  // Syncs the log to disk. All changes made before the call are durable once
+  // it returns.
+  void flush();
 
   uint64_t sensorFromUID(const std::string &dev_uuid);
+  // Resolves the ids of all uids at once. Unknown uids are mapped to -1.
+  std::vector<uint64_t>
+  sensorsFromUIDs(const std::vector<std::string> &dev_uuids);
 
   size_t getNumSensors();
 
+  // Rewrites the database file so the chunks of every table are contiguous
+  // and drops unused reserved chunks. The log is applied first. The database
+  // must not be open.
+  static void compact(const std::string &filename);
+
 private:
   void load();
-  void onSensorBlockLoaded(const DataChunk &chunk, std::vector<char> *buffer);
-  void onMeasurementBlockLoaded(const DataChunk &chunk, uint64_t table_id);
+  // Loads a single table starting at the offset within start_chunk.
+  // Different tables can be loaded concurrently.
+  void loadTable(uint64_t table_id, uint64_t start_chunk, size_t offset);
+  void onSensorBlockLoaded(const DataChunk &chunk, size_t offset,
+                           std::vector<char> *buffer);
+  void onMeasurementBlockLoaded(const DataChunk &chunk, uint64_t block_id,
+                                uint64_t table_id, size_t offset);
+  // Fills the cache of a series restored from the snapshot from the chunks
+  // in its directory
+  void fillCache(MeasurementSeries *series);
+
+  // The snapshot holds the tail of every table, the sensors and their
+  // indices and the in memory state of every series.
+  void writeSnapshot();
+  // Writes a snapshot, errors are only logged
+  void autoCheckpoint();
+  // Restores the state of the last snapshot and sets the chunk and offset
+  // every table has to be replayed from. Returns false if there is no
+  // snapshot that matches the database.
+  bool restoreSnapshot(std::vector<uint64_t> *start_chunks,
+                       std::vector<size_t> *start_offsets);
+
+  // Returns a view of the measurements [begin, end) of the series. count has
+  // to be a value of series.count loaded by the caller.
+  MeasurementRange seriesRange(const MeasurementSeries &series, uint64_t count,
+                               uint64_t begin, uint64_t end);
+  // Returns the position of the first measurement with a timestamp that is
+  // not smaller than timestamp (or larger if upper is set). The series has to
+  // be sorted.
+  uint64_t searchSeries(const MeasurementSeries &series, uint64_t count,
+                        uint64_t timestamp, bool upper);
+  // The number of chunks in the directory holding the first count
+  // measurements.
+  size_t numSeriesChunks(const MeasurementSeries &series, uint64_t count);
+  Measurement readMeasurement(const DataChunk *chunk, size_t i);
+  // Decodes the first num_measurements of a compressed chunk
+  std::shared_ptr<std::vector<Measurement>>
+  decodeChunk(const DataChunk *chunk, size_t num_measurements);
+
+  // Adds the measurement stored in the chunk at chunk_idx to the in memory
+  // series and publishes it.
+  void recordMeasurement(MeasurementSeries *series, uint64_t chunk_idx,
+                         const Measurement &m);
+  void addToRollups(MeasurementSeries *series, const Measurement &m);
+  // Adds the sensor to the in memory indices
+  void indexSensor(const Sensor &sensor);
+  // The published indices, queries keep using them while they are replaced
+  std::shared_ptr<const SensorIndex> sensorIndex() const;
+  // Writes the sensor or measurement to the file and the in memory state
+  // without logging it
+  void storeSensor(const Sensor &sensor);
+  void storeMeasurement(uint64_t id, const Measurement &measurement);
 
   void serializeSensor(const Sensor &sensor, std::vector<char> *buffer);
   void deserializeSensor(Sensor *sensor, const char *src);
@@ -78,25 +311,88 @@ private:
   uint64_t addTable();
 
   // Creates a new block in the data file.
-  uint64_t newFileBlock(void *data = nullptr);
-  void writeFileChunk(void *data, uint64_t idx);
+  uint64_t newFileBlock(const void *data = nullptr);
+  // Appends the data to the table, linking in new chunks as required.
+  void appendToTable(uint64_t table_id, const void *data, size_t size);
+  // Appends the measurement to its table in the format of the tail chunk
+  void appendMeasurement(uint64_t table_id, MeasurementSeries *series,
+                         const Measurement &m);
+  // Moves the tail of the table to the next chunk and returns its idx. A new
+  // extent is reserved when all chunks of the table are used.
+  uint64_t extendTable(uint64_t table_id);
+  // The number of chunks of the next extent of the table
+  uint64_t extentSize(uint64_t table_id);
+
+  DataChunk *dataChunk(uint64_t idx);
+
+  // Appends the measurement to the tail chunk of its table without syncing
+  // the chunk. Returns false if the sensor does not exist or the measurement
+  // is older than the last one of the sensor.
+  bool stageMeasurement(uint64_t id, Measurement measurement);
+  // Writes the staged changes to the log and syncs it if required by the
+  // commit mode.
+  void commitStaged();
+  // flush without locking
+  void syncFile();
+  // Syncs the changes left unsynced for max_delay, runs until the database
+  // is destroyed
+  void runFlusher();
+  // Appends a record to the log, it is synced with the next commit
+  void logRecord(WriteAheadLog::RecordType type, const void *data,
+                 size_t size);
+  // Syncs the file and starts a new log from its current state
+  void checkpointLog();
+  // Undoes all changes to the file since the last checkpoint of the log.
+  // Returns false if there is no log.
+  bool rollbackToCheckpoint();
+  // Applies the records of the log after its checkpoint
+  void replayLog();
 
   void init_db();
 
-  std::fstream _db_file;
+  ChunkFile _file;
   // The block idx and block data
   std::vector<PositionedIndexChunk> _index_chunks;
-  // The block idx and block data
-  std::vector<PositionedDataChunk> _table_last_chunks;
+  // The block idx of the last chunk of every table
+  std::vector<uint64_t> _table_last_chunks;
 
-  JournalChunk _journal_chunk;
+  // Serializes all writers
+  std::mutex _write_mutex;
 
   // indices and caches
-  std::vector<Sensor> _sensors;
-  std::vector<std::vector<Measurement>> _measurements;
-  std::unordered_map<std::string, uint64_t> _uuid_to_id;
-  QGramIndex<3> _sensor_search_index;
+  ConcurrentLog<Sensor> _sensors;
+  HistoryMode _history_mode;
+  ConcurrentLog<std::unique_ptr<MeasurementSeries>> _measurements;
+  // Accessed with the atomic shared_ptr functions. Only the writer replaces
+  // it, and the only change made in place are the last measurements of the
+  // tile index, which may be updated while it is queried.
+  std::shared_ptr<SensorIndex> _index;
+  // Indices published before and the sensors they miss, oldest first. Once
+  // no query holds one anymore it is brought up to date and published again,
+  // which saves copying the indices for every new sensor. Every running query
+  // may hold one, so a few are kept.
+  std::vector<RetiredIndex> _retired_indices;
+  // Set while the database is loaded, when nobody queries it and the index
+  // is extended in place
+  bool _loading;
+
+  WriteAheadLog _log;
+  bool _compress;
+
+  // group commit
+  bool _group_commit;
+  size_t _max_pending;
+  std::chrono::milliseconds _max_delay;
+  size_t _num_pending;
+  std::chrono::steady_clock::time_point _first_pending;
+  std::thread _flusher;
+  // Notified when the first unsynced change is logged and on destruction
+  std::condition_variable _flusher_wake;
+  bool _stop_flusher;
 
-  bool _use_journaling;
+  // checkpoints
+  std::string _snapshot_path;
+  std::chrono::seconds _checkpoint_interval;
+  std::chrono::steady_clock::time_point _last_checkpoint;
 };
 } // namespace smartwater
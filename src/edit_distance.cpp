@@ -0,0 +1,94 @@
+#include "edit_distance.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace smartwater {
+
+EditDistance::EditDistance(const std::string &pattern) : _pattern(pattern) {
+  std::memset(_peq, 0, sizeof(_peq));
+  if (_pattern.size() <= 64) {
+    for (size_t i = 0; i < _pattern.size(); i++) {
+      _peq[static_cast<unsigned char>(_pattern[i])] |= uint64_t(1) << i;
+    }
+  }
+}
+
+size_t EditDistance::distance(const std::string &text,
+                              size_t max_distance) const {
+  size_t length_difference = text.size() > _pattern.size()
+                                 ? text.size() - _pattern.size()
+                                 : _pattern.size() - text.size();
+  // Every byte of the difference needs an insertion or deletion
+  if (length_difference > max_distance) {
+    return max_distance + 1;
+  }
+  if (_pattern.empty()) {
+    return text.size();
+  }
+  if (_pattern.size() <= 64) {
+    return myersDistance(text, max_distance);
+  }
+  return dynamicDistance(text, max_distance);
+}
+
+size_t EditDistance::myersDistance(const std::string &text,
+                                   size_t max_distance) const {
+  // The vertical deltas of the current column are kept as bit vectors of
+  // the positive (pv) and negative (mv) ones. The first column is 0..m.
+  const size_t m = _pattern.size();
+  const uint64_t last = uint64_t(1) << (m - 1);
+  uint64_t pv = m == 64 ? ~uint64_t(0) : (last << 1) - 1;
+  uint64_t mv = 0;
+  size_t score = m;
+  for (size_t j = 0; j < text.size(); j++) {
+    uint64_t eq = _peq[static_cast<unsigned char>(text[j])];
+    uint64_t xv = eq | mv;
+    uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+    uint64_t ph = mv | ~(xh | pv);
+    uint64_t mh = pv & xh;
+    if (ph & last) {
+      score++;
+    } else if (mh & last) {
+      score--;
+    }
+    // The first row is 0..n, so every column starts one higher
+    ph = (ph << 1) | 1;
+    mh <<= 1;
+    pv = mh | ~(xv | ph);
+    mv = ph & xv;
+    // The score drops by at most one per remaining byte of the text
+    if (score > max_distance + (text.size() - j - 1)) {
+      return max_distance + 1;
+    }
+  }
+  return std::min(score, max_distance + 1);
+}
+
+size_t EditDistance::dynamicDistance(const std::string &text,
+                                     size_t max_distance) const {
+  std::vector<size_t> row(text.size() + 1);
+  for (size_t j = 0; j <= text.size(); j++) {
+    row[j] = j;
+  }
+  for (size_t i = 1; i <= _pattern.size(); i++) {
+    size_t diagonal = row[0];
+    row[0] = i;
+    size_t row_min = row[0];
+    for (size_t j = 1; j <= text.size(); j++) {
+      size_t above = row[j];
+      size_t cost = _pattern[i - 1] == text[j - 1] ? 0 : 1;
+      row[j] = std::min({above + 1, row[j - 1] + 1, diagonal + cost});
+      diagonal = above;
+      row_min = std::min(row_min, row[j]);
+    }
+    // Distances never decrease from one row to the next
+    if (row_min > max_distance) {
+      return max_distance + 1;
+    }
+  }
+  return std::min(row[text.size()], max_distance + 1);
+}
+
+} // namespace smartwater
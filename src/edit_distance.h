@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace smartwater {
+
+// Computes the Levenshtein distance between a fixed pattern and many texts.
+// Patterns of up to 64 bytes use Myers' bit parallel algorithm, which
+// handles a whole column of the dynamic program in a few word operations,
+// longer ones fall back to the plain dynamic program. Bytes are compared as
+// is, so a multi byte character counts as several.
+class EditDistance {
+public:
+  explicit EditDistance(const std::string &pattern);
+
+  // Returns the distance between the pattern and text, or max_distance + 1 if
+  // it is larger than max_distance.
+  size_t distance(const std::string &text, size_t max_distance) const;
+
+private:
+  size_t myersDistance(const std::string &text, size_t max_distance) const;
+  size_t dynamicDistance(const std::string &text, size_t max_distance) const;
+
+  std::string _pattern;
+  // The positions of every byte in the pattern as a bit mask
+  uint64_t _peq[256];
+};
+
+} // namespace smartwater
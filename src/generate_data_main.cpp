@@ -51,13 +51,12 @@ int main(int argc, char **argv) {
   time_t now = time(nullptr);
 
   Database db((std::string(argv[4])));
-
-  size_t id_offset = db.getNumSensors();
+  db.enableGroupCommit(4096, std::chrono::milliseconds(1000));
+  db.enableCompression();
 
   for (size_t i = 0; i < num_sensors; i++) {
     std::cout << "Sensor " << i << " / " << num_sensors << std::endl;
     Sensor s;
-    s.id = id_offset + i;
     s.name = city_names[rand_r(&seed) % city_names.size()];
     s.dev_uid = rand_hex_str(16, &seed);
 
@@ -66,7 +65,7 @@ int main(int argc, char **argv) {
     s.longitude = 6 + 9 * (rand_r(&seed) / static_cast<double>(RAND_MAX));
     s.latitude = 47 + 6 * (rand_r(&seed) / static_cast<double>(RAND_MAX));
     s.location_name = city_names[rand_r(&seed) % city_names.size()];
-    db.addSensor(s);
+    s.id = db.addSensor(s);
 
     size_t num_measurements =
         min_measurements + (rand_r(&seed) / static_cast<double>(RAND_MAX)) *
@@ -74,7 +73,8 @@ int main(int argc, char **argv) {
 
     for (size_t j = 0; j < num_measurements; j++) {
       Measurement m;
-      m.timestamp = now - 15 * 60 * j;
+      // Measurements are expected in timestamp order
+      m.timestamp = now - 15 * 60 * (num_measurements - 1 - j);
       m.height =
           sin(j / 0.04) + rand_r(&seed) / static_cast<double>(RAND_MAX) * 0.2;
       db.addMeasurement(s.id, m);
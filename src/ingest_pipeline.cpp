@@ -0,0 +1,164 @@
+#include "ingest_pipeline.h"
+
+#include <chrono>
+#include <stdexcept>
+
+#include "logger.h"
+#include "metrics.h"
+
+namespace smartwater {
+
+namespace {
+// How long an idle writer sleeps before it checks its queue again, in case
+// a wake up was missed
+const std::chrono::milliseconds IDLE_INTERVAL(10);
+
+Gauge &queue_depth = MetricsRegistry::global().gauge(
+    "smartwater_ingest_queue_depth",
+    "The number of measurements that are queued or being written");
+Counter &rejected_measurements = MetricsRegistry::global().counter(
+    "smartwater_ingest_rejected_total",
+    "The number of measurements rejected because the ingest queue was full");
+Counter &failed_measurements = MetricsRegistry::global().counter(
+    "smartwater_ingest_failed_total",
+    "The number of queued measurements the database could not add");
+Histogram &batch_size = MetricsRegistry::global().histogram(
+    "smartwater_ingest_batch_size",
+    "The number of measurements a writer adds at once", HistogramUnit::COUNT);
+} // namespace
+
+IngestPipeline::IngestPipeline(ShardedDatabase *database, size_t capacity,
+                               size_t max_batch)
+    : _database(database), _capacity(capacity), _max_batch(max_batch) {
+  if (capacity == 0 || max_batch == 0) {
+    throw std::runtime_error("The ingest queue needs room for measurements");
+  }
+  for (size_t i = 0; i < _database->numShards(); i++) {
+    // All reserved measurements may belong to the same shard
+    _writers.emplace_back(new Writer(capacity));
+  }
+  for (size_t i = 0; i < _writers.size(); i++) {
+    _writers[i]->thread = std::thread([this, i]() { run(i); });
+  }
+}
+
+IngestPipeline::~IngestPipeline() {
+  _stop.store(true);
+  for (std::unique_ptr<Writer> &writer : _writers) {
+    wakeWriter(writer.get());
+    writer->thread.join();
+  }
+}
+
+size_t IngestPipeline::depth() const {
+  return _depth.load(std::memory_order_relaxed);
+}
+
+size_t IngestPipeline::capacity() const { return _capacity; }
+
+bool IngestPipeline::reserve(size_t num_measurements) {
+  size_t depth = _depth.load(std::memory_order_relaxed);
+  do {
+    if (depth + num_measurements > _capacity) {
+      rejected_measurements.add(num_measurements);
+      return false;
+    }
+  } while (!_depth.compare_exchange_weak(depth, depth + num_measurements,
+                                         std::memory_order_relaxed));
+  queue_depth.set(depth + num_measurements);
+  return true;
+}
+
+bool IngestPipeline::push(
+    const std::vector<std::pair<uint64_t, Measurement>> &measurements) {
+  if (!reserve(measurements.size())) {
+    return false;
+  }
+  std::vector<bool> pushed(_writers.size(), false);
+  for (const std::pair<uint64_t, Measurement> &measurement : measurements) {
+    size_t shard = _database->shardOf(measurement.first);
+    // Can not fail, the reservation guarantees the room
+    _writers[shard]->queue.tryPush(
+        {_database->localId(measurement.first), measurement.second});
+    pushed[shard] = true;
+  }
+  for (size_t i = 0; i < _writers.size(); i++) {
+    if (pushed[i]) {
+      wakeWriter(_writers[i].get());
+    }
+  }
+  return true;
+}
+
+bool IngestPipeline::push(uint64_t id, const Measurement &measurement) {
+  if (!reserve(1)) {
+    return false;
+  }
+  Writer *writer = _writers[_database->shardOf(id)].get();
+  writer->queue.tryPush({_database->localId(id), measurement});
+  wakeWriter(writer);
+  return true;
+}
+
+void IngestPipeline::flush() {
+  std::unique_lock<std::mutex> lock(_flush_mutex);
+  _flushed.wait(lock, [this]() { return depth() == 0; });
+}
+
+void IngestPipeline::wakeWriter(Writer *writer) {
+  // Only writers that wait have to be woken, which keeps the producers from
+  // taking the lock while the writer is busy
+  if (writer->waiting.load() || _stop.load()) {
+    std::lock_guard<std::mutex> lock(writer->mutex);
+    writer->wake.notify_one();
+  }
+}
+
+void IngestPipeline::run(size_t shard) {
+  Writer &writer = *_writers[shard];
+  Database *database = _database->shard(shard);
+  std::vector<std::pair<uint64_t, Measurement>> batch;
+  batch.reserve(_max_batch);
+  std::pair<uint64_t, Measurement> item;
+  while (true) {
+    batch.clear();
+    while (batch.size() < _max_batch && writer.queue.tryPop(&item)) {
+      batch.push_back(item);
+    }
+    if (!batch.empty()) {
+      try {
+        std::vector<bool> added = database->addMeasurements(batch);
+        for (bool a : added) {
+          if (!a) {
+            failed_measurements.add();
+          }
+        }
+      } catch (const std::exception &e) {
+        failed_measurements.add(batch.size());
+        LOG_ERROR << "Unable to write " << batch.size()
+                  << " queued measurements: " << e.what() << LOG_END;
+      }
+      batch_size.record(batch.size());
+      size_t depth = _depth.fetch_sub(batch.size()) - batch.size();
+      queue_depth.set(depth);
+      if (depth == 0) {
+        std::lock_guard<std::mutex> lock(_flush_mutex);
+        _flushed.notify_all();
+      }
+      continue;
+    }
+    // The producers are gone once the pipeline is stopped, so the queue
+    // stays empty
+    if (_stop.load()) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    writer.waiting.store(true);
+    writer.wake.wait_for(lock, IDLE_INTERVAL, [this, &writer]() {
+      return _stop.load() || !writer.queue.empty();
+    });
+    writer.waiting.store(false);
+  }
+}
+
+} // namespace smartwater
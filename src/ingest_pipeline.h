@@ -0,0 +1,77 @@
+#pragma once
+
+#include "mpsc_queue.h"
+#include "sharded_database.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace smartwater {
+
+// Decouples accepting measurements from writing them. Measurements are queued
+// for the shard of their sensor, and a writer thread per shard adds them to
+// the database in batches. Measurements that are queued but not written yet
+// are lost if the process ends abruptly.
+class IngestPipeline {
+public:
+  // At most capacity measurements are queued at a time, and a writer adds up
+  // to max_batch of them at once.
+  IngestPipeline(ShardedDatabase *database, size_t capacity,
+                 size_t max_batch = 1024);
+  // Writes the queued measurements
+  ~IngestPipeline();
+
+  IngestPipeline(const IngestPipeline &other) = delete;
+  IngestPipeline &operator=(const IngestPipeline &other) = delete;
+
+  // Queues all of the measurements, or none of them if there is not enough
+  // room in the queue, in which case false is returned. Batches larger than
+  // the capacity are never queued. The sensors have to exist.
+  bool push(const std::vector<std::pair<uint64_t, Measurement>> &measurements);
+  bool push(uint64_t id, const Measurement &measurement);
+
+  // The number of measurements that are queued or being written
+  size_t depth() const;
+  size_t capacity() const;
+  // Blocks until every queued measurement is written
+  void flush();
+
+private:
+  struct Writer {
+    explicit Writer(size_t capacity) : queue(capacity) {}
+
+    // The local ids and the measurements for the shard
+    MpscQueue<std::pair<uint64_t, Measurement>> queue;
+    std::thread thread;
+    // Set while the writer waits for measurements
+    std::atomic<bool> waiting{false};
+    std::mutex mutex;
+    std::condition_variable wake;
+  };
+
+  // Returns false if there is no room for num_measurements
+  bool reserve(size_t num_measurements);
+  void wakeWriter(Writer *writer);
+  void run(size_t shard);
+
+  ShardedDatabase *_database;
+  size_t _capacity;
+  size_t _max_batch;
+  // Reserved by the producers before pushing and released by the writers
+  // after writing, so every queue always has room for the reserved
+  // measurements
+  std::atomic<size_t> _depth{0};
+  std::atomic<bool> _stop{false};
+  std::vector<std::unique_ptr<Writer>> _writers;
+
+  // Notified when the depth drops to 0
+  std::mutex _flush_mutex;
+  std::condition_variable _flushed;
+};
+} // namespace smartwater
@@ -0,0 +1,124 @@
+#include "json_writer.h"
+
+#include <charconv>
+#include <cmath>
+
+namespace smartwater {
+
+JsonWriter::JsonWriter() : _after_key(false) {}
+
+void JsonWriter::beginArray() {
+  separate();
+  _out.push_back('[');
+  _has_element.push_back(false);
+}
+
+void JsonWriter::endArray() {
+  _out.push_back(']');
+  _has_element.pop_back();
+}
+
+void JsonWriter::beginObject() {
+  separate();
+  _out.push_back('{');
+  _has_element.push_back(false);
+}
+
+void JsonWriter::endObject() {
+  _out.push_back('}');
+  _has_element.pop_back();
+}
+
+void JsonWriter::key(const char *name) {
+  separate();
+  _out.push_back('"');
+  _out.append(name);
+  _out.append("\":");
+  _after_key = true;
+}
+
+void JsonWriter::value(uint64_t v) {
+  separate();
+  char buf[24];
+  char *end = std::to_chars(buf, buf + sizeof(buf), v).ptr;
+  _out.append(buf, end - buf);
+}
+
+void JsonWriter::value(double v) {
+  separate();
+  if (!std::isfinite(v)) {
+    // Same as nlohmann::json
+    _out.append("null");
+    return;
+  }
+  // The shortest representation that parses back to the same value
+  char buf[32];
+  char *end = std::to_chars(buf, buf + sizeof(buf), v).ptr;
+  _out.append(buf, end - buf);
+  bool integral = true;
+  for (char *c = buf; c != end; c++) {
+    if (*c == '.' || *c == 'e') {
+      integral = false;
+      break;
+    }
+  }
+  if (integral) {
+    // Keep the value a float for the clients, like nlohmann::json does
+    _out.append(".0");
+  }
+}
+
+void JsonWriter::value(const std::string &v) {
+  static const char *HEX = "0123456789abcdef";
+  separate();
+  _out.push_back('"');
+  for (char c : v) {
+    switch (c) {
+    case '"':
+      _out.append("\\\"");
+      break;
+    case '\\':
+      _out.append("\\\\");
+      break;
+    case '\n':
+      _out.append("\\n");
+      break;
+    case '\r':
+      _out.append("\\r");
+      break;
+    case '\t':
+      _out.append("\\t");
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        _out.append("\\u00");
+        _out.push_back(HEX[c >> 4]);
+        _out.push_back(HEX[c & 0xf]);
+      } else {
+        _out.push_back(c);
+      }
+    }
+  }
+  _out.push_back('"');
+}
+
+const std::string &JsonWriter::str() const { return _out; }
+
+size_t JsonWriter::size() const { return _out.size(); }
+
+void JsonWriter::clear() { _out.clear(); }
+
+void JsonWriter::separate() {
+  if (_after_key) {
+    _after_key = false;
+    return;
+  }
+  if (!_has_element.empty()) {
+    if (_has_element.back()) {
+      _out.push_back(',');
+    }
+    _has_element.back() = true;
+  }
+}
+
+} // namespace smartwater
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace smartwater {
+
+// Writes json text directly into a string buffer without building an in
+// memory document first. The buffer can be taken out and cleared at any
+// point, which allows streaming large arrays piece by piece.
+class JsonWriter {
+public:
+  JsonWriter();
+
+  void beginArray();
+  void endArray();
+  void beginObject();
+  void endObject();
+  // The name is written as is, it must not require escaping.
+  void key(const char *name);
+
+  void value(uint64_t v);
+  void value(double v);
+  void value(const std::string &v);
+
+  const std::string &str() const;
+  size_t size() const;
+  // Drops the written text but keeps the nesting state.
+  void clear();
+
+private:
+  // Writes the separator required before the next value
+  void separate();
+
+  std::string _out;
+  // Whether the open arrays and objects already contain an element
+  std::vector<bool> _has_element;
+  bool _after_key;
+};
+
+} // namespace smartwater
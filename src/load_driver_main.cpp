@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "database.h"
+#include "server.h"
+
+namespace {
+using smartwater::Database;
+using smartwater::Measurement;
+using smartwater::Sensor;
+typedef std::chrono::steady_clock Clock;
+
+// The kinds of requests in the mix
+enum RequestType { INGEST, HISTORY, SEARCH, NUM_REQUEST_TYPES };
+const char *REQUEST_NAMES[NUM_REQUEST_TYPES] = {"ingest", "history",
+                                                "search"};
+
+struct ClientStats {
+  // The latencies of the successful requests of every type in nanoseconds
+  std::vector<uint64_t> latencies[NUM_REQUEST_TYPES];
+  size_t errors = 0;
+};
+
+double randomDouble(unsigned int *seed) {
+  return rand_r(seed) / static_cast<double>(RAND_MAX);
+}
+
+void removeDatabase(const std::string &path) {
+  unlink(path.c_str());
+  unlink((path + ".wal").c_str());
+  unlink((path + ".snapshot").c_str());
+}
+
+// Creates the database the server is started on
+std::vector<Sensor> populate(const std::string &path, size_t num_sensors,
+                             size_t history_length) {
+  removeDatabase(path);
+  Database db(path);
+  db.enableGroupCommit(4096, std::chrono::milliseconds(1000));
+  db.enableCompression();
+  unsigned int seed = 42;
+  std::vector<Sensor> sensors;
+  uint64_t now = time(nullptr);
+  for (size_t i = 0; i < num_sensors; i++) {
+    Sensor s;
+    s.name = "Sensor " + std::to_string(i);
+    s.location_name = "Location " + std::to_string(i % 1000);
+    s.dev_uid = "dev" + std::to_string(i);
+    s.longitude = 6 + 9 * randomDouble(&seed);
+    s.latitude = 47 + 6 * randomDouble(&seed);
+    s.id = db.addSensor(s);
+    for (size_t j = 0; j < history_length; j++) {
+      Measurement m;
+      m.timestamp = now - 15 * 60 * (history_length - j);
+      m.height = randomDouble(&seed);
+      db.addMeasurement(s.id, m);
+    }
+    sensors.push_back(s);
+  }
+  return sensors;
+}
+
+// Sends requests of the mix until the deadline. Every request opens a new
+// connection, like the webhooks of the network server.
+void runClient(uint16_t port, const std::vector<Sensor> &sensors,
+               const unsigned int *mix, Clock::time_point deadline,
+               unsigned int seed, ClientStats *stats) {
+  httplib::Client client("127.0.0.1", port);
+  unsigned int total = mix[INGEST] + mix[HISTORY] + mix[SEARCH];
+  while (Clock::now() < deadline) {
+    const Sensor &sensor = sensors[rand_r(&seed) % sensors.size()];
+    unsigned int pick = rand_r(&seed) % total;
+    RequestType type = pick < mix[INGEST]                  ? INGEST
+                       : pick < mix[INGEST] + mix[HISTORY] ? HISTORY
+                                                           : SEARCH;
+    Clock::time_point start = Clock::now();
+    bool ok = false;
+    if (type == INGEST) {
+      // An uplink as sent by the things network
+      std::string body = "{\"dev_id\": \"" + sensor.dev_uid +
+                         "\", \"payload_fields\": {\"height\": " +
+                         std::to_string(randomDouble(&seed)) + "}}";
+      auto res = client.Post("/sensor/add_measurement", body,
+                             "application/json");
+      ok = res && res->status == 200;
+    } else if (type == HISTORY) {
+      // The last day of the sensor
+      uint64_t from = time(nullptr) - 86400;
+      auto res = client.Get("/sensor/history?id=" + std::to_string(sensor.id) +
+                            "&from=" + std::to_string(from));
+      ok = res && res->status == 200;
+    } else {
+      // A prefix of the name as typed into the search box
+      std::string prefix = sensor.name.substr(0, 3 + rand_r(&seed) % 6);
+      for (char &c : prefix) {
+        if (c == ' ') {
+          c = '+';
+        }
+      }
+      auto res = client.Get("/sensors?name=" + prefix + "&limit=10");
+      ok = res && res->status == 200;
+    }
+    uint64_t latency =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                             start)
+            .count();
+    if (ok) {
+      stats->latencies[type].push_back(latency);
+    } else {
+      stats->errors++;
+    }
+  }
+}
+
+void report(const std::string &name, std::vector<uint64_t> latencies,
+            double seconds) {
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double p) {
+    if (latencies.empty()) {
+      return 0.0;
+    }
+    size_t i = std::min(latencies.size() - 1,
+                        static_cast<size_t>(p * latencies.size()));
+    return latencies[i] / 1000.0;
+  };
+  std::cout << "  " << std::left << std::setw(8) << name << std::right
+            << std::setw(10) << latencies.size() << " requests "
+            << std::fixed << std::setprecision(0) << std::setw(8)
+            << latencies.size() / seconds << " req/s   p50 "
+            << std::setprecision(1) << std::setw(9) << percentile(0.5)
+            << " us   p99 " << std::setw(9) << percentile(0.99)
+            << " us   p999 " << std::setw(9) << percentile(0.999) << " us"
+            << std::endl;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 5 && argc != 8) {
+    std::cout << "Expected 4 or 7 arguments, but got " << (argc - 1)
+              << std::endl;
+    std::cout << "Usage: " << argv[0]
+              << " <num_sensors> <history_length> <seconds> <clients>"
+                 " [<ingest> <history> <search>]"
+              << std::endl;
+    std::cout << "The last three arguments are the weights of the request "
+                 "types, 80 15 5 by default."
+              << std::endl;
+    return 1;
+  }
+  size_t num_sensors = std::stoul(argv[1]);
+  size_t history_length = std::stoul(argv[2]);
+  size_t seconds = std::stoul(argv[3]);
+  size_t num_clients = std::stoul(argv[4]);
+  unsigned int mix[NUM_REQUEST_TYPES] = {80, 15, 5};
+  if (argc == 8) {
+    for (int i = 0; i < NUM_REQUEST_TYPES; i++) {
+      mix[i] = std::stoul(argv[5 + i]);
+    }
+  }
+  if (num_sensors == 0 || mix[INGEST] + mix[HISTORY] + mix[SEARCH] == 0) {
+    std::cout << "Expected at least one sensor and request type" << std::endl;
+    return 1;
+  }
+
+  const std::string path = "./load_driver.db";
+  const uint16_t port = 8089;
+  std::cout << "Creating " << num_sensors << " sensors with "
+            << history_length << " measurements each" << std::endl;
+  std::vector<Sensor> sensors = populate(path, num_sensors, history_length);
+
+  // Configured like the server in main.cpp
+  Database db(path, smartwater::HistoryMode::MAPPED);
+  db.enableCompression();
+  db.enableCheckpoints(std::chrono::minutes(10));
+  smartwater::ShardedDatabase shards({&db});
+  smartwater::Server server(&shards, "", "", port);
+  server.enableIngestQueue(65536);
+  std::thread server_thread([&server]() { server.start(); });
+  // Wait for the server to accept connections
+  {
+    httplib::Client client("127.0.0.1", port);
+    while (!client.Get("/sensors/complete?prefix=s")) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  std::cout << "Running " << num_clients << " clients for " << seconds
+            << " seconds" << std::endl;
+  std::vector<ClientStats> stats(num_clients);
+  std::vector<std::thread> clients;
+  Clock::time_point start = Clock::now();
+  Clock::time_point deadline = start + std::chrono::seconds(seconds);
+  for (size_t i = 0; i < num_clients; i++) {
+    clients.emplace_back(runClient, port, std::cref(sensors), mix, deadline,
+                         static_cast<unsigned int>(i + 1), &stats[i]);
+  }
+  for (std::thread &client : clients) {
+    client.join();
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  server.stop();
+  server_thread.join();
+
+  std::vector<uint64_t> all;
+  size_t errors = 0;
+  for (int type = 0; type < NUM_REQUEST_TYPES; type++) {
+    std::vector<uint64_t> latencies;
+    for (const ClientStats &s : stats) {
+      latencies.insert(latencies.end(), s.latencies[type].begin(),
+                       s.latencies[type].end());
+    }
+    all.insert(all.end(), latencies.begin(), latencies.end());
+    report(REQUEST_NAMES[type], std::move(latencies), elapsed);
+  }
+  for (const ClientStats &s : stats) {
+    errors += s.errors;
+  }
+  report("total", std::move(all), elapsed);
+  std::cout << "  " << errors << " failed requests" << std::endl;
+}
@@ -0,0 +1,373 @@
+#include "logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace smartwater {
+
+namespace {
+const char *LEVEL_PREFIX[5] = {
+    "\x1b[34m[TRACE] ", "\x1b[36m[DEBUG] ", "[INFO ] ",
+    "\x1b[33m[WARN ] ", "\x1b[31m[ERROR] ",
+};
+const char *COLOR_RESET = "\x1b[0m";
+
+// Longer messages are cut, like the bodies of large requests
+const size_t MAX_MESSAGE_SIZE = 4096;
+// How long the background thread sleeps when there is nothing to write
+const std::chrono::milliseconds WRITE_INTERVAL(10);
+
+struct RecordHeader {
+  // Nanoseconds since the epoch
+  int64_t time;
+  uint32_t size;
+  int32_t level;
+};
+
+// The messages of one thread. The thread appends records, the background
+// thread removes them, so both sides only need the atomic positions.
+class LogBuffer {
+public:
+  static const size_t SIZE = size_t(1) << 18;
+
+  // Returns false and counts the message as dropped if it does not fit
+  bool push(int level, int64_t time, const char *data, size_t size) {
+    size_t head = _head.load(std::memory_order_relaxed);
+    size_t tail = _tail.load(std::memory_order_acquire);
+    if (sizeof(RecordHeader) + size > SIZE - (head - tail)) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    RecordHeader header;
+    header.time = time;
+    header.size = size;
+    header.level = level;
+    copyIn(head, &header, sizeof(header));
+    copyIn(head + sizeof(header), data, size);
+    _head.store(head + sizeof(header) + size, std::memory_order_release);
+    return true;
+  }
+
+  bool halfFull() const {
+    return _head.load(std::memory_order_relaxed) -
+               _tail.load(std::memory_order_relaxed) >=
+           SIZE / 2;
+  }
+
+  // Calls f(header, message) for every record and removes them
+  template <typename F> size_t drain(F f) {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    size_t head = _head.load(std::memory_order_acquire);
+    size_t num_records = 0;
+    std::string message;
+    while (tail != head) {
+      RecordHeader header;
+      copyOut(tail, &header, sizeof(header));
+      message.resize(header.size);
+      copyOut(tail + sizeof(header), &message[0], header.size);
+      tail += sizeof(header) + header.size;
+      f(header, message);
+      num_records++;
+    }
+    _tail.store(tail, std::memory_order_release);
+    return num_records;
+  }
+
+  uint64_t takeDropped() {
+    return _dropped.exchange(0, std::memory_order_relaxed);
+  }
+
+  // Called when the thread exits, the buffer is removed once it is drained
+  void close() { _closed.store(true, std::memory_order_release); }
+  bool closed() const { return _closed.load(std::memory_order_acquire); }
+
+private:
+  void copyIn(size_t position, const void *data, size_t size) {
+    size_t offset = position % SIZE;
+    size_t first = std::min(size, SIZE - offset);
+    std::memcpy(_data + offset, data, first);
+    std::memcpy(_data, static_cast<const char *>(data) + first, size - first);
+  }
+
+  void copyOut(size_t position, void *data, size_t size) const {
+    size_t offset = position % SIZE;
+    size_t first = std::min(size, SIZE - offset);
+    std::memcpy(data, _data + offset, first);
+    std::memcpy(static_cast<char *>(data) + first, _data, size - first);
+  }
+
+  char _data[SIZE];
+  std::atomic<size_t> _head{0};
+  std::atomic<size_t> _tail{0};
+  std::atomic<uint64_t> _dropped{0};
+  std::atomic<bool> _closed{false};
+};
+
+// Owns the buffers and the background thread
+class Backend {
+public:
+  Backend() : _stop(false), _written(0) {
+    _thread = std::thread([this]() { run(); });
+  }
+
+  ~Backend() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _wake.notify_all();
+    _thread.join();
+  }
+
+  std::shared_ptr<LogBuffer> addBuffer() {
+    std::shared_ptr<LogBuffer> buffer = std::make_shared<LogBuffer>();
+    std::lock_guard<std::mutex> lock(_mutex);
+    _buffers.push_back(buffer);
+    return buffer;
+  }
+
+  void wake() { _wake.notify_all(); }
+
+  // Waits for one full round of the background thread, which writes
+  // everything that was queued before the call
+  void flush() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    uint64_t target = _written + 2;
+    _wake.notify_all();
+    _flushed.wait(lock, [this, target]() { return _written >= target; });
+  }
+
+private:
+  struct Line {
+    int64_t time;
+    std::string text;
+  };
+
+  void run() {
+    std::vector<Line> lines;
+    std::string out;
+    while (true) {
+      std::vector<std::shared_ptr<LogBuffer>> buffers;
+      bool stop;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        stop = _stop;
+        buffers = _buffers;
+      }
+      uint64_t dropped = 0;
+      for (const std::shared_ptr<LogBuffer> &buffer : buffers) {
+        // Checked before draining, so no message of a closed buffer is lost
+        bool closed = buffer->closed();
+        buffer->drain([&lines](const RecordHeader &header,
+                               const std::string &message) {
+          lines.push_back({header.time, format(header, message)});
+        });
+        dropped += buffer->takeDropped();
+        if (closed) {
+          removeBuffer(buffer);
+        }
+      }
+      // The threads are merged by the time of their messages
+      std::stable_sort(lines.begin(), lines.end(),
+                       [](const Line &a, const Line &b) {
+                         return a.time < b.time;
+                       });
+      out.clear();
+      for (const Line &line : lines) {
+        out += line.text;
+      }
+      if (dropped > 0) {
+        out += LEVEL_PREFIX[WARN];
+        out += "Dropped " + std::to_string(dropped) +
+               " log messages because a buffer was full";
+        out += COLOR_RESET;
+        out += '\n';
+      }
+      if (!out.empty()) {
+        std::cout.write(out.data(), out.size());
+        std::cout.flush();
+      }
+      bool idle = lines.empty();
+      lines.clear();
+
+      std::unique_lock<std::mutex> lock(_mutex);
+      _written++;
+      _flushed.notify_all();
+      if (stop && idle) {
+        return;
+      }
+      if (idle && !_stop) {
+        _wake.wait_for(lock, WRITE_INTERVAL);
+      }
+    }
+  }
+
+  void removeBuffer(const std::shared_ptr<LogBuffer> &buffer) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _buffers.erase(std::remove(_buffers.begin(), _buffers.end(), buffer),
+                   _buffers.end());
+  }
+
+  static std::string format(const RecordHeader &header,
+                            const std::string &message) {
+    time_t seconds = header.time / 1000000000;
+    int millis = (header.time / 1000000) % 1000;
+    struct tm local;
+    localtime_r(&seconds, &local);
+    char time[32];
+    size_t length = strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S", &local);
+    snprintf(time + length, sizeof(time) - length, ".%03d ", millis);
+    std::string line = LEVEL_PREFIX[header.level];
+    line += time;
+    line += message;
+    line += COLOR_RESET;
+    line += '\n';
+    return line;
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::condition_variable _flushed;
+  std::vector<std::shared_ptr<LogBuffer>> _buffers;
+  bool _stop;
+  // The number of finished rounds of the background thread
+  uint64_t _written;
+  std::thread _thread;
+};
+
+// Messages logged during the destruction of static objects, after the
+// backend is gone, are written directly
+std::atomic<bool> backend_destroyed{false};
+
+Backend &backend() {
+  struct Holder {
+    ~Holder() { backend_destroyed.store(true); }
+    Backend backend;
+  };
+  static Holder holder;
+  return holder.backend;
+}
+
+// Closes the buffer of a thread when it exits
+struct ThreadBuffer {
+  ~ThreadBuffer() {
+    if (buffer) {
+      buffer->close();
+    }
+  }
+  std::shared_ptr<LogBuffer> buffer;
+};
+
+LogBuffer *threadBuffer() {
+  thread_local ThreadBuffer thread_buffer;
+  if (!thread_buffer.buffer) {
+    thread_buffer.buffer = backend().addBuffer();
+  }
+  return thread_buffer.buffer.get();
+}
+
+// The streams of the messages the thread is formatting, one per nesting level
+struct ThreadStreams {
+  std::vector<std::unique_ptr<std::ostringstream>> streams;
+  size_t depth = 0;
+};
+
+ThreadStreams &threadStreams() {
+  thread_local ThreadStreams streams;
+  return streams;
+}
+
+std::ostringstream &acquireStream() {
+  ThreadStreams &streams = threadStreams();
+  if (streams.depth == streams.streams.size()) {
+    streams.streams.emplace_back(new std::ostringstream());
+  }
+  std::ostringstream &stream = *streams.streams[streams.depth++];
+  stream.str(std::string());
+  stream.clear();
+  return stream;
+}
+
+void releaseStream() { threadStreams().depth--; }
+
+int levelFromEnvironment() {
+  const char *value = getenv("SMARTWATER_LOG_LEVEL");
+  if (value == nullptr) {
+    return Logger::level();
+  }
+  const char *names[5] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+  for (int level = TRACE; level <= ERROR; level++) {
+    if (strcmp(value, names[level]) == 0) {
+      return level;
+    }
+  }
+  return Logger::level();
+}
+
+// Applies the environment variable before main runs
+const bool level_initialized = (Logger::setLevel(levelFromEnvironment()), true);
+} // namespace
+
+void Logger::write(int level, const std::string &message) {
+  int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::system_clock::now().time_since_epoch())
+                     .count();
+  size_t size = std::min(message.size(), MAX_MESSAGE_SIZE);
+  if (backend_destroyed.load(std::memory_order_relaxed)) {
+    std::cout << LEVEL_PREFIX[level] << message.substr(0, size) << COLOR_RESET
+              << std::endl;
+    return;
+  }
+  LogBuffer *buffer = threadBuffer();
+  buffer->push(level, time, message.data(), size);
+  // Errors are written right away in case the process ends, and bursts
+  // before the buffer overflows
+  if (level >= ERROR || buffer->halfFull()) {
+    backend().wake();
+  }
+}
+
+void Logger::flush() {
+  if (!backend_destroyed.load(std::memory_order_relaxed)) {
+    backend().flush();
+  }
+}
+
+bool RateLimiter::allow() {
+  uint64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+                        std::chrono::steady_clock::now().time_since_epoch())
+                        .count();
+  uint64_t current = _second.load(std::memory_order_relaxed);
+  if (current != second &&
+      _second.compare_exchange_strong(current, second,
+                                      std::memory_order_relaxed)) {
+    _count.store(0, std::memory_order_relaxed);
+  }
+  if (_count.fetch_add(1, std::memory_order_relaxed) < _per_second) {
+    return true;
+  }
+  _skipped.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+LogMessage::LogMessage(int level, uint64_t skipped)
+    : _level(level), _skipped(skipped), _stream(acquireStream()) {}
+
+LogMessage::~LogMessage() {
+  if (_skipped > 0) {
+    _stream << " (" << _skipped << " similar messages skipped)";
+  }
+  Logger::write(_level, _stream.str());
+  releaseStream();
+}
+
+} // namespace smartwater
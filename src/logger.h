@@ -1,8 +1,11 @@
 #ifndef MINIANT_LOGGER_H_
 #define MINIANT_LOGGER_H_
 
-#include <iostream>
+#include <atomic>
+#include <cstdint>
+#include <sstream>
 #include <string>
+#include <type_traits>
 
 #define TRACE 0
 #define DEBUG 1
@@ -10,20 +13,113 @@
 #define WARN 3
 #define ERROR 4
 
+// Messages below this level are removed by the compiler
 #ifndef LOGLEVEL
 #define LOGLEVEL DEBUG
 #endif  // LOGLEVEL
 
-const std::string LOG_STRING[5] = {
-    "\x1b[34m[TRACE] ", "\x1b[36m[DEBUG] ", "[INFO ] ",
-    "\x1b[33m[WARN ] ", "\x1b[31m[ERROR] ",
+namespace smartwater {
+
+// The logger of the process. Threads write their messages into their own ring
+// buffer, a background thread adds the time and the level and writes them to
+// stdout, so logging never waits for the terminal or the stdout lock. When a
+// buffer is full its messages are dropped, and the number of dropped messages
+// is logged later.
+class Logger {
+public:
+  // Messages below the level are skipped at runtime. The level is INFO or
+  // LOGLEVEL if that is higher, and can be set with the environment variable
+  // SMARTWATER_LOG_LEVEL to one of TRACE, DEBUG, INFO, WARN or ERROR.
+  static void setLevel(int level) {
+    _level.store(level, std::memory_order_relaxed);
+  }
+  static int level() { return _level.load(std::memory_order_relaxed); }
+  static bool enabled(int level) {
+    return level >= _level.load(std::memory_order_relaxed);
+  }
+
+  // Queues the message of the calling thread
+  static void write(int level, const std::string &message);
+  // Blocks until every queued message is written
+  static void flush();
+
+private:
+  static inline std::atomic<int> _level{LOGLEVEL > INFO ? LOGLEVEL : INFO};
+};
+
+// Limits a log statement to a number of messages per second. The number of
+// skipped messages is added to the next message that is written.
+class RateLimiter {
+public:
+  explicit RateLimiter(uint32_t per_second) : _per_second(per_second) {}
+
+  bool allow();
+  // Returns the messages skipped since the last call
+  uint64_t takeSkipped() {
+    return _skipped.exchange(0, std::memory_order_relaxed);
+  }
+
+private:
+  uint32_t _per_second;
+  std::atomic<uint64_t> _second{0};
+  std::atomic<uint32_t> _count{0};
+  std::atomic<uint64_t> _skipped{0};
 };
 
-#define LOG(level)        \
-  if (level < LOGLEVEL) { \
-  } else                  \
-    std::cout << LOG_STRING[level]
-#define LOG_END "\x1b[0m" << std::endl
+// Ends a log statement, the message is queued when the statement ends
+struct LogEnd {};
+
+// Collects the parts of a message and queues it when destroyed. The parts
+// are formatted into a stream that is reused by the thread, messages logged
+// while the parts of another message are formatted use their own stream.
+class LogMessage {
+public:
+  explicit LogMessage(int level, uint64_t skipped = 0);
+  ~LogMessage();
+  LogMessage(const LogMessage &) = delete;
+  LogMessage &operator=(const LogMessage &) = delete;
+
+  // Numbers are taken by value, so constants like static const members need
+  // no definition
+  template <typename T>
+  typename std::enable_if<std::is_arithmetic<T>::value, LogMessage &>::type
+  operator<<(T value) {
+    _stream << value;
+    return *this;
+  }
+  template <typename T>
+  typename std::enable_if<!std::is_arithmetic<T>::value, LogMessage &>::type
+  operator<<(const T &value) {
+    _stream << value;
+    return *this;
+  }
+  LogMessage &operator<<(LogEnd) { return *this; }
+
+private:
+  int _level;
+  uint64_t _skipped;
+  std::ostringstream &_stream;
+};
+
+} // namespace smartwater
+
+#define LOG(level)                                                  \
+  if (level < LOGLEVEL || !smartwater::Logger::enabled(level)) {    \
+  } else                                                            \
+    smartwater::LogMessage(level)
+#define LOG_END smartwater::LogEnd()
+
+// Like LOG, but writes at most per_second messages every second. Meant for
+// messages that are logged on every request.
+#define LOG_LIMITED(level, per_second)                              \
+  if (level < LOGLEVEL || !smartwater::Logger::enabled(level)) {    \
+  } else if (smartwater::RateLimiter *log_limiter_ = [] {           \
+               static smartwater::RateLimiter limiter(per_second);  \
+               return &limiter;                                     \
+             }();                                                   \
+             !log_limiter_->allow()) {                              \
+  } else                                                            \
+    smartwater::LogMessage(level, log_limiter_->takeSkipped())
 
 #define LOG_TRACE LOG(TRACE)
 #define LOG_DEBUG LOG(DEBUG)
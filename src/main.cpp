@@ -1,6 +1,6 @@
 
-#include "database.h"
 #include "server.h"
+#include "sharded_database.h"
 #include <iostream>
 
 int main(int argc, char **argv) {
@@ -24,7 +24,16 @@ int main(int argc, char **argv) {
               << std::endl;
     return 1;
   }
-  smartwater::Database db;
+  // Keep only chunk locations in memory, the history is served from the
+  // mapped database file. The sensors are spread over SMARTWATER_SHARDS
+  // files.
+  using smartwater::ShardedDatabase;
+  ShardedDatabase db("./db.sqlite", ShardedDatabase::configuredShards(),
+                     smartwater::HistoryMode::MAPPED);
+  db.enableCompression();
+  db.enableCheckpoints(std::chrono::minutes(10));
   smartwater::Server server(&db, cert, key, port);
+  // Answer the webhooks without waiting for the disk
+  server.enableIngestQueue(65536);
   server.start();
 }
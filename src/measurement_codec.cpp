@@ -0,0 +1,187 @@
+#include "measurement_codec.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace smartwater {
+
+namespace {
+// Writes bits most significant first into a zeroed buffer
+class BitWriter {
+public:
+  explicit BitWriter(char *out)
+      : _out(reinterpret_cast<unsigned char *>(out)), _bit(0) {}
+
+  // Writes the lowest bits of value
+  void write(uint64_t value, int bits) {
+    while (bits > 0) {
+      int free = 8 - _bit % 8;
+      int n = std::min(free, bits);
+      unsigned part = (value >> (bits - n)) & ((1u << n) - 1);
+      _out[_bit / 8] |= part << (free - n);
+      _bit += n;
+      bits -= n;
+    }
+  }
+
+  // The number of bytes written, including the padding of the last byte
+  size_t bytes() const { return (_bit + 7) / 8; }
+
+private:
+  unsigned char *_out;
+  size_t _bit;
+};
+
+class BitReader {
+public:
+  explicit BitReader(const char *data)
+      : _data(reinterpret_cast<const unsigned char *>(data)), _bit(0) {}
+
+  uint64_t read(int bits) {
+    uint64_t value = 0;
+    while (bits > 0) {
+      int available = 8 - _bit % 8;
+      int n = std::min(available, bits);
+      unsigned part = (_data[_bit / 8] >> (available - n)) & ((1u << n) - 1);
+      value = (value << n) | part;
+      _bit += n;
+      bits -= n;
+    }
+    return value;
+  }
+
+  size_t bytes() const { return (_bit + 7) / 8; }
+
+private:
+  const unsigned char *_data;
+  size_t _bit;
+};
+
+bool fitsBits(int64_t value, int bits) {
+  return value >= -(int64_t(1) << (bits - 1)) &&
+         value < (int64_t(1) << (bits - 1));
+}
+
+int64_t signExtend(uint64_t value, int bits) {
+  if (value & (uint64_t(1) << (bits - 1))) {
+    return static_cast<int64_t>(value) - (int64_t(1) << bits);
+  }
+  return static_cast<int64_t>(value);
+}
+} // namespace
+
+MeasurementCodec::MeasurementCodec() { reset(); }
+
+void MeasurementCodec::reset() {
+  _num_measurements = 0;
+  _prev_timestamp = 0;
+  _prev_delta = 0;
+  _prev_value = 0;
+  _leading = -1;
+  _trailing = -1;
+}
+
+size_t MeasurementCodec::encode(const Measurement &m, char *out) {
+  std::memset(out, 0, MAX_ENCODED_SIZE);
+  BitWriter writer(out);
+  uint64_t value;
+  std::memcpy(&value, &m.height, sizeof(value));
+  if (_num_measurements == 0) {
+    writer.write(m.timestamp, 64);
+    writer.write(value, 64);
+    _prev_delta = 0;
+  } else {
+    // The deltas wrap around for measurements that are out of order
+    uint64_t delta = m.timestamp - _prev_timestamp;
+    int64_t dod = static_cast<int64_t>(delta - _prev_delta);
+    if (dod == 0) {
+      writer.write(0, 1);
+    } else if (fitsBits(dod, 7)) {
+      writer.write(0x2, 2);
+      writer.write(dod, 7);
+    } else if (fitsBits(dod, 9)) {
+      writer.write(0x6, 3);
+      writer.write(dod, 9);
+    } else if (fitsBits(dod, 12)) {
+      writer.write(0xe, 4);
+      writer.write(dod, 12);
+    } else {
+      writer.write(0xf, 4);
+      writer.write(dod, 64);
+    }
+    _prev_delta = delta;
+
+    uint64_t x = value ^ _prev_value;
+    if (x == 0) {
+      writer.write(0, 1);
+    } else {
+      int leading = std::min(__builtin_clzll(x), 31);
+      int trailing = __builtin_ctzll(x);
+      if (_leading >= 0 && leading >= _leading && trailing >= _trailing) {
+        // The meaningful bits fit into those of the previous xor
+        writer.write(0x2, 2);
+        writer.write(x >> _trailing, 64 - _leading - _trailing);
+      } else {
+        int meaningful = 64 - leading - trailing;
+        writer.write(0x3, 2);
+        writer.write(leading, 5);
+        // 64 meaningful bits are stored as 0
+        writer.write(meaningful & 63, 6);
+        writer.write(x >> trailing, meaningful);
+        _leading = leading;
+        _trailing = trailing;
+      }
+    }
+  }
+  _prev_timestamp = m.timestamp;
+  _prev_value = value;
+  _num_measurements++;
+  return writer.bytes();
+}
+
+size_t MeasurementCodec::decode(const char *data, Measurement *m) {
+  BitReader reader(data);
+  uint64_t value;
+  if (_num_measurements == 0) {
+    m->timestamp = reader.read(64);
+    value = reader.read(64);
+    _prev_delta = 0;
+  } else {
+    int64_t dod;
+    if (reader.read(1) == 0) {
+      dod = 0;
+    } else if (reader.read(1) == 0) {
+      dod = signExtend(reader.read(7), 7);
+    } else if (reader.read(1) == 0) {
+      dod = signExtend(reader.read(9), 9);
+    } else if (reader.read(1) == 0) {
+      dod = signExtend(reader.read(12), 12);
+    } else {
+      dod = static_cast<int64_t>(reader.read(64));
+    }
+    uint64_t delta = _prev_delta + static_cast<uint64_t>(dod);
+    m->timestamp = _prev_timestamp + delta;
+    _prev_delta = delta;
+
+    uint64_t x = 0;
+    if (reader.read(1) == 1) {
+      if (reader.read(1) == 1) {
+        _leading = reader.read(5);
+        int meaningful = reader.read(6);
+        if (meaningful == 0) {
+          meaningful = 64;
+        }
+        _trailing = 64 - _leading - meaningful;
+      }
+      x = reader.read(64 - _leading - _trailing) << _trailing;
+    }
+    value = _prev_value ^ x;
+  }
+  std::memcpy(&m->height, &value, sizeof(value));
+  _prev_timestamp = m->timestamp;
+  _prev_value = value;
+  _num_measurements++;
+  return reader.bytes();
+}
+
+} // namespace smartwater
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "sensor.h"
+
+namespace smartwater {
+
+// Compresses a sequence of measurements in the style of Facebook's Gorilla:
+// timestamps are stored as the difference between consecutive deltas and
+// heights as the xor with the previous height. The first measurement is
+// stored as is.
+//
+// Unlike Gorilla every measurement is padded to whole bytes, so the bytes of
+// an encoded measurement never change once it has been written. This allows
+// readers to decode a chunk while new measurements are appended to it.
+//
+// The codec is stateful, measurements have to be decoded in the order they
+// were encoded, starting after a reset.
+class MeasurementCodec {
+public:
+  // The maximum number of bytes of an encoded measurement
+  static const size_t MAX_ENCODED_SIZE = 24;
+
+  MeasurementCodec();
+
+  void reset();
+  // Writes the encoded measurement to out and returns its size.
+  size_t encode(const Measurement &m, char *out);
+  // Reads a measurement from data and returns the number of bytes read.
+  size_t decode(const char *data, Measurement *m);
+
+private:
+  uint64_t _num_measurements;
+  uint64_t _prev_timestamp;
+  uint64_t _prev_delta;
+  uint64_t _prev_value;
+  // The range of bits of the last stored xor
+  int _leading;
+  int _trailing;
+};
+
+} // namespace smartwater
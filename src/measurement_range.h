@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include "sensor.h"
+
+namespace smartwater {
+
+// A read only view of a sequence of measurements that is stored in several
+// contiguous segments, e.g. the data chunks of a table in the mapped database
+// file. The view usually does not own the measurements, but can keep data
+// alive that was materialized for it. Segments need not be aligned, so
+// measurements are returned by value.
+class MeasurementRange {
+public:
+  struct Segment {
+    const char *data;
+    size_t size;
+  };
+
+  class const_iterator {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Measurement value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const Measurement *pointer;
+    typedef Measurement reference;
+
+    const_iterator(const MeasurementRange *range, size_t segment,
+                   size_t offset)
+        : _range(range), _segment(segment), _offset(offset) {}
+
+    Measurement operator*() const {
+      Measurement m;
+      std::memcpy(&m,
+                  _range->_segments[_segment].data +
+                      _offset * sizeof(Measurement),
+                  sizeof(Measurement));
+      return m;
+    }
+
+    const_iterator &operator++() {
+      _offset++;
+      if (_offset == _range->_segments[_segment].size) {
+        _segment++;
+        _offset = 0;
+      }
+      return *this;
+    }
+
+    bool operator==(const const_iterator &other) const {
+      return _segment == other._segment && _offset == other._offset;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return !(*this == other);
+    }
+
+  private:
+    const MeasurementRange *_range;
+    size_t _segment;
+    size_t _offset;
+  };
+
+  MeasurementRange() : _size(0) {}
+
+  // Appends size measurements stored at data to the view.
+  void append(const void *data, size_t size) {
+    if (size == 0) {
+      return;
+    }
+    _segments.push_back({reinterpret_cast<const char *>(data), size});
+    _offsets.push_back(_size);
+    _size += size;
+  }
+
+  // Keeps the data alive for as long as the view (or a slice of it) exists.
+  void hold(std::shared_ptr<const void> data) { _held.push_back(data); }
+
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+  Measurement operator[](size_t i) const {
+    // Find the last segment starting at or before i
+    size_t segment =
+        std::upper_bound(_offsets.begin(), _offsets.end(), i) -
+        _offsets.begin() - 1;
+    Measurement m;
+    std::memcpy(&m,
+                _segments[segment].data +
+                    (i - _offsets[segment]) * sizeof(Measurement),
+                sizeof(Measurement));
+    return m;
+  }
+
+  Measurement front() const { return (*this)[0]; }
+  Measurement back() const { return (*this)[_size - 1]; }
+
+  const_iterator begin() const { return const_iterator(this, 0, 0); }
+  const_iterator end() const {
+    return const_iterator(this, _segments.size(), 0);
+  }
+
+  // Returns a view of the measurements in [from, to)
+  MeasurementRange slice(size_t from, size_t to) const {
+    MeasurementRange r;
+    r._held = _held;
+    to = std::min(to, _size);
+    for (size_t i = 0; i < _segments.size() && from < to; i++) {
+      size_t seg_start = _offsets[i];
+      size_t seg_end = seg_start + _segments[i].size;
+      if (seg_end <= from) {
+        continue;
+      }
+      size_t begin = std::max(from, seg_start);
+      size_t end = std::min(to, seg_end);
+      if (begin >= end) {
+        break;
+      }
+      r.append(_segments[i].data + (begin - seg_start) * sizeof(Measurement),
+               end - begin);
+    }
+    return r;
+  }
+
+  const std::vector<Segment> &segments() const { return _segments; }
+
+private:
+  std::vector<Segment> _segments;
+  // The index of the first measurement of every segment
+  std::vector<size_t> _offsets;
+  size_t _size;
+  std::vector<std::shared_ptr<const void>> _held;
+};
+
+} // namespace smartwater
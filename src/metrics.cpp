@@ -0,0 +1,155 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+namespace smartwater {
+
+namespace {
+// The powers of two that bound the exported buckets of histograms
+const int MIN_DURATION_EXPONENT = 10; // ~1us
+const int MAX_DURATION_EXPONENT = 36; // ~69s
+const int MIN_COUNT_EXPONENT = 0;
+const int MAX_COUNT_EXPONENT = 24;
+
+std::string withLabel(const std::string &labels, const std::string &label) {
+  if (labels.empty()) {
+    return "{" + label + "}";
+  }
+  return "{" + labels + "," + label + "}";
+}
+
+std::string withLabels(const std::string &labels) {
+  return labels.empty() ? "" : "{" + labels + "}";
+}
+} // namespace
+
+void Histogram::record(uint64_t value) {
+  _buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::countBelow(int exponent) const {
+  size_t end =
+      exponent >= 64 ? NUM_BUCKETS : bucketIndex(uint64_t(1) << exponent);
+  uint64_t count = 0;
+  for (size_t i = 0; i < end; i++) {
+    count += _buckets[i].load(std::memory_order_relaxed);
+  }
+  return count;
+}
+
+size_t Histogram::bucketIndex(uint64_t value) {
+  if (value < SUB_BUCKETS) {
+    return value;
+  }
+  // The position of the highest bit selects the power of two, the bits below
+  // it the sub bucket
+  int magnitude = 63 - __builtin_clzll(value);
+  int shift = magnitude - SUB_BUCKET_BITS;
+  return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+MetricsRegistry &MetricsRegistry::global() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+MetricsRegistry::Family &MetricsRegistry::family(const std::string &name,
+                                                 const std::string &type,
+                                                 const std::string &help) {
+  Family &family = _families[name];
+  if (family.type.empty()) {
+    family.type = type;
+    family.help = help;
+  } else if (family.type != type) {
+    throw std::runtime_error("The metric " + name + " is a " + family.type);
+  }
+  return family;
+}
+
+Counter &MetricsRegistry::counter(const std::string &name,
+                                  const std::string &help,
+                                  const std::string &labels) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::unique_ptr<Counter> &counter =
+      family(name, "counter", help).counters[labels];
+  if (!counter) {
+    counter.reset(new Counter());
+  }
+  return *counter;
+}
+
+Gauge &MetricsRegistry::gauge(const std::string &name, const std::string &help,
+                              const std::string &labels) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::unique_ptr<Gauge> &gauge = family(name, "gauge", help).gauges[labels];
+  if (!gauge) {
+    gauge.reset(new Gauge());
+  }
+  return *gauge;
+}
+
+Histogram &MetricsRegistry::histogram(const std::string &name,
+                                      const std::string &help,
+                                      HistogramUnit unit,
+                                      const std::string &labels) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::unique_ptr<Histogram> &histogram =
+      family(name, "histogram", help).histograms[labels];
+  if (!histogram) {
+    histogram.reset(new Histogram(unit));
+  }
+  return *histogram;
+}
+
+std::string MetricsRegistry::prometheusText() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::ostringstream out;
+  out << std::setprecision(10);
+  for (const std::pair<const std::string, Family> &entry : _families) {
+    const std::string &name = entry.first;
+    const Family &family = entry.second;
+    out << "# HELP " << name << " " << family.help << "\n";
+    out << "# TYPE " << name << " " << family.type << "\n";
+    for (const std::pair<const std::string, std::unique_ptr<Counter>> &c :
+         family.counters) {
+      out << name << withLabels(c.first) << " " << c.second->value() << "\n";
+    }
+    for (const std::pair<const std::string, std::unique_ptr<Gauge>> &g :
+         family.gauges) {
+      out << name << withLabels(g.first) << " " << g.second->value() << "\n";
+    }
+    for (const std::pair<const std::string, std::unique_ptr<Histogram>> &h :
+         family.histograms) {
+      const Histogram &histogram = *h.second;
+      bool duration = histogram.unit() == HistogramUnit::NANOSECONDS;
+      double scale = duration ? 1e-9 : 1;
+      int min_exponent = duration ? MIN_DURATION_EXPONENT : MIN_COUNT_EXPONENT;
+      int max_exponent = duration ? MAX_DURATION_EXPONENT : MAX_COUNT_EXPONENT;
+      // Values are added to their bucket before the count, the buckets are
+      // capped so they never exceed it
+      uint64_t count = histogram.count();
+      for (int e = min_exponent; e <= max_exponent; e++) {
+        // Prometheus buckets include their bound. The values are integers,
+        // so the values below 2^e are the ones up to 2^e - 1.
+        std::ostringstream le;
+        le << std::setprecision(10) << ((uint64_t(1) << e) - 1) * scale;
+        out << name << "_bucket"
+            << withLabel(h.first, "le=\"" + le.str() + "\"") << " "
+            << std::min(count, histogram.countBelow(e)) << "\n";
+      }
+      out << name << "_bucket" << withLabel(h.first, "le=\"+Inf\"") << " "
+          << count << "\n";
+      out << name << "_sum" << withLabels(h.first) << " "
+          << histogram.sum() * scale << "\n";
+      out << name << "_count" << withLabels(h.first) << " " << count << "\n";
+    }
+  }
+  return out.str();
+}
+
+} // namespace smartwater
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace smartwater {
+
+// A monotonically increasing count
+class Counter {
+public:
+  void add(uint64_t n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t value() const { return _value.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> _value{0};
+};
+
+// A value that is set, like the duration of the last load
+class Gauge {
+public:
+  void set(double value) { _value.store(value, std::memory_order_relaxed); }
+  double value() const { return _value.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<double> _value{0};
+};
+
+// What the values recorded in a histogram are
+enum class HistogramUnit {
+  // Durations, exported in seconds
+  NANOSECONDS,
+  // Plain numbers, like the size of a result
+  COUNT
+};
+
+// Counts values in log linear buckets like an HDR histogram. Every power of
+// two is split into SUB_BUCKETS buckets of equal width, so the bucket of a
+// value is within 1 / SUB_BUCKETS of it over the whole range of uint64_t.
+// Recording a value takes three relaxed atomic additions.
+class Histogram {
+public:
+  static const int SUB_BUCKET_BITS = 3;
+  static const uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BUCKET_BITS;
+  static const size_t NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  explicit Histogram(HistogramUnit unit) : _unit(unit) {}
+
+  void record(uint64_t value);
+  // Records the nanoseconds passed since start
+  void recordSince(std::chrono::steady_clock::time_point start) {
+    record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+               .count());
+  }
+
+  HistogramUnit unit() const { return _unit; }
+  uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+  uint64_t sum() const { return _sum.load(std::memory_order_relaxed); }
+  // The number of recorded values smaller than 2^exponent
+  uint64_t countBelow(int exponent) const;
+
+private:
+  static size_t bucketIndex(uint64_t value);
+
+  HistogramUnit _unit;
+  std::atomic<uint64_t> _buckets[NUM_BUCKETS] = {};
+  std::atomic<uint64_t> _count{0};
+  std::atomic<uint64_t> _sum{0};
+};
+
+// Records the time from construction to destruction in a histogram
+class ScopedTimer {
+public:
+  explicit ScopedTimer(Histogram *histogram)
+      : _histogram(histogram), _start(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() { _histogram->recordSince(_start); }
+
+private:
+  Histogram *_histogram;
+  std::chrono::steady_clock::time_point _start;
+};
+
+// The metrics of the process. Metrics are registered by name and an optional
+// label set like 'route="/sensors"', and live as long as the process, so
+// callers keep references to them and update them without locking.
+class MetricsRegistry {
+public:
+  static MetricsRegistry &global();
+
+  // Returns the metric with the name and labels, registering it on the first
+  // call. Throws if the name was registered as a different type.
+  Counter &counter(const std::string &name, const std::string &help,
+                   const std::string &labels = "");
+  Gauge &gauge(const std::string &name, const std::string &help,
+               const std::string &labels = "");
+  Histogram &histogram(const std::string &name, const std::string &help,
+                       HistogramUnit unit, const std::string &labels = "");
+
+  // All metrics in the Prometheus text format. Histograms are exported with
+  // a bucket for every power of two of their range.
+  std::string prometheusText() const;
+
+private:
+  struct Family {
+    std::string type;
+    std::string help;
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::unique_ptr<Gauge>> gauges;
+    std::map<std::string, std::unique_ptr<Histogram>> histograms;
+  };
+
+  Family &family(const std::string &name, const std::string &type,
+                 const std::string &help);
+
+  mutable std::mutex _mutex;
+  std::map<std::string, Family> _families;
+};
+
+} // namespace smartwater
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace smartwater {
+
+// A bounded queue for any number of producers and a single consumer. Every
+// slot carries a sequence number telling whether it is free or filled for
+// the current round of the ring, so neither side takes any locks. Producers
+// claim a position by advancing the head, the consumer owns the tail.
+template <typename T> class MpscQueue {
+public:
+  // The capacity is rounded up to a power of two
+  explicit MpscQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    _mask = size - 1;
+    _slots.reset(new Slot[size]);
+    for (size_t i = 0; i < size; i++) {
+      _slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpscQueue(const MpscQueue &other) = delete;
+  MpscQueue &operator=(const MpscQueue &other) = delete;
+
+  size_t capacity() const { return _mask + 1; }
+
+  // Returns false if the queue is full
+  bool tryPush(T value) {
+    size_t position = _head.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true) {
+      slot = &_slots[position & _mask];
+      size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence) -
+                      static_cast<intptr_t>(position);
+      if (diff == 0) {
+        // The slot is free, claim it
+        if (_head.compare_exchange_weak(position, position + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // The consumer has not freed the slot of the previous round yet
+        return false;
+      } else {
+        // Another producer claimed the position
+        position = _head.load(std::memory_order_relaxed);
+      }
+    }
+    slot->value = std::move(value);
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Only called by the consumer. Returns false if the queue is empty or the
+  // next element is still being written.
+  bool tryPop(T *value) {
+    Slot &slot = _slots[_tail & _mask];
+    if (slot.sequence.load(std::memory_order_acquire) != _tail + 1) {
+      return false;
+    }
+    *value = std::move(slot.value);
+    // Free the slot for the next round
+    slot.sequence.store(_tail + _mask + 1, std::memory_order_release);
+    _tail++;
+    return true;
+  }
+
+  // Only called by the consumer
+  bool empty() const {
+    return _slots[_tail & _mask].sequence.load(std::memory_order_acquire) !=
+           _tail + 1;
+  }
+
+private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  std::unique_ptr<Slot[]> _slots;
+  size_t _mask;
+  // The producers and the consumer write to different cache lines
+  alignas(64) std::atomic<size_t> _head{0};
+  alignas(64) size_t _tail = 0;
+};
+} // namespace smartwater
@@ -0,0 +1,266 @@
+#include "octree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <utility>
+
+namespace smartwater {
+
+namespace {
+constexpr double EARTH_RADIUS = 6378000;
+
+void toUnitVector(double latitude, double longitude, double *out) {
+  double lat = latitude * M_PI / 180;
+  double lon = longitude * M_PI / 180;
+  out[0] = cos(lat) * cos(lon);
+  out[1] = cos(lat) * sin(lon);
+  out[2] = sin(lat);
+}
+
+double distSquared(const double *a, double x, double y, double z) {
+  double dx = a[0] - x;
+  double dy = a[1] - y;
+  double dz = a[2] - z;
+  return dx * dx + dy * dy + dz * dz;
+}
+
+// Appends the ids of the points whose dot product with q is at least min_dot.
+// The dot products of a block are computed in a loop of their own, which the
+// compiler turns into SIMD instructions, and the ids are then copied without
+// branches so that points near the boundary cause no mispredictions.
+void appendWithinDot(const double *x, const double *y, const double *z,
+                     const uint64_t *ids, size_t n, const double *q,
+                     double min_dot, std::vector<uint64_t> *result) {
+  constexpr size_t BLOCK_SIZE = 64;
+  const double qx = q[0];
+  const double qy = q[1];
+  const double qz = q[2];
+  double dots[BLOCK_SIZE];
+  for (size_t begin = 0; begin < n; begin += BLOCK_SIZE) {
+    size_t count = std::min(BLOCK_SIZE, n - begin);
+    for (size_t i = 0; i < count; i++) {
+      dots[i] = x[begin + i] * qx + y[begin + i] * qy + z[begin + i] * qz;
+    }
+    size_t offset = result->size();
+    result->resize(offset + count);
+    uint64_t *out = result->data() + offset;
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++) {
+      out[found] = ids[begin + i];
+      found += dots[i] >= min_dot;
+    }
+    result->resize(offset + found);
+  }
+}
+} // namespace
+
+void Octree::Points::push_back(const Point &p) {
+  x.push_back(p.x);
+  y.push_back(p.y);
+  z.push_back(p.z);
+  ids.push_back(p.id);
+}
+
+Octree::Point Octree::Points::operator[](size_t i) const {
+  return Point{x[i], y[i], z[i], ids[i]};
+}
+
+Octree::Octree() : _size(0) {
+  // The root cell contains the entire unit sphere
+  _nodes.emplace_back();
+  _nodes[0].center[0] = 0;
+  _nodes[0].center[1] = 0;
+  _nodes[0].center[2] = 0;
+  _nodes[0].half_size = 1.0001;
+}
+
+size_t Octree::size() const { return _size; }
+
+void Octree::insert(uint64_t id, double latitude, double longitude) {
+  double v[3];
+  toUnitVector(latitude, longitude, v);
+  Point p;
+  p.x = v[0];
+  p.y = v[1];
+  p.z = v[2];
+  p.id = id;
+  insertInto(0, p);
+  _size++;
+}
+
+void Octree::insertInto(uint32_t node_idx, const Point &p) {
+  while (_nodes[node_idx].first_child != 0) {
+    node_idx = _nodes[node_idx].first_child + childIndex(_nodes[node_idx], p);
+  }
+  _nodes[node_idx].points.push_back(p);
+  if (_nodes[node_idx].points.size() > MAX_LEAF_SIZE &&
+      _nodes[node_idx].depth < MAX_DEPTH) {
+    split(node_idx);
+  }
+}
+
+void Octree::split(uint32_t node_idx) {
+  uint32_t first_child = _nodes.size();
+  // This may invalidate references into _nodes
+  _nodes.resize(_nodes.size() + 8);
+  Node &node = _nodes[node_idx];
+  double child_half = node.half_size / 2;
+  for (int i = 0; i < 8; i++) {
+    Node &child = _nodes[first_child + i];
+    child.center[0] = node.center[0] + ((i & 1) ? child_half : -child_half);
+    child.center[1] = node.center[1] + ((i & 2) ? child_half : -child_half);
+    child.center[2] = node.center[2] + ((i & 4) ? child_half : -child_half);
+    child.half_size = child_half;
+    child.depth = node.depth + 1;
+  }
+  node.first_child = first_child;
+
+  Points points;
+  std::swap(points, node.points);
+  for (size_t i = 0; i < points.size(); i++) {
+    // Children of a freshly split node are leaves, so no need to descend
+    // further than one level. Overfull children are split recursively.
+    insertInto(node_idx, points[i]);
+  }
+}
+
+int Octree::childIndex(const Node &node, const Point &p) const {
+  return (p.x >= node.center[0] ? 1 : 0) | (p.y >= node.center[1] ? 2 : 0) |
+         (p.z >= node.center[2] ? 4 : 0);
+}
+
+double Octree::boxDistSquared(const Node &node, const double *p) const {
+  double d = 0;
+  for (int i = 0; i < 3; i++) {
+    double delta = std::abs(p[i] - node.center[i]) - node.half_size;
+    if (delta > 0) {
+      d += delta * delta;
+    }
+  }
+  return d;
+}
+
+double Octree::boxMaxDistSquared(const Node &node, const double *p) const {
+  double d = 0;
+  for (int i = 0; i < 3; i++) {
+    double delta = std::abs(p[i] - node.center[i]) + node.half_size;
+    d += delta * delta;
+  }
+  return d;
+}
+
+void Octree::collect(uint32_t node_idx, std::vector<uint64_t> *result) const {
+  const Node &node = _nodes[node_idx];
+  if (node.first_child == 0) {
+    result->insert(result->end(), node.points.ids.begin(),
+                   node.points.ids.end());
+    return;
+  }
+  for (uint32_t i = 0; i < 8; i++) {
+    collect(node.first_child + i, result);
+  }
+}
+
+std::vector<uint64_t> Octree::queryRadius(double latitude, double longitude,
+                                          double dist) const {
+  std::vector<uint64_t> result;
+  if (dist < 0 || _size == 0) {
+    return result;
+  }
+  double q[3];
+  toUnitVector(latitude, longitude, q);
+
+  // The angle between the query and a point on the unit sphere is at most
+  // theta iff the chord between them is at most 2 * sin(theta / 2).
+  double theta = std::min(dist / EARTH_RADIUS, M_PI);
+  double chord = 2 * sin(theta / 2);
+  double max_chord_sq = chord * chord;
+  double min_dot = cos(theta);
+
+  std::vector<uint32_t> stack;
+  stack.push_back(0);
+  while (!stack.empty()) {
+    uint32_t node_idx = stack.back();
+    stack.pop_back();
+    const Node &node = _nodes[node_idx];
+    if (boxDistSquared(node, q) > max_chord_sq) {
+      continue;
+    }
+    if (boxMaxDistSquared(node, q) <= max_chord_sq) {
+      // The whole cell is inside the query sphere
+      collect(node_idx, &result);
+      continue;
+    }
+    if (node.first_child != 0) {
+      for (uint32_t i = 0; i < 8; i++) {
+        stack.push_back(node.first_child + i);
+      }
+      continue;
+    }
+    const Points &points = node.points;
+    appendWithinDot(points.x.data(), points.y.data(), points.z.data(),
+                    points.ids.data(), points.size(), q, min_dot, &result);
+  }
+  return result;
+}
+
+std::vector<uint64_t> Octree::queryNearest(double latitude, double longitude,
+                                           size_t k) const {
+  std::vector<uint64_t> result;
+  if (k == 0 || _size == 0) {
+    return result;
+  }
+  double q[3];
+  toUnitVector(latitude, longitude, q);
+
+  // Cells are visited in order of their distance to the query point. Once the
+  // closest unvisited cell is further away than the k-th best candidate the
+  // search is done.
+  typedef std::pair<double, uint32_t> CellEntry;
+  std::priority_queue<CellEntry, std::vector<CellEntry>,
+                      std::greater<CellEntry>>
+      cells;
+  // A max heap of the best k candidates found so far.
+  typedef std::pair<double, uint64_t> Candidate;
+  std::priority_queue<Candidate> best;
+
+  cells.emplace(boxDistSquared(_nodes[0], q), 0);
+  while (!cells.empty()) {
+    CellEntry top = cells.top();
+    cells.pop();
+    if (best.size() == k && top.first > best.top().first) {
+      break;
+    }
+    const Node &node = _nodes[top.second];
+    if (node.first_child != 0) {
+      for (uint32_t i = 0; i < 8; i++) {
+        const Node &child = _nodes[node.first_child + i];
+        if (child.first_child == 0 && child.points.empty()) {
+          continue;
+        }
+        cells.emplace(boxDistSquared(child, q), node.first_child + i);
+      }
+      continue;
+    }
+    const Points &points = node.points;
+    for (size_t i = 0; i < points.size(); i++) {
+      double d = distSquared(q, points.x[i], points.y[i], points.z[i]);
+      if (best.size() < k) {
+        best.emplace(d, points.ids[i]);
+      } else if (d < best.top().first) {
+        best.pop();
+        best.emplace(d, points.ids[i]);
+      }
+    }
+  }
+
+  result.resize(best.size());
+  for (size_t i = result.size(); i > 0; i--) {
+    result[i - 1] = best.top().second;
+    best.pop();
+  }
+  return result;
+}
+
+} // namespace smartwater
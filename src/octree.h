@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace smartwater {
+
+// A spatial index over points on the earths surface. Points are converted
+// into earth centered, earth fixed (ECEF) coordinates on the unit sphere and
+// stored in an octree. Radius queries only visit cells that intersect the
+// query sphere and then refine with an exact great circle distance check.
+//
+// The coordinates are computed once on insert and every leaf keeps them as a
+// structure of arrays, so the distance check is a dot product threshold over
+// contiguous arrays that the compiler can vectorize.
+class Octree {
+  // Leaves are split once they contain more than this many points.
+  static const size_t MAX_LEAF_SIZE = 32;
+  // Cells are never split beyond this depth (the cell size at this depth is
+  // ~0.1m on the earths surface).
+  static const int MAX_DEPTH = 24;
+
+  struct Point {
+    double x;
+    double y;
+    double z;
+    uint64_t id;
+  };
+
+  // The points of a leaf, one array per coordinate
+  struct Points {
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> z;
+    std::vector<uint64_t> ids;
+
+    size_t size() const { return ids.size(); }
+    bool empty() const { return ids.empty(); }
+    void push_back(const Point &p);
+    Point operator[](size_t i) const;
+  };
+
+  struct Node {
+    double center[3];
+    double half_size;
+    // The index of the first of the eight children in _nodes, 0 for leaves.
+    uint32_t first_child = 0;
+    uint32_t depth = 0;
+    Points points;
+  };
+
+public:
+  Octree();
+
+  void insert(uint64_t id, double latitude, double longitude);
+
+  // Returns the ids of all points within dist meters of the given position.
+  std::vector<uint64_t> queryRadius(double latitude, double longitude,
+                                    double dist) const;
+
+  // Returns the ids of the k points closest to the given position, ordered by
+  // increasing distance.
+  std::vector<uint64_t> queryNearest(double latitude, double longitude,
+                                     size_t k) const;
+
+  size_t size() const;
+
+private:
+  void insertInto(uint32_t node_idx, const Point &p);
+  void split(uint32_t node_idx);
+  int childIndex(const Node &node, const Point &p) const;
+
+  // The squared euclidean distance between the point and the nodes box.
+  double boxDistSquared(const Node &node, const double *p) const;
+  // The squared euclidean distance between the point and the furthest corner
+  // of the nodes box.
+  double boxMaxDistSquared(const Node &node, const double *p) const;
+
+  // Appends the ids of all points below the node.
+  void collect(uint32_t node_idx, std::vector<uint64_t> *result) const;
+
+  std::vector<Node> _nodes;
+  size_t _size;
+};
+
+} // namespace smartwater
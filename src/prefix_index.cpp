@@ -0,0 +1,140 @@
+#include "prefix_index.h"
+
+#include <algorithm>
+#include <cctype>
+#include <queue>
+#include <tuple>
+
+namespace smartwater {
+
+namespace {
+std::string lowercase(const std::string &s) {
+  std::string lower = s;
+  std::transform(lower.begin(), lower.end(), lower.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return lower;
+}
+} // namespace
+
+PrefixIndex::PrefixIndex() : _size(0) {
+  // The root has an empty label
+  _nodes.emplace_back();
+}
+
+size_t PrefixIndex::size() const { return _size; }
+
+void PrefixIndex::insert(const std::string &s, uint64_t id) {
+  if (s.empty()) {
+    return;
+  }
+  std::string key = lowercase(s);
+  uint32_t node_idx = 0;
+  size_t pos = 0;
+  while (pos < key.size()) {
+    size_t c = findChild(_nodes[node_idx], key[pos]);
+    const std::vector<uint32_t> &children = _nodes[node_idx].children;
+    if (c == children.size() ||
+        _nodes[children[c]].label[0] != static_cast<char>(key[pos])) {
+      // The rest of the key becomes a new leaf. The nodes may move when
+      // adding one, so only indices are kept across the emplace.
+      uint32_t leaf_idx = _nodes.size();
+      _nodes.emplace_back();
+      _nodes[leaf_idx].label = key.substr(pos);
+      std::vector<uint32_t> &parent_children = _nodes[node_idx].children;
+      parent_children.insert(parent_children.begin() + c, leaf_idx);
+      node_idx = leaf_idx;
+      break;
+    }
+    uint32_t child_idx = children[c];
+    const std::string &label = _nodes[child_idx].label;
+    size_t common = 0;
+    while (common < label.size() && pos + common < key.size() &&
+           label[common] == key[pos + common]) {
+      common++;
+    }
+    if (common < label.size()) {
+      // Split the edge where the key leaves it
+      uint32_t mid_idx = _nodes.size();
+      _nodes.emplace_back();
+      Node &child = _nodes[child_idx];
+      Node &mid = _nodes[mid_idx];
+      mid.label = child.label.substr(0, common);
+      child.label.erase(0, common);
+      mid.children.push_back(child_idx);
+      _nodes[node_idx].children[c] = mid_idx;
+      child_idx = mid_idx;
+    }
+    node_idx = child_idx;
+    pos += common;
+  }
+
+  Node &node = _nodes[node_idx];
+  if (node.ids.empty()) {
+    node.text = s;
+    _size++;
+  }
+  std::vector<uint64_t>::iterator it =
+      std::lower_bound(node.ids.begin(), node.ids.end(), id);
+  if (it == node.ids.end() || *it != id) {
+    node.ids.insert(it, id);
+  }
+}
+
+std::vector<PrefixIndex::Completion>
+PrefixIndex::complete(const std::string &prefix, size_t limit) const {
+  std::vector<Completion> completions;
+  if (limit == 0) {
+    return completions;
+  }
+  // Find the first node whose key starts with the prefix
+  std::string key = lowercase(prefix);
+  uint32_t node_idx = 0;
+  size_t pos = 0;
+  while (pos < key.size()) {
+    const Node &node = _nodes[node_idx];
+    size_t c = findChild(node, key[pos]);
+    if (c == node.children.size()) {
+      return completions;
+    }
+    const std::string &label = _nodes[node.children[c]].label;
+    size_t n = std::min(label.size(), key.size() - pos);
+    if (label.compare(0, n, key, pos, n) != 0) {
+      return completions;
+    }
+    node_idx = node.children[c];
+    // The prefix may end within the label
+    key.append(label, n, std::string::npos);
+    pos += label.size();
+  }
+
+  // Visit the subtree by increasing length and then alphabetically. Every
+  // child sorts after its parent, so the nodes are visited in order.
+  typedef std::tuple<size_t, std::string, uint32_t> Entry;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+  queue.emplace(key.size(), key, node_idx);
+  while (!queue.empty() && completions.size() < limit) {
+    Entry entry = queue.top();
+    queue.pop();
+    const Node &node = _nodes[std::get<2>(entry)];
+    if (!node.ids.empty()) {
+      completions.push_back(Completion{node.text, node.ids});
+    }
+    for (uint32_t child_idx : node.children) {
+      const std::string &label = _nodes[child_idx].label;
+      queue.emplace(std::get<0>(entry) + label.size(),
+                    std::get<1>(entry) + label, child_idx);
+    }
+  }
+  return completions;
+}
+
+size_t PrefixIndex::findChild(const Node &node, unsigned char c) const {
+  std::vector<uint32_t>::const_iterator it = std::lower_bound(
+      node.children.begin(), node.children.end(), c,
+      [this](uint32_t child_idx, unsigned char c) {
+        return static_cast<unsigned char>(_nodes[child_idx].label[0]) < c;
+      });
+  return it - node.children.begin();
+}
+
+} // namespace smartwater
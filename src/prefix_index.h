@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace smartwater {
+
+// Completes prefixes to the strings added to the index, ignoring case. The
+// lowercased strings are stored in a radix tree (a trie whose chains of
+// single children are merged into one edge), so finding the subtree of a
+// prefix only takes as many steps as the prefix has bytes.
+class PrefixIndex {
+public:
+  struct Completion {
+    // The string as it was first added
+    std::string text;
+    // The ids the string was added for, in increasing order
+    std::vector<uint64_t> ids;
+  };
+
+  PrefixIndex();
+
+  // Empty strings are ignored.
+  void insert(const std::string &s, uint64_t id);
+
+  // Returns up to limit strings starting with prefix. Shorter strings come
+  // first, strings of the same length are ordered alphabetically.
+  std::vector<Completion> complete(const std::string &prefix,
+                                   size_t limit) const;
+
+  // The number of distinct strings
+  size_t size() const;
+
+private:
+  struct Node {
+    // The lowercased bytes on the edge from the parent
+    std::string label;
+    // Ordered by the first byte of their labels
+    std::vector<uint32_t> children;
+    // The string ending at this node, if ids is not empty
+    std::string text;
+    std::vector<uint64_t> ids;
+  };
+
+  // Returns the position of the child whose label starts with c, or where it
+  // would have to be inserted.
+  size_t findChild(const Node &node, unsigned char c) const;
+
+  std::vector<Node> _nodes;
+  size_t _size;
+};
+
+} // namespace smartwater
@@ -1,61 +1,262 @@
 #pragma once
 
 #include <algorithm>
+#include <cctype>
 #include <cstdint>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
-#include <iostream>
+#include "edit_distance.h"
+#include "snapshot.h"
 
+// Finds the ids of the strings sharing the most q-grams with a query. The
+// q-grams of the lowercased strings are packed into integer keys, every key
+// maps to a sorted list of the ids whose strings contain the gram.
+//
+// The lowercased strings are kept per id as well, for fuzzy queries that
+// verify the candidates by their edit distance. Ids are expected to be dense.
 template <int Q> class QGramIndex {
+  static_assert(Q >= 1 && Q <= 4, "The q-grams have to fit into 32 bits");
+
 public:
+  typedef uint32_t Gram;
+
   QGramIndex() {}
 
   void addMapping(const std::string &s, uint64_t id) {
-    std::string key = std::string(Q - 1, '$') + s + std::string(Q - 1, '$');
-    std::transform(key.begin(), key.end(), key.begin(),
-                   [](unsigned char c) { return std::tolower(c); });
-    for (size_t i = 0; i < key.size() - Q + 1; i++) {
-      std::string gram = key.substr(i, Q);
-      _document_map[gram].push_back(id);
+    if (_strings.size() <= id) {
+      _strings.resize(id + 1);
+    }
+    std::string lower = lowercase(s);
+    std::vector<std::string> &strings = _strings[id];
+    if (std::find(strings.begin(), strings.end(), lower) == strings.end()) {
+      strings.push_back(lower);
+    }
+    forEachGram(lower, [this, id](Gram gram) {
+      std::vector<uint64_t> &ids = _document_map[gram];
+      if (ids.empty() || ids.back() < id) {
+        // Ids are usually added in increasing order
+        ids.push_back(id);
+      } else {
+        std::vector<uint64_t>::iterator it =
+            std::lower_bound(ids.begin(), ids.end(), id);
+        if (*it != id) {
+          ids.insert(it, id);
+        }
+      }
+    });
+  }
+
+  // Returns up to limit ids ordered by the number of distinct q-grams they
+  // share with s, ties are ordered by id. The posting lists of the grams are
+  // merged with a heap, so only the limit best ids are kept in memory. The
+  // number of ids sharing any gram is stored in num_candidates and the number
+  // of grams every returned id shares in num_shared if given.
+  std::vector<uint64_t> query(const std::string &s, size_t limit,
+                              size_t *num_candidates = nullptr,
+                              std::vector<size_t> *num_shared = nullptr) const {
+    std::vector<uint64_t> ranked_ids;
+    if (limit == 0) {
+      return ranked_ids;
+    }
+    std::vector<Gram> grams = distinctGrams(lowercase(s));
+
+    // A min heap of the best ids seen so far, its top is the worst of them
+    typedef std::pair<size_t, uint64_t> Match;
+    std::vector<Match> best;
+    best.reserve(std::min<size_t>(limit, 1024) + 1);
+    auto better = [](const Match &m1, const Match &m2) {
+      return m1.first > m2.first ||
+             (m1.first == m2.first && m1.second < m2.second);
+    };
+    size_t candidates = 0;
+    mergePostings(grams, [&best, &better, &candidates, limit](uint64_t id,
+                                                             size_t count) {
+      candidates++;
+      Match match(count, id);
+      if (best.size() < limit) {
+        best.push_back(match);
+        std::push_heap(best.begin(), best.end(), better);
+      } else if (better(match, best.front())) {
+        std::pop_heap(best.begin(), best.end(), better);
+        best.back() = match;
+        std::push_heap(best.begin(), best.end(), better);
+      }
+    });
+    std::sort_heap(best.begin(), best.end(), better);
+    if (num_candidates != nullptr) {
+      *num_candidates = candidates;
+    }
+    ranked_ids.reserve(best.size());
+    for (const Match &match : best) {
+      ranked_ids.push_back(match.second);
+      if (num_shared != nullptr) {
+        num_shared->push_back(match.first);
+      }
+    }
+    return ranked_ids;
+  }
+
+  // Returns the ids with a string within max_distance edits of s, together
+  // with the smallest distance, ordered by id. Every edit destroys at most Q
+  // of the q-grams of s, so the ids sharing fewer grams are skipped without
+  // computing any distances. The number of ids whose distance had to be
+  // computed is stored in num_candidates if given.
+  std::vector<std::pair<uint64_t, size_t>>
+  fuzzyQuery(const std::string &s, size_t max_distance,
+             size_t *num_candidates = nullptr) const {
+    std::string pattern = lowercase(s);
+    smartwater::EditDistance edit_distance(pattern);
+    std::vector<std::pair<uint64_t, size_t>> matches;
+    size_t candidates = 0;
+    auto verify = [this, &edit_distance, &matches, &candidates,
+                   max_distance](uint64_t id) {
+      candidates++;
+      size_t best = max_distance + 1;
+      for (const std::string &candidate : _strings[id]) {
+        if (best == 0) {
+          break;
+        }
+        best = std::min(best, edit_distance.distance(candidate, best - 1));
+      }
+      if (best <= max_distance) {
+        matches.emplace_back(id, best);
+      }
+    };
+
+    std::vector<Gram> grams = distinctGrams(pattern);
+    if (grams.size() <= max_distance * Q) {
+      // The filter can not rule out any string
+      for (uint64_t id = 0; id < _strings.size(); id++) {
+        verify(id);
+      }
+    } else {
+      size_t min_count = grams.size() - max_distance * Q;
+      mergePostings(grams, [&verify, min_count](uint64_t id, size_t count) {
+        if (count >= min_count) {
+          verify(id);
+        }
+      });
+    }
+    if (num_candidates != nullptr) {
+      *num_candidates = candidates;
+    }
+    return matches;
+  }
+
+  void serialize(smartwater::SnapshotWriter *writer) const {
+    writer->write<uint64_t>(_document_map.size());
+    for (const std::pair<const Gram, std::vector<uint64_t>> &p :
+         _document_map) {
+      writer->write(p.first);
+      writer->write<uint64_t>(p.second.size());
+      writer->write(p.second.data(), p.second.size() * sizeof(uint64_t));
+    }
+    writer->write<uint64_t>(_strings.size());
+    for (const std::vector<std::string> &strings : _strings) {
+      writer->write<uint64_t>(strings.size());
+      for (const std::string &string : strings) {
+        writer->writeString(string);
+      }
+    }
+  }
+
+  void deserialize(smartwater::SnapshotReader *reader) {
+    _document_map.clear();
+    uint64_t num_grams = reader->read<uint64_t>();
+    _document_map.reserve(num_grams);
+    for (uint64_t i = 0; i < num_grams; i++) {
+      std::vector<uint64_t> &ids = _document_map[reader->read<Gram>()];
+      ids.resize(reader->read<uint64_t>());
+      reader->read(ids.data(), ids.size() * sizeof(uint64_t));
+    }
+    _strings.resize(reader->read<uint64_t>());
+    for (std::vector<std::string> &strings : _strings) {
+      strings.resize(reader->read<uint64_t>());
+      for (std::string &string : strings) {
+        string = reader->readString();
+      }
     }
   }
 
-  std::vector<uint64_t> query(const std::string &s, size_t limit) const {
-    std::unordered_map<uint64_t, size_t> counts;
-    std::string key = std::string(Q - 1, '$') + s + std::string(Q - 1, '$');
-    std::transform(key.begin(), key.end(), key.begin(),
+private:
+  static std::string lowercase(const std::string &s) {
+    std::string lower = s;
+    std::transform(lower.begin(), lower.end(), lower.begin(),
                    [](unsigned char c) { return std::tolower(c); });
-    for (size_t i = 0; i < key.size() - Q + 1; i++) {
-      std::string gram = key.substr(i, Q);
+    return lower;
+  }
+
+  static std::vector<Gram> distinctGrams(const std::string &s) {
+    std::vector<Gram> grams;
+    grams.reserve(s.size() + Q - 1);
+    forEachGram(s, [&grams](Gram gram) { grams.push_back(gram); });
+    std::sort(grams.begin(), grams.end());
+    grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+    return grams;
+  }
 
-      std::unordered_map<std::string, std::vector<uint64_t>>::const_iterator
-          it = _document_map.find(gram);
+  // Merges the posting lists of the grams with a heap and calls f with every
+  // id and the number of the grams it has, in the order of the ids.
+  template <typename F>
+  void mergePostings(const std::vector<Gram> &grams, F f) const {
+    // The current position in every posting list
+    typedef std::vector<uint64_t>::const_iterator Cursor;
+    std::vector<std::pair<Cursor, Cursor>> cursors;
+    cursors.reserve(grams.size());
+    for (Gram g : grams) {
+      typename std::unordered_map<Gram, std::vector<uint64_t>>::const_iterator
+          it = _document_map.find(g);
       if (it != _document_map.end()) {
-        for (uint64_t id : it->second) {
-          counts[id]++;
+        cursors.emplace_back(it->second.begin(), it->second.end());
+      }
+    }
+    // A min heap of the cursors by their current id
+    std::vector<size_t> merge(cursors.size());
+    for (size_t i = 0; i < merge.size(); i++) {
+      merge[i] = i;
+    }
+    auto later = [&cursors](size_t c1, size_t c2) {
+      return *cursors[c1].first > *cursors[c2].first;
+    };
+    std::make_heap(merge.begin(), merge.end(), later);
+    while (!merge.empty()) {
+      uint64_t id = *cursors[merge.front()].first;
+      size_t count = 0;
+      // Pop the id from every list containing it
+      while (!merge.empty() && *cursors[merge.front()].first == id) {
+        std::pop_heap(merge.begin(), merge.end(), later);
+        std::pair<Cursor, Cursor> &cursor = cursors[merge.back()];
+        count++;
+        if (++cursor.first == cursor.second) {
+          merge.pop_back();
+        } else {
+          std::push_heap(merge.begin(), merge.end(), later);
         }
       }
+      f(id, count);
     }
-    std::vector<std::pair<uint64_t, size_t>> sorted_counts;
-    sorted_counts.reserve(counts.size());
-    for (const std::pair<const uint64_t, size_t> &p : counts) {
-      sorted_counts.push_back(p);
+  }
+
+  // Calls f with the key of every q-gram of s, padded by Q - 1 '$' on both
+  // sides. The key holds the characters of the gram from the most
+  // significant byte used on.
+  template <typename F> static void forEachGram(const std::string &s, F f) {
+    const Gram mask = Q == 4 ? ~Gram(0) : (Gram(1) << (8 * Q)) - 1;
+    Gram gram = 0;
+    for (int i = 0; i < Q - 1; i++) {
+      gram = (gram << 8) | '$';
     }
-    std::sort(sorted_counts.begin(), sorted_counts.end(),
-              [](const std::pair<uint64_t, size_t> &p1,
-                 const std::pair<uint64_t, size_t> &p2) {
-                return p1.second > p2.second;
-              });
-    std::vector<uint64_t> ranked_ids;
-    ranked_ids.reserve(std::min(limit, sorted_counts.size()));
-    for (size_t i = 0; i < limit && i < sorted_counts.size(); i++) {
-      ranked_ids.push_back(sorted_counts[i].first);
+    for (size_t i = 0; i < s.size() + Q - 1; i++) {
+      unsigned char c = i < s.size() ? s[i] : '$';
+      gram = ((gram << 8) | c) & mask;
+      f(gram);
     }
-    return ranked_ids;
   }
 
-private:
-  std::unordered_map<std::string, std::vector<uint64_t>> _document_map;
+  std::unordered_map<Gram, std::vector<uint64_t>> _document_map;
+  // The lowercased strings of every id
+  std::vector<std::vector<std::string>> _strings;
 };
@@ -1,14 +1,83 @@
 #include "server.h"
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <nlohmann/json.hpp>
 
+#include "json_writer.h"
 #include "logger.h"
-#include "util.h"
+#include "metrics.h"
 
 namespace smartwater {
 
-Server::Server(Database *db, const std::string &cert_path,
+// The binary responses are the in memory representation of little endian
+// hosts
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "The binary responses require a little endian host");
+static_assert(sizeof(Measurement) == 16,
+              "Measurements are sent as 16 byte records");
+
+namespace {
+template <typename T> void appendBinary(std::string *buffer, const T &value) {
+  buffer->append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+void appendBinaryString(std::string *buffer, const std::string &s) {
+  // Strings are limited to 64k like in the database file
+  uint16_t len = s.size();
+  appendBinary(buffer, len);
+  buffer->append(s.data(), len);
+}
+
+Histogram &json_parse_time = MetricsRegistry::global().histogram(
+    "smartwater_json_parse_seconds", "The time it takes to parse json bodies",
+    HistogramUnit::NANOSECONDS);
+
+Histogram &jsonEncodeTime(const std::string &response) {
+  return MetricsRegistry::global().histogram(
+      "smartwater_json_encode_seconds",
+      "The time it takes to encode a json response or a chunk of a streamed "
+      "one",
+      HistogramUnit::NANOSECONDS, "response=\"" + response + "\"");
+}
+Histogram &sensors_encode_time = jsonEncodeTime("sensors");
+Histogram &history_encode_time = jsonEncodeTime("history");
+Histogram &aggregates_encode_time = jsonEncodeTime("aggregates");
+Histogram &completions_encode_time = jsonEncodeTime("completions");
+Histogram &markers_encode_time = jsonEncodeTime("markers");
+Histogram &batch_encode_time = jsonEncodeTime("batch");
+
+// Explicit timestamps may be at most this many seconds ahead of the clock of
+// the server. A timestamp far in the future, for example one in
+// milliseconds, would make the database reject every later measurement of
+// the sensor as late.
+const uint64_t MAX_CLOCK_SKEW = 60;
+
+// Thrown when the ingest queue has no room for the measurements of a request
+class QueueFullError : public std::runtime_error {
+public:
+  QueueFullError() : std::runtime_error("The ingest queue is full") {}
+};
+
+// Thrown for batches that would not fit into the ingest queue even if it was
+// empty, retrying them is pointless
+class BatchTooLargeError : public std::runtime_error {
+public:
+  explicit BatchTooLargeError(size_t capacity)
+      : std::runtime_error("A batch holds at most " +
+                           std::to_string(capacity) + " measurements") {}
+};
+
+nlohmann::json parseJson(const std::string &s) {
+  ScopedTimer timer(&json_parse_time);
+  return nlohmann::json::parse(s);
+}
+} // namespace
+
+const char *Server::BINARY_CONTENT_TYPE = "application/octet-stream";
+
+Server::Server(ShardedDatabase *db, const std::string &cert_path,
                const std::string &key_path, uint16_t port)
     : _port(port), _address("0.0.0.0"), _server(), _database(db) {}
 
@@ -17,8 +86,11 @@ void Server::start() {
 
   _server.set_logger(
       [](const httplib::Request &req, const httplib::Response &res) {
-        LOG_INFO << req.method << " request for " << req.path << " : '"
-                 << req.body << "'" << LOG_END;
+        // Every request is logged, so only a few of them are written
+        LOG_LIMITED(INFO, 10) << req.method << " request for " << req.path
+                              << " : " << res.status << LOG_END;
+        LOG_LIMITED(DEBUG, 10) << req.method << " body for " << req.path
+                               << " : '" << req.body << "'" << LOG_END;
       });
 
   _server.set_error_handler([this](const httplib::Request &req,
@@ -40,8 +112,7 @@ void Server::start() {
                     res.set_header("Access-Control-Allow-Headers", "*");
                   });
 
-  _server.Get("/sensors", [this](const httplib::Request &req,
-                                 httplib::Response &res) {
+  get("/sensors", [this](const httplib::Request &req, httplib::Response &res) {
     try {
       using nlohmann::json;
       size_t limit = std::numeric_limits<size_t>::max();
@@ -53,31 +124,62 @@ void Server::start() {
         offset = std::stoul(req.get_param_value("offset"));
       }
 
-      json response;
+      if (req.has_param("minlat") && req.has_param("minlong") &&
+          req.has_param("maxlat") && req.has_param("maxlong")) {
+        // Without a zoom level every sensor is returned individually
+        int zoom = TileIndex::MAX_LEVEL;
+        if (req.has_param("zoom")) {
+          zoom = std::stoi(req.get_param_value("zoom"));
+        }
+        std::vector<TileIndex::Marker> markers = _database->getSensorMarkers(
+            std::stod(req.get_param_value("minlat")),
+            std::stod(req.get_param_value("minlong")),
+            std::stod(req.get_param_value("maxlat")),
+            std::stod(req.get_param_value("maxlong")), zoom);
+        if (acceptsBinary(req)) {
+          sendMarkersBinary(&res, markers);
+        } else {
+          sendMarkers(&res, markers);
+        }
+        setCommonHeaders(&res);
+        return;
+      }
+
+      std::vector<Sensor> sensors;
       if (req.has_param("lat") && req.has_param("long") &&
           req.has_param("dist")) {
         double latitude = std::stod(req.get_param_value("lat"));
         double longitude = std::stod(req.get_param_value("long"));
         double dist = std::stod(req.get_param_value("dist"));
 
-        std::vector<Sensor> sensors = _database->getSensorsCached();
-        response =
-            encodeSensors(sensors, _database,
-                          [latitude, longitude, dist](const Sensor &s) -> bool {
-                            return greatCircleDist(s.longitude, s.latitude,
-                                                   longitude, latitude) <= dist;
-                          });
+        sensors = _database->getSensorsInRadius(latitude, longitude, dist);
+      } else if (req.has_param("lat") && req.has_param("long") &&
+                 req.has_param("nearest")) {
+        double latitude = std::stod(req.get_param_value("lat"));
+        double longitude = std::stod(req.get_param_value("long"));
+        size_t k = std::stoul(req.get_param_value("nearest"));
+
+        sensors = _database->getNearestSensors(latitude, longitude, k);
       } else if (req.has_param("name")) {
         std::string name = req.get_param_value("name");
-        std::vector<Sensor> sensors = _database->searchForSensors(name, limit);
-        response = encodeSensors(sensors, _database);
+        if (req.has_param("fuzzy")) {
+          // The maximum edit distance is optional
+          std::string max_distance = req.get_param_value("fuzzy");
+          sensors = _database->searchForSensorsFuzzy(
+              name, max_distance.empty() ? -1 : std::stoi(max_distance),
+              limit);
+        } else {
+          sensors = _database->searchForSensors(name, limit);
+        }
       } else {
-        std::vector<Sensor> sensors = _database->getSensorsCached();
-        response = encodeSensors(sensors, _database);
+        sensors = _database->getSensorsCached();
       }
-      std::string s = response.dump();
-      res.set_content(s.c_str(), s.length(), "application/json");
       setCommonHeaders(&res);
+      if (acceptsBinary(req)) {
+        streamSensorsBinary(&res, std::move(sensors));
+      } else {
+        streamSensors(&res, std::move(sensors));
+      }
     } catch (const std::exception &e) {
       LOG_ERROR << e.what() << LOG_END;
       res.set_content(e.what(), strlen(e.what()), "application/json");
@@ -90,8 +192,49 @@ void Server::start() {
     }
   });
 
-  _server.Get("/sensor/history", [this](const httplib::Request &req,
-                                        httplib::Response &res) {
+  get("/sensors/complete", [this](const httplib::Request &req,
+                                  httplib::Response &res) {
+    try {
+      std::string prefix = req.get_param_value("prefix");
+      size_t limit = 10;
+      if (req.has_param("limit")) {
+        limit = std::stoul(req.get_param_value("limit"));
+      }
+      std::vector<PrefixIndex::Completion> completions =
+          _database->completeSensorNames(prefix, limit);
+      std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      JsonWriter writer;
+      writer.beginArray();
+      for (const PrefixIndex::Completion &completion : completions) {
+        writer.beginObject();
+        writer.key("name");
+        writer.value(completion.text);
+        writer.key("ids");
+        writer.beginArray();
+        for (uint64_t id : completion.ids) {
+          writer.value(id);
+        }
+        writer.endArray();
+        writer.endObject();
+      }
+      writer.endArray();
+      completions_encode_time.recordSince(start);
+      res.set_content(writer.str(), "application/json");
+      setCommonHeaders(&res);
+    } catch (const std::exception &e) {
+      LOG_ERROR << e.what() << LOG_END;
+      res.set_content(e.what(), strlen(e.what()), "application/json");
+      res.status = 400;
+      setCommonHeaders(&res);
+    } catch (...) {
+      res.set_content("Error", 4, "application/json");
+      res.status = 400;
+      setCommonHeaders(&res);
+    }
+  });
+  get("/sensor/history", [this](const httplib::Request &req,
+                                httplib::Response &res) {
     try {
       using nlohmann::json;
       size_t limit = std::numeric_limits<size_t>::max();
@@ -109,19 +252,35 @@ void Server::start() {
 
       if (req.has_param("id")) {
         uint64_t id = std::stoul(req.get_param_value("id"));
-        std::vector<Measurement> measurements;
-        for (const Measurement &m : _database->getMeasurementsCached(id)) {
-          if (m.timestamp >= t_start && m.timestamp <= t_end) {
-            measurements.push_back(m);
-            if (measurements.size() >= limit) {
-              break;
-            }
+        if (req.has_param("bucket")) {
+          uint64_t bucket_size = std::stoul(req.get_param_value("bucket"));
+          Aggregation aggregation = Aggregation::AVG;
+          if (req.has_param("agg")) {
+            aggregation = parseAggregation(req.get_param_value("agg"));
+          }
+          std::vector<Rollup> buckets = _database->getAggregatedMeasurements(
+              id, t_start, t_end, bucket_size, limit);
+          if (acceptsBinary(req)) {
+            sendAggregatesBinary(&res, buckets, aggregation);
+          } else {
+            std::chrono::steady_clock::time_point start =
+                std::chrono::steady_clock::now();
+            std::string s = encodeAggregates(buckets, aggregation).dump();
+            aggregates_encode_time.recordSince(start);
+            res.set_content(s.c_str(), s.length(), "application/json");
+          }
+          setCommonHeaders(&res);
+        } else {
+          // Returns the most recent measurements if limit is exceeded
+          MeasurementRange measurements =
+              _database->getMeasurementsInRange(id, t_start, t_end, limit);
+          setCommonHeaders(&res);
+          if (acceptsBinary(req)) {
+            streamHistoryBinary(&res, measurements);
+          } else {
+            streamHistory(&res, measurements);
           }
         }
-        json resp = encodeHistory(measurements);
-        std::string s = resp.dump();
-        res.set_content(s.c_str(), s.length(), "application/json");
-        setCommonHeaders(&res);
       } else {
         std::string s = "Invalid Request";
         res.set_content(s.c_str(), s.length(), "text/html");
@@ -138,13 +297,20 @@ void Server::start() {
       setCommonHeaders(&res);
     }
   });
-  _server.Post("/sensor/add_measurement", [this](const httplib::Request &req,
-                                                 httplib::Response &res) {
+  post("/sensor/add_measurement", [this](const httplib::Request &req,
+                                         httplib::Response &res) {
     try {
       using nlohmann::json;
       addMeasurements(req.body);
       res.set_content("Done", 4, "application/json");
       setCommonHeaders(&res);
+    } catch (const QueueFullError &e) {
+      LOG_LIMITED(WARN, 1) << e.what() << LOG_END;
+      res.set_content(e.what(), strlen(e.what()), "application/json");
+      res.status = 503;
+      // Webhooks retry later
+      res.set_header("Retry-After", "1");
+      setCommonHeaders(&res);
     } catch (const std::exception &e) {
       LOG_ERROR << e.what() << LOG_END;
       res.set_content(e.what(), strlen(e.what()), "application/json");
@@ -156,8 +322,42 @@ void Server::start() {
       setCommonHeaders(&res);
     }
   });
-  _server.Post("/sensor/create", [this](const httplib::Request &req,
-                                        httplib::Response &res) {
+  post("/sensor/add_measurements", [this](const httplib::Request &req,
+                                          httplib::Response &res) {
+    try {
+      using nlohmann::json;
+      json resp = addMeasurementBatch(req.body);
+      std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      std::string s = resp.dump();
+      batch_encode_time.recordSince(start);
+      res.set_content(s.c_str(), s.length(), "application/json");
+      setCommonHeaders(&res);
+    } catch (const BatchTooLargeError &e) {
+      LOG_LIMITED(WARN, 1) << e.what() << LOG_END;
+      res.set_content(e.what(), strlen(e.what()), "application/json");
+      res.status = 413;
+      setCommonHeaders(&res);
+    } catch (const QueueFullError &e) {
+      LOG_LIMITED(WARN, 1) << e.what() << LOG_END;
+      res.set_content(e.what(), strlen(e.what()), "application/json");
+      res.status = 503;
+      // Webhooks retry later
+      res.set_header("Retry-After", "1");
+      setCommonHeaders(&res);
+    } catch (const std::exception &e) {
+      LOG_ERROR << e.what() << LOG_END;
+      res.set_content(e.what(), strlen(e.what()), "application/json");
+      res.status = 400;
+      setCommonHeaders(&res);
+    } catch (...) {
+      res.set_content("Error", 4, "application/json");
+      res.status = 400;
+      setCommonHeaders(&res);
+    }
+  });
+  post("/sensor/create", [this](const httplib::Request &req,
+                                httplib::Response &res) {
     using nlohmann::json;
     try {
       addSensor(req.body);
@@ -176,37 +376,234 @@ void Server::start() {
     }
   });
 
+  get("/metrics", [](const httplib::Request &, httplib::Response &res) {
+    res.set_content(MetricsRegistry::global().prometheusText(),
+                    "text/plain; version=0.0.4");
+  });
+
   LOG_INFO << "Starting to listen" << LOG_END;
   if (!_server.listen(_address.c_str(), _port)) {
     LOG_ERROR << "Error when binding to the socket" << LOG_END;
   }
 } // namespace smartwater
 
+void Server::stop() { _server.stop(); }
+
+void Server::enableIngestQueue(size_t capacity) {
+  _ingest.reset(new IngestPipeline(_database, capacity));
+}
+
+void Server::get(const std::string &route, httplib::Server::Handler handler) {
+  _server.Get(route.c_str(), instrument(route, std::move(handler)));
+}
+
+void Server::post(const std::string &route, httplib::Server::Handler handler) {
+  _server.Post(route.c_str(), instrument(route, std::move(handler)));
+}
+
+httplib::Server::Handler Server::instrument(const std::string &route,
+                                            httplib::Server::Handler handler) {
+  std::string labels = "route=\"" + route + "\"";
+  Histogram *latency = &MetricsRegistry::global().histogram(
+      "smartwater_http_request_duration_seconds",
+      "The time it takes to handle a request, streamed responses are only "
+      "timed until they start",
+      HistogramUnit::NANOSECONDS, labels);
+  Counter *errors = &MetricsRegistry::global().counter(
+      "smartwater_http_request_errors_total",
+      "The number of requests answered with an error status", labels);
+  return [latency, errors, handler](const httplib::Request &req,
+                                    httplib::Response &res) {
+    {
+      ScopedTimer timer(latency);
+      handler(req, res);
+    }
+    if (res.status >= 400) {
+      errors->add();
+    }
+  };
+}
+
+void Server::writeSensor(JsonWriter *writer, const Sensor &sensor,
+                         double last_measurement) {
+  writer->beginObject();
+  writer->key("id");
+  writer->value(sensor.id);
+  writer->key("long");
+  writer->value(sensor.longitude);
+  writer->key("lat");
+  writer->value(sensor.latitude);
+  writer->key("name");
+  writer->value(sensor.name);
+  writer->key("last_measurement");
+  writer->value(last_measurement);
+  writer->key("loc_name");
+  writer->value(sensor.location_name);
+  writer->endObject();
+}
+
+void Server::writeMeasurement(JsonWriter *writer,
+                              const Measurement &measurement) {
+  writer->beginObject();
+  writer->key("time");
+  writer->value(measurement.timestamp);
+  writer->key("height");
+  writer->value(measurement.height);
+  writer->endObject();
+}
+
 void Server::setCommonHeaders(httplib::Response *response) {
   response->set_header("Access-Control-Allow-Origin", "*");
 }
 
 void Server::addMeasurements(const std::string &body) {
-  LOG_DEBUG << "Adding a mesuremrent" << LOG_END;
   using nlohmann::json;
-  json j = json::parse(body);
-  LOG_DEBUG << body << LOG_END;
+  json j = parseJson(body);
   std::string uid = j["dev_id"].get<std::string>();
 
   Measurement m;
-  m.timestamp = time(NULL);
+  // Stamped by the database while it holds the write lock
+  m.timestamp = Database::UNSTAMPED;
   m.height = j["payload_fields"]["height"].get<double>();
   uint64_t sensor_id = _database->sensorFromUID(uid);
-  LOG_DEBUG << "Trying to add data for a sensor with dev_uid " << sensor_id
-            << " and id " << sensor_id << LOG_END;
-  _database->addMeasurement(sensor_id, m);
+  if (sensor_id == static_cast<uint64_t>(-1)) {
+    throw std::runtime_error("Unknown dev_id " + uid);
+  }
+  LOG_LIMITED(DEBUG, 10) << "Adding a measurement for the sensor with dev_uid "
+                         << uid << " and id " << sensor_id << LOG_END;
+  if (_ingest) {
+    if (!_ingest->push(sensor_id, m)) {
+      throw QueueFullError();
+    }
+  } else if (!_database->addMeasurement(sensor_id, m)) {
+    throw std::runtime_error("Unable to add the measurement");
+  }
+}
+
+nlohmann::json Server::addMeasurementBatch(const std::string &body) {
+  using nlohmann::json;
+  // The body is either a json array of uplinks or one uplink per line
+  std::vector<json> uplinks;
+  std::vector<std::string> errors;
+  size_t start = body.find_first_not_of(" \t\r\n");
+  if (start != std::string::npos && body[start] == '[') {
+    json j = parseJson(body);
+    for (json &uplink : j) {
+      uplinks.push_back(std::move(uplink));
+      errors.emplace_back();
+    }
+  } else {
+    size_t line_start = 0;
+    while (line_start < body.size()) {
+      size_t line_end = body.find('\n', line_start);
+      if (line_end == std::string::npos) {
+        line_end = body.size();
+      }
+      std::string line = body.substr(line_start, line_end - line_start);
+      line_start = line_end + 1;
+      if (line.find_first_not_of(" \t\r") == std::string::npos) {
+        continue;
+      }
+      try {
+        uplinks.push_back(parseJson(line));
+        errors.emplace_back();
+      } catch (const std::exception &e) {
+        uplinks.emplace_back();
+        errors.push_back(e.what());
+      }
+    }
+  }
+  LOG_LIMITED(DEBUG, 10) << "Adding a batch of " << uplinks.size()
+                         << " measurements" << LOG_END;
+
+  // Extract the uids and measurements of all valid uplinks
+  uint64_t now = time(NULL);
+  std::vector<std::string> uids(uplinks.size());
+  std::vector<Measurement> measurements(uplinks.size());
+  for (size_t i = 0; i < uplinks.size(); i++) {
+    if (!errors[i].empty()) {
+      continue;
+    }
+    try {
+      const json &j = uplinks[i];
+      uids[i] = j.at("dev_id").get<std::string>();
+      measurements[i].height =
+          j.at("payload_fields").at("height").get<double>();
+      if (j.find("timestamp") != j.end()) {
+        measurements[i].timestamp = j["timestamp"].get<uint64_t>();
+        if (measurements[i].timestamp == Database::UNSTAMPED) {
+          errors[i] = "Invalid timestamp";
+        } else if (measurements[i].timestamp > now + MAX_CLOCK_SKEW) {
+          errors[i] = "Timestamp in the future";
+        }
+      } else {
+        measurements[i].timestamp = Database::UNSTAMPED;
+      }
+    } catch (const std::exception &e) {
+      errors[i] = e.what();
+    }
+  }
+
+  std::vector<uint64_t> sensor_ids = _database->sensorsFromUIDs(uids);
+  std::vector<std::pair<uint64_t, Measurement>> batch;
+  std::vector<size_t> batch_items;
+  batch.reserve(uplinks.size());
+  batch_items.reserve(uplinks.size());
+  for (size_t i = 0; i < uplinks.size(); i++) {
+    if (!errors[i].empty()) {
+      continue;
+    }
+    if (sensor_ids[i] == static_cast<uint64_t>(-1)) {
+      errors[i] = "Unknown dev_id " + uids[i];
+      continue;
+    }
+    // Checked here as well, since queued measurements can not report it
+    if (measurements[i].timestamp != Database::UNSTAMPED &&
+        measurements[i].timestamp <
+            _database->getLastTimestamp(sensor_ids[i])) {
+      errors[i] = "Older than the last measurement of the sensor";
+      continue;
+    }
+    batch.emplace_back(sensor_ids[i], measurements[i]);
+    batch_items.push_back(i);
+  }
+  // Queued measurements are reported as added
+  std::vector<bool> added(batch.size(), true);
+  if (_ingest) {
+    if (batch.size() > _ingest->capacity()) {
+      throw BatchTooLargeError(_ingest->capacity());
+    }
+    if (!_ingest->push(batch)) {
+      throw QueueFullError();
+    }
+  } else {
+    added = _database->addMeasurements(batch);
+  }
+  for (size_t i = 0; i < added.size(); i++) {
+    if (!added[i]) {
+      errors[batch_items[i]] = "Unable to add the measurement";
+    }
+  }
+
+  json::array_t root = json::array();
+  for (const std::string &error : errors) {
+    json s;
+    if (error.empty()) {
+      s["status"] = "ok";
+    } else {
+      s["status"] = "error";
+      s["error"] = error;
+    }
+    root.push_back(s);
+  }
+  json j = std::move(root);
+  return j;
 }
 
 void Server::addSensor(const std::string &body) {
   using nlohmann::json;
-  json j = json::parse(body);
+  json j = parseJson(body);
   Sensor s;
-  s.id = _database->getNumSensors();
   s.name = j["name"].get<std::string>();
   s.latitude = j["latitude"].get<double>();
   s.longitude = j["longitude"].get<double>();
@@ -215,36 +612,245 @@ void Server::addSensor(const std::string &body) {
   _database->addSensor(s);
 }
 
-nlohmann::json
-Server::encodeSensors(const std::vector<Sensor> &sensors, Database *db,
-                      std::function<bool(const Sensor &)> _filter) {
-  using nlohmann::json;
-  json::array_t root = json::array();
-  for (const Sensor &sensor : sensors) {
-    if (_filter == nullptr || _filter(sensor)) {
-      double last_m = db->getLastMeasurement(sensor.id);
-      json s;
-      s["id"] = sensor.id;
-      s["long"] = sensor.longitude;
-      s["lat"] = sensor.latitude;
-      s["name"] = sensor.name;
-      s["last_measurement"] = last_m;
-      s["loc_name"] = sensor.location_name;
-      root.push_back(s);
+void Server::streamSensors(httplib::Response *res,
+                           std::vector<Sensor> sensors) {
+  // The state is shared by all copies of the provider
+  struct State {
+    std::vector<Sensor> sensors;
+    size_t next = 0;
+    JsonWriter writer;
+  };
+  std::shared_ptr<State> state = std::make_shared<State>();
+  state->sensors = std::move(sensors);
+  ShardedDatabase *db = _database;
+  res->set_chunked_content_provider(
+      "application/json", [state, db](size_t, httplib::DataSink &sink) {
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        JsonWriter &writer = state->writer;
+        writer.clear();
+        if (state->next == 0) {
+          writer.beginArray();
+        }
+        size_t end =
+            std::min(state->next + SENSORS_PER_CHUNK, state->sensors.size());
+        for (; state->next < end; state->next++) {
+          const Sensor &sensor = state->sensors[state->next];
+          writeSensor(&writer, sensor, db->getLastMeasurement(sensor.id));
+        }
+        bool done = state->next == state->sensors.size();
+        if (done) {
+          writer.endArray();
+        }
+        sensors_encode_time.recordSince(start);
+        if (!sink.write(writer.str().data(), writer.size())) {
+          return false;
+        }
+        if (done) {
+          sink.done();
+        }
+        return true;
+      });
+}
+
+void Server::streamHistory(httplib::Response *res,
+                           const MeasurementRange &measurements) {
+  struct State {
+    MeasurementRange measurements;
+    size_t next = 0;
+    JsonWriter writer;
+  };
+  std::shared_ptr<State> state = std::make_shared<State>();
+  state->measurements = measurements;
+  res->set_chunked_content_provider(
+      "application/json", [state](size_t, httplib::DataSink &sink) {
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        JsonWriter &writer = state->writer;
+        writer.clear();
+        if (state->next == 0) {
+          writer.beginArray();
+        }
+        size_t end = std::min(state->next + MEASUREMENTS_PER_CHUNK,
+                              state->measurements.size());
+        // Iterate over the slice instead of indexing every measurement
+        for (const Measurement &measurement :
+             state->measurements.slice(state->next, end)) {
+          writeMeasurement(&writer, measurement);
+        }
+        state->next = end;
+        bool done = state->next == state->measurements.size();
+        if (done) {
+          writer.endArray();
+        }
+        history_encode_time.recordSince(start);
+        if (!sink.write(writer.str().data(), writer.size())) {
+          return false;
+        }
+        if (done) {
+          sink.done();
+        }
+        return true;
+      });
+}
+
+bool Server::acceptsBinary(const httplib::Request &req) {
+  return req.has_header("Accept") &&
+         req.get_header_value("Accept").find(BINARY_CONTENT_TYPE) !=
+             std::string::npos;
+}
+
+void Server::streamSensorsBinary(httplib::Response *res,
+                                 std::vector<Sensor> sensors) {
+  struct State {
+    std::vector<Sensor> sensors;
+    size_t next = 0;
+    std::string buffer;
+  };
+  std::shared_ptr<State> state = std::make_shared<State>();
+  state->sensors = std::move(sensors);
+  ShardedDatabase *db = _database;
+  res->set_chunked_content_provider(
+      BINARY_CONTENT_TYPE, [state, db](size_t, httplib::DataSink &sink) {
+        std::string &buffer = state->buffer;
+        buffer.clear();
+        if (state->next == 0) {
+          appendBinary(&buffer, static_cast<uint64_t>(state->sensors.size()));
+        }
+        size_t end =
+            std::min(state->next + SENSORS_PER_CHUNK, state->sensors.size());
+        for (; state->next < end; state->next++) {
+          const Sensor &sensor = state->sensors[state->next];
+          appendBinary(&buffer, sensor.id);
+          appendBinary(&buffer, sensor.longitude);
+          appendBinary(&buffer, sensor.latitude);
+          appendBinary(&buffer, db->getLastMeasurement(sensor.id));
+          appendBinaryString(&buffer, sensor.name);
+          appendBinaryString(&buffer, sensor.location_name);
+        }
+        if (!sink.write(buffer.data(), buffer.size())) {
+          return false;
+        }
+        if (state->next == state->sensors.size()) {
+          sink.done();
+        }
+        return true;
+      });
+}
+
+void Server::streamHistoryBinary(httplib::Response *res,
+                                 const MeasurementRange &measurements) {
+  struct State {
+    MeasurementRange measurements;
+    // The next segment to send, the header is sent first
+    size_t next = 0;
+    bool sent_header = false;
+  };
+  std::shared_ptr<State> state = std::make_shared<State>();
+  state->measurements = measurements;
+  res->set_chunked_content_provider(
+      BINARY_CONTENT_TYPE, [state](size_t, httplib::DataSink &sink) {
+        const std::vector<MeasurementRange::Segment> &segments =
+            state->measurements.segments();
+        if (!state->sent_header) {
+          uint64_t count = state->measurements.size();
+          if (!sink.write(reinterpret_cast<const char *>(&count),
+                          sizeof(count))) {
+            return false;
+          }
+          state->sent_header = true;
+        } else if (state->next < segments.size()) {
+          // The stored records are sent as they are
+          const MeasurementRange::Segment &segment = segments[state->next];
+          if (!sink.write(segment.data, segment.size * sizeof(Measurement))) {
+            return false;
+          }
+          state->next++;
+        }
+        if (state->next == segments.size()) {
+          sink.done();
+        }
+        return true;
+      });
+}
+
+void Server::sendAggregatesBinary(httplib::Response *res,
+                                  const std::vector<Rollup> &buckets,
+                                  Aggregation aggregation) {
+  std::string buffer;
+  buffer.reserve(8 + buckets.size() * sizeof(Measurement));
+  appendBinary(&buffer, static_cast<uint64_t>(buckets.size()));
+  for (const Rollup &bucket : buckets) {
+    appendBinary(&buffer, bucket.start);
+    appendBinary(&buffer, bucket.value(aggregation));
+  }
+  res->set_content(std::move(buffer), BINARY_CONTENT_TYPE);
+}
+
+void Server::sendMarkers(httplib::Response *res,
+                         const std::vector<TileIndex::Marker> &markers) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  JsonWriter writer;
+  writer.beginArray();
+  for (const TileIndex::Marker &marker : markers) {
+    writer.beginObject();
+    writer.key("count");
+    writer.value(marker.count);
+    if (marker.count == 1) {
+      Sensor sensor = _database->getSensorByIdCached(marker.id);
+      writer.key("id");
+      writer.value(sensor.id);
+      writer.key("long");
+      writer.value(sensor.longitude);
+      writer.key("lat");
+      writer.value(sensor.latitude);
+      writer.key("name");
+      writer.value(sensor.name);
+      writer.key("last_measurement");
+      writer.value(marker.last_measurement);
+      writer.key("loc_name");
+      writer.value(sensor.location_name);
+    } else {
+      writer.key("long");
+      writer.value(marker.longitude);
+      writer.key("lat");
+      writer.value(marker.latitude);
+      writer.key("last_measurement");
+      writer.value(marker.last_measurement);
+      writer.key("num_measured");
+      writer.value(marker.num_measured);
     }
+    writer.endObject();
   }
-  json j = std::move(root);
-  return j;
+  writer.endArray();
+  markers_encode_time.recordSince(start);
+  res->set_content(writer.str(), "application/json");
+}
+
+void Server::sendMarkersBinary(httplib::Response *res,
+                               const std::vector<TileIndex::Marker> &markers) {
+  std::string buffer;
+  buffer.reserve(8 + markers.size() * 40);
+  appendBinary(&buffer, static_cast<uint64_t>(markers.size()));
+  for (const TileIndex::Marker &marker : markers) {
+    appendBinary(&buffer, marker.count);
+    appendBinary(&buffer, marker.id);
+    appendBinary(&buffer, marker.longitude);
+    appendBinary(&buffer, marker.latitude);
+    appendBinary(&buffer, marker.last_measurement);
+  }
+  res->set_content(std::move(buffer), BINARY_CONTENT_TYPE);
 }
 
-nlohmann::json
-Server::encodeHistory(const std::vector<Measurement> &measurements) {
+nlohmann::json Server::encodeAggregates(const std::vector<Rollup> &buckets,
+                                        Aggregation aggregation) {
   using nlohmann::json;
   json::array_t root = json::array();
-  for (const Measurement &measurement : measurements) {
+  for (const Rollup &bucket : buckets) {
     json s;
-    s["time"] = measurement.timestamp;
-    s["height"] = measurement.height;
+    s["time"] = bucket.start;
+    s["height"] = bucket.value(aggregation);
     root.push_back(s);
   }
   json j = std::move(root);
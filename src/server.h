@@ -4,35 +4,94 @@
 #include <cstdint>
 #include <functional>
 #include <httplib.h>
+#include <memory>
 #include <string>
 
 #include <nlohmann/json.hpp>
 
-#include "database.h"
+#include "ingest_pipeline.h"
+#include "json_writer.h"
+#include "sharded_database.h"
 
 namespace smartwater {
 
 class Server {
 public:
-  Server(Database *database, const std::string &cert_path,
+  Server(ShardedDatabase *database, const std::string &cert_path,
          const std::string &key_path, uint16_t port = 8080);
 
+  // Serves requests until stop is called
   void start();
+  void stop();
+
+  // Answers ingest requests once their measurements are queued instead of
+  // once they are written, see IngestPipeline. While the queue has no room
+  // for the measurements of a request it is answered with 503, batches larger
+  // than the capacity are answered with 413.
+  void enableIngestQueue(size_t capacity);
+
+  // The json encoding of a single sensor and measurement in the responses
+  static void writeSensor(JsonWriter *writer, const Sensor &sensor,
+                          double last_measurement);
+  static void writeMeasurement(JsonWriter *writer,
+                               const Measurement &measurement);
 
 private:
-  nlohmann::json
-  encodeSensors(const std::vector<Sensor> &sensors, Database *db,
-                std::function<bool(const Sensor &)> _filter = nullptr);
-  nlohmann::json encodeHistory(const std::vector<Measurement> &measurements);
+  // Large responses are written as json directly and streamed in chunks of
+  // this many elements, so sending can start before the body is complete.
+  static constexpr size_t SENSORS_PER_CHUNK = 256;
+  static constexpr size_t MEASUREMENTS_PER_CHUNK = 4096;
+
+  void streamSensors(httplib::Response *res, std::vector<Sensor> sensors);
+  // The measurements have to stay valid until the response is sent.
+  void streamHistory(httplib::Response *res,
+                     const MeasurementRange &measurements);
+
+  // Clients that accept BINARY_CONTENT_TYPE get a compact little endian
+  // encoding instead of json. Every response starts with the number of
+  // elements as uint64. Measurements and buckets are sent as the 16 byte
+  // Measurement records {uint64 time, double height}. Sensors are sent as
+  // uint64 id, double long, double lat, double last_measurement followed by
+  // name and loc_name, each as uint16 length and the bytes of the string.
+  // Map markers are sent as uint64 count, uint64 id, double long, double lat
+  // and double last_measurement, where clusters have the id of their first
+  // sensor and the mean of the last measurements.
+  static const char *BINARY_CONTENT_TYPE;
+  static bool acceptsBinary(const httplib::Request &req);
+  void streamSensorsBinary(httplib::Response *res,
+                           std::vector<Sensor> sensors);
+  void streamHistoryBinary(httplib::Response *res,
+                           const MeasurementRange &measurements);
+  void sendAggregatesBinary(httplib::Response *res,
+                            const std::vector<Rollup> &buckets,
+                            Aggregation aggregation);
+  // Clusters are sent as {count, long, lat, last_measurement, num_measured}
+  // and single sensors like in streamSensors with an additional count.
+  void sendMarkers(httplib::Response *res,
+                   const std::vector<TileIndex::Marker> &markers);
+  void sendMarkersBinary(httplib::Response *res,
+                         const std::vector<TileIndex::Marker> &markers);
+  nlohmann::json encodeAggregates(const std::vector<Rollup> &buckets,
+                                  Aggregation aggregation);
 
   void setCommonHeaders(httplib::Response *response);
+  // Register the handler for the route. The latency and the errors of every
+  // route are recorded in the metrics.
+  void get(const std::string &route, httplib::Server::Handler handler);
+  void post(const std::string &route, httplib::Server::Handler handler);
+  static httplib::Server::Handler instrument(const std::string &route,
+                                             httplib::Server::Handler handler);
 
   void addMeasurements(const std::string &body);
+  // Adds a json array or newline delimited json of uplinks. Returns the
+  // status of every uplink.
+  nlohmann::json addMeasurementBatch(const std::string &body);
   void addSensor(const std::string &body);
 
   uint16_t _port;
   std::string _address;
   httplib::Server _server;
-  Database *_database;
+  ShardedDatabase *_database;
+  std::unique_ptr<IngestPipeline> _ingest;
 };
 } // namespace smartwater
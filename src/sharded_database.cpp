@@ -0,0 +1,467 @@
+#include "sharded_database.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "logger.h"
+#include "snapshot.h"
+#include "util.h"
+
+namespace smartwater {
+
+namespace {
+std::string lowercase(const std::string &s) {
+  std::string lower = s;
+  std::transform(lower.begin(), lower.end(), lower.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return lower;
+}
+
+bool exists(const std::string &path) { return access(path.c_str(), F_OK) == 0; }
+
+// Records the number of shards, since the sensors are routed by it
+std::string manifestFilename(const std::string &filename) {
+  return filename + ".shards";
+}
+
+// The number of shards of the files of the database, 0 for a new database
+size_t existingShards(const std::string &filename) {
+  std::string manifest = manifestFilename(filename);
+  if (exists(manifest)) {
+    SnapshotReader reader(manifest);
+    if (!reader.valid()) {
+      throw std::runtime_error("The shard manifest " + manifest +
+                               " is corrupt");
+    }
+    return reader.read<uint64_t>();
+  }
+  // Databases written without a manifest
+  if (exists(filename)) {
+    return 1;
+  }
+  size_t num_shards = 0;
+  while (exists(filename + "." + std::to_string(num_shards))) {
+    num_shards++;
+  }
+  return num_shards;
+}
+
+void checkShards(const std::string &filename, size_t num_shards) {
+  size_t existing = existingShards(filename);
+  if (existing != 0 && existing != num_shards) {
+    throw std::runtime_error("The database " + filename + " has " +
+                             std::to_string(existing) + " shards, but " +
+                             std::to_string(num_shards) + " are configured");
+  }
+}
+} // namespace
+
+ShardedDatabase::ShardedDatabase(const std::string &filename,
+                                 size_t num_shards, HistoryMode history_mode) {
+  if (num_shards == 0) {
+    throw std::runtime_error("A database needs at least one shard");
+  }
+  checkShards(filename, num_shards);
+  if (!exists(manifestFilename(filename))) {
+    SnapshotWriter manifest(manifestFilename(filename));
+    manifest.write<uint64_t>(num_shards);
+    manifest.commit();
+  }
+  LOG_INFO << "Opening " << num_shards << " shards of " << filename << LOG_END;
+  for (size_t i = 0; i < num_shards; i++) {
+    _owned.emplace_back(
+        new Database(shardFilename(filename, num_shards, i), history_mode));
+    _shards.push_back(_owned.back().get());
+  }
+}
+
+ShardedDatabase::ShardedDatabase(std::vector<Database *> shards)
+    : _shards(std::move(shards)) {
+  if (_shards.empty()) {
+    throw std::runtime_error("A database needs at least one shard");
+  }
+}
+
+size_t ShardedDatabase::numShards() const { return _shards.size(); }
+
+Database *ShardedDatabase::shard(size_t i) { return _shards[i]; }
+
+std::string ShardedDatabase::shardFilename(const std::string &filename,
+                                           size_t num_shards, size_t i) {
+  if (num_shards == 1) {
+    return filename;
+  }
+  return filename + "." + std::to_string(i);
+}
+
+uint64_t ShardedDatabase::globalId(size_t shard, uint64_t local_id) const {
+  if (local_id == uint64_t(-1)) {
+    // Unknown sensors stay unknown
+    return local_id;
+  }
+  return local_id * _shards.size() + shard;
+}
+
+void ShardedDatabase::globalize(size_t shard,
+                                std::vector<Sensor> *sensors) const {
+  for (Sensor &sensor : *sensors) {
+    sensor.id = globalId(shard, sensor.id);
+  }
+}
+
+double ShardedDatabase::getLastMeasurement(uint64_t id) {
+  return _shards[shardOf(id)]->getLastMeasurement(localId(id));
+}
+
+uint64_t ShardedDatabase::getLastTimestamp(uint64_t id) {
+  return _shards[shardOf(id)]->getLastTimestamp(localId(id));
+}
+
+MeasurementRange ShardedDatabase::getMeasurementsCached(uint64_t id) {
+  return _shards[shardOf(id)]->getMeasurementsCached(localId(id));
+}
+
+MeasurementRange ShardedDatabase::getMeasurementsInRange(uint64_t id,
+                                                         uint64_t from,
+                                                         uint64_t to,
+                                                         size_t limit) {
+  return _shards[shardOf(id)]->getMeasurementsInRange(localId(id), from, to,
+                                                      limit);
+}
+
+std::vector<Rollup> ShardedDatabase::getAggregatedMeasurements(
+    uint64_t id, uint64_t from, uint64_t to, uint64_t bucket_size,
+    size_t limit) {
+  return _shards[shardOf(id)]->getAggregatedMeasurements(
+      localId(id), from, to, bucket_size, limit);
+}
+
+std::vector<Sensor> ShardedDatabase::getSensorsCached() {
+  std::vector<Sensor> sensors;
+  for (size_t i = 0; i < _shards.size(); i++) {
+    std::vector<Sensor> shard_sensors = _shards[i]->getSensorsCached();
+    globalize(i, &shard_sensors);
+    sensors.insert(sensors.end(), shard_sensors.begin(), shard_sensors.end());
+  }
+  if (_shards.size() > 1) {
+    std::sort(sensors.begin(), sensors.end(),
+              [](const Sensor &s1, const Sensor &s2) { return s1.id < s2.id; });
+  }
+  return sensors;
+}
+
+Sensor ShardedDatabase::getSensorByIdCached(uint64_t id) {
+  Sensor sensor = _shards[shardOf(id)]->getSensorByIdCached(localId(id));
+  sensor.id = id;
+  return sensor;
+}
+
+std::vector<Sensor> ShardedDatabase::searchForSensors(const std::string &name,
+                                                      size_t limit) {
+  if (_shards.size() == 1) {
+    return _shards[0]->searchForSensors(name, limit);
+  }
+  // Every shard returns its best sensors, which are ranked again by their
+  // number of shared q-grams
+  std::vector<std::pair<size_t, Sensor>> ranked;
+  for (size_t i = 0; i < _shards.size(); i++) {
+    std::vector<size_t> num_shared;
+    std::vector<Sensor> sensors =
+        _shards[i]->searchForSensors(name, limit, &num_shared);
+    globalize(i, &sensors);
+    for (size_t j = 0; j < sensors.size(); j++) {
+      ranked.emplace_back(num_shared[j], std::move(sensors[j]));
+    }
+  }
+  limit = std::min(limit, ranked.size());
+  std::partial_sort(
+      ranked.begin(), ranked.begin() + limit, ranked.end(),
+      [](const std::pair<size_t, Sensor> &m1,
+         const std::pair<size_t, Sensor> &m2) {
+        return m1.first > m2.first ||
+               (m1.first == m2.first && m1.second.id < m2.second.id);
+      });
+  std::vector<Sensor> sensors;
+  sensors.reserve(limit);
+  for (size_t i = 0; i < limit; i++) {
+    sensors.push_back(std::move(ranked[i].second));
+  }
+  return sensors;
+}
+
+std::vector<Sensor>
+ShardedDatabase::searchForSensorsFuzzy(const std::string &name,
+                                       int max_distance, size_t limit) {
+  if (_shards.size() == 1) {
+    return _shards[0]->searchForSensorsFuzzy(name, max_distance, limit);
+  }
+  // Ranked like Database::searchForSensorsFuzzy
+  struct Match {
+    size_t distance;
+    uint64_t popularity;
+    Sensor sensor;
+  };
+  std::vector<Match> ranked;
+  for (size_t i = 0; i < _shards.size(); i++) {
+    std::vector<size_t> distances;
+    std::vector<uint64_t> counts;
+    std::vector<Sensor> sensors = _shards[i]->searchForSensorsFuzzy(
+        name, max_distance, limit, &distances, &counts);
+    for (size_t j = 0; j < sensors.size(); j++) {
+      sensors[j].id = globalId(i, sensors[j].id);
+      ranked.push_back(Match{distances[j], counts[j], std::move(sensors[j])});
+    }
+  }
+  limit = std::min(limit, ranked.size());
+  std::partial_sort(ranked.begin(), ranked.begin() + limit, ranked.end(),
+                    [](const Match &m1, const Match &m2) {
+                      if (m1.distance != m2.distance) {
+                        return m1.distance < m2.distance;
+                      }
+                      if (m1.popularity != m2.popularity) {
+                        return m1.popularity > m2.popularity;
+                      }
+                      return m1.sensor.id < m2.sensor.id;
+                    });
+  std::vector<Sensor> sensors;
+  sensors.reserve(limit);
+  for (size_t i = 0; i < limit; i++) {
+    sensors.push_back(std::move(ranked[i].sensor));
+  }
+  return sensors;
+}
+
+std::vector<PrefixIndex::Completion>
+ShardedDatabase::completeSensorNames(const std::string &prefix, size_t limit) {
+  // Names used in several shards are merged, ordered like
+  // PrefixIndex::complete by length and then alphabetically
+  std::map<std::pair<size_t, std::string>, PrefixIndex::Completion> merged;
+  for (size_t i = 0; i < _shards.size(); i++) {
+    for (PrefixIndex::Completion &completion :
+         _shards[i]->completeSensorNames(prefix, limit)) {
+      std::string key = lowercase(completion.text);
+      PrefixIndex::Completion &entry = merged[{key.size(), key}];
+      if (entry.ids.empty()) {
+        entry.text = std::move(completion.text);
+      }
+      for (uint64_t id : completion.ids) {
+        entry.ids.push_back(globalId(i, id));
+      }
+    }
+  }
+  std::vector<PrefixIndex::Completion> completions;
+  for (std::pair<const std::pair<size_t, std::string>,
+                 PrefixIndex::Completion> &entry : merged) {
+    if (completions.size() >= limit) {
+      break;
+    }
+    std::sort(entry.second.ids.begin(), entry.second.ids.end());
+    completions.push_back(std::move(entry.second));
+  }
+  return completions;
+}
+
+std::vector<Sensor> ShardedDatabase::getSensorsInRadius(double latitude,
+                                                        double longitude,
+                                                        double dist) {
+  std::vector<Sensor> sensors;
+  for (size_t i = 0; i < _shards.size(); i++) {
+    std::vector<Sensor> shard_sensors =
+        _shards[i]->getSensorsInRadius(latitude, longitude, dist);
+    globalize(i, &shard_sensors);
+    sensors.insert(sensors.end(), shard_sensors.begin(), shard_sensors.end());
+  }
+  // Keep the order of getSensorsCached
+  if (_shards.size() > 1) {
+    std::sort(sensors.begin(), sensors.end(),
+              [](const Sensor &s1, const Sensor &s2) { return s1.id < s2.id; });
+  }
+  return sensors;
+}
+
+std::vector<Sensor> ShardedDatabase::getNearestSensors(double latitude,
+                                                       double longitude,
+                                                       size_t k) {
+  if (_shards.size() == 1) {
+    return _shards[0]->getNearestSensors(latitude, longitude, k);
+  }
+  // The k nearest sensors are among the k nearest of every shard
+  std::vector<std::pair<double, Sensor>> nearest;
+  for (size_t i = 0; i < _shards.size(); i++) {
+    std::vector<Sensor> sensors =
+        _shards[i]->getNearestSensors(latitude, longitude, k);
+    globalize(i, &sensors);
+    for (Sensor &sensor : sensors) {
+      double dist = greatCircleDist(longitude, latitude, sensor.longitude,
+                                    sensor.latitude);
+      nearest.emplace_back(dist, std::move(sensor));
+    }
+  }
+  k = std::min(k, nearest.size());
+  std::partial_sort(nearest.begin(), nearest.begin() + k, nearest.end(),
+                    [](const std::pair<double, Sensor> &n1,
+                       const std::pair<double, Sensor> &n2) {
+                      return n1.first < n2.first ||
+                             (n1.first == n2.first &&
+                              n1.second.id < n2.second.id);
+                    });
+  std::vector<Sensor> sensors;
+  sensors.reserve(k);
+  for (size_t i = 0; i < k; i++) {
+    sensors.push_back(std::move(nearest[i].second));
+  }
+  return sensors;
+}
+
+std::vector<TileIndex::Marker>
+ShardedDatabase::getSensorMarkers(double min_latitude, double min_longitude,
+                                  double max_latitude, double max_longitude,
+                                  int zoom) {
+  if (_shards.size() == 1) {
+    return _shards[0]->getSensorMarkers(min_latitude, min_longitude,
+                                        max_latitude, max_longitude, zoom);
+  }
+  std::vector<TileIndex::Marker> markers;
+  for (size_t i = 0; i < _shards.size(); i++) {
+    for (TileIndex::Marker &marker :
+         _shards[i]->getSensorMarkers(min_latitude, min_longitude,
+                                      max_latitude, max_longitude, zoom)) {
+      marker.id = globalId(i, marker.id);
+      markers.push_back(marker);
+    }
+  }
+  return TileIndex::mergeMarkers(std::move(markers), zoom);
+}
+
+uint64_t ShardedDatabase::addSensor(const Sensor &sensor) {
+  // Concurrent sensors would be added to the same shard
+  std::lock_guard<std::mutex> lock(_add_sensor_mutex);
+  size_t target = 0;
+  size_t min_sensors = _shards[0]->getNumSensors();
+  for (size_t i = 1; i < _shards.size(); i++) {
+    size_t num_sensors = _shards[i]->getNumSensors();
+    if (num_sensors < min_sensors) {
+      target = i;
+      min_sensors = num_sensors;
+    }
+  }
+  return globalId(target, _shards[target]->addSensor(sensor));
+}
+
+bool ShardedDatabase::addMeasurement(uint64_t id,
+                                     const Measurement &measurement) {
+  return _shards[shardOf(id)]->addMeasurement(localId(id), measurement);
+}
+
+std::vector<bool> ShardedDatabase::addMeasurements(
+    const std::vector<std::pair<uint64_t, Measurement>> &measurements) {
+  if (_shards.size() == 1) {
+    return _shards[0]->addMeasurements(measurements);
+  }
+  // Split the batch by shard and remember where every measurement came from
+  std::vector<std::vector<std::pair<uint64_t, Measurement>>> batches(
+      _shards.size());
+  std::vector<std::vector<size_t>> positions(_shards.size());
+  for (size_t i = 0; i < measurements.size(); i++) {
+    size_t shard = shardOf(measurements[i].first);
+    batches[shard].emplace_back(localId(measurements[i].first),
+                                measurements[i].second);
+    positions[shard].push_back(i);
+  }
+  std::vector<bool> added(measurements.size(), false);
+  for (size_t shard = 0; shard < _shards.size(); shard++) {
+    if (batches[shard].empty()) {
+      continue;
+    }
+    std::vector<bool> result = _shards[shard]->addMeasurements(batches[shard]);
+    for (size_t i = 0; i < result.size(); i++) {
+      added[positions[shard][i]] = result[i];
+    }
+  }
+  return added;
+}
+
+void ShardedDatabase::enableGroupCommit(size_t max_pending,
+                                        std::chrono::milliseconds max_delay) {
+  for (Database *shard : _shards) {
+    shard->enableGroupCommit(max_pending, max_delay);
+  }
+}
+
+void ShardedDatabase::enableCompression() {
+  for (Database *shard : _shards) {
+    shard->enableCompression();
+  }
+}
+
+void ShardedDatabase::enableCheckpoints(std::chrono::seconds interval) {
+  for (Database *shard : _shards) {
+    shard->enableCheckpoints(interval);
+  }
+}
+
+void ShardedDatabase::checkpoint() {
+  for (Database *shard : _shards) {
+    shard->checkpoint();
+  }
+}
+
+void ShardedDatabase::flush() {
+  for (Database *shard : _shards) {
+    shard->flush();
+  }
+}
+
+uint64_t ShardedDatabase::sensorFromUID(const std::string &dev_uuid) {
+  for (size_t i = 0; i < _shards.size(); i++) {
+    uint64_t id = _shards[i]->sensorFromUID(dev_uuid);
+    if (id != uint64_t(-1)) {
+      return globalId(i, id);
+    }
+  }
+  return -1;
+}
+
+std::vector<uint64_t>
+ShardedDatabase::sensorsFromUIDs(const std::vector<std::string> &dev_uuids) {
+  std::vector<uint64_t> ids(dev_uuids.size(), -1);
+  for (size_t i = 0; i < _shards.size(); i++) {
+    std::vector<uint64_t> shard_ids = _shards[i]->sensorsFromUIDs(dev_uuids);
+    for (size_t j = 0; j < ids.size(); j++) {
+      if (ids[j] == uint64_t(-1)) {
+        ids[j] = globalId(i, shard_ids[j]);
+      }
+    }
+  }
+  return ids;
+}
+
+size_t ShardedDatabase::getNumSensors() {
+  size_t num_sensors = 0;
+  for (Database *shard : _shards) {
+    num_sensors += shard->getNumSensors();
+  }
+  return num_sensors;
+}
+
+size_t ShardedDatabase::configuredShards() {
+  const char *value = getenv("SMARTWATER_SHARDS");
+  if (value == nullptr) {
+    return 1;
+  }
+  return std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+}
+
+void ShardedDatabase::compact(const std::string &filename, size_t num_shards) {
+  checkShards(filename, num_shards);
+  for (size_t i = 0; i < num_shards; i++) {
+    Database::compact(shardFilename(filename, num_shards, i));
+  }
+}
+
+} // namespace smartwater
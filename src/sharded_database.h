@@ -0,0 +1,109 @@
+#pragma once
+
+#include "database.h"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace smartwater {
+
+// Partitions the sensors over several independent databases, each with its
+// own file, log and writer lock, so writes to different shards run in
+// parallel. A sensor lives in the shard id % num_shards under the local id
+// id / num_shards. Requests for a single sensor are routed to its shard,
+// listings and searches query every shard and merge the results in the
+// order a single database returns them.
+//
+// The number of shards of a set of files must not change, the sensors would
+// be routed to the wrong shards. It is recorded in the file filename.shards,
+// and opening the files with a different number of shards throws.
+class ShardedDatabase {
+public:
+  // Opens num_shards databases. A single shard uses filename as it is, so an
+  // existing database can be opened, otherwise the shards are named
+  // filename.0, filename.1 and so on.
+  ShardedDatabase(const std::string &filename, size_t num_shards,
+                  HistoryMode history_mode = HistoryMode::CACHED);
+  // Serves the given databases, which have to outlive this object
+  explicit ShardedDatabase(std::vector<Database *> shards);
+
+  size_t numShards() const;
+  Database *shard(size_t i);
+
+  double getLastMeasurement(uint64_t id);
+  uint64_t getLastTimestamp(uint64_t id);
+  MeasurementRange getMeasurementsCached(uint64_t id);
+  MeasurementRange getMeasurementsInRange(uint64_t id, uint64_t from,
+                                          uint64_t to, size_t limit);
+  std::vector<Rollup> getAggregatedMeasurements(uint64_t id, uint64_t from,
+                                                uint64_t to,
+                                                uint64_t bucket_size,
+                                                size_t limit);
+
+  // See the methods of Database, the ids of the returned sensors are global
+  std::vector<Sensor> getSensorsCached();
+  Sensor getSensorByIdCached(uint64_t id);
+  std::vector<Sensor> searchForSensors(const std::string &name, size_t limit);
+  std::vector<Sensor> searchForSensorsFuzzy(const std::string &name,
+                                            int max_distance, size_t limit);
+  std::vector<PrefixIndex::Completion>
+  completeSensorNames(const std::string &prefix, size_t limit);
+  std::vector<Sensor> getSensorsInRadius(double latitude, double longitude,
+                                         double dist);
+  std::vector<Sensor> getNearestSensors(double latitude, double longitude,
+                                        size_t k);
+  std::vector<TileIndex::Marker>
+  getSensorMarkers(double min_latitude, double min_longitude,
+                   double max_latitude, double max_longitude, int zoom);
+
+  // New sensors are added to the shard with the fewest sensors, which keeps
+  // the global ids dense. Sensors are added one at a time.
+  uint64_t addSensor(const Sensor &sensor);
+  bool addMeasurement(uint64_t id, const Measurement &measurement);
+  // The shards are written one after another by the calling thread, each
+  // shard only locks its writer while its part of the batch is written
+  std::vector<bool> addMeasurements(
+      const std::vector<std::pair<uint64_t, Measurement>> &measurements);
+
+  // Applied to every shard
+  void enableGroupCommit(size_t max_pending,
+                         std::chrono::milliseconds max_delay);
+  void enableCompression();
+  void enableCheckpoints(std::chrono::seconds interval);
+  void checkpoint();
+  void flush();
+
+  uint64_t sensorFromUID(const std::string &dev_uuid);
+  std::vector<uint64_t>
+  sensorsFromUIDs(const std::vector<std::string> &dev_uuids);
+
+  size_t getNumSensors();
+
+  // The number of shards set by the environment variable SMARTWATER_SHARDS,
+  // 1 if it is not set
+  static size_t configuredShards();
+  // Compacts every shard, see Database::compact
+  static void compact(const std::string &filename, size_t num_shards);
+  static std::string shardFilename(const std::string &filename,
+                                   size_t num_shards, size_t i);
+
+  // The shard of the sensor with the global id and its id within the shard
+  size_t shardOf(uint64_t id) const { return id % _shards.size(); }
+  uint64_t localId(uint64_t id) const { return id / _shards.size(); }
+
+private:
+  uint64_t globalId(size_t shard, uint64_t local_id) const;
+  // Replaces the local ids of sensors of the shard by their global ids
+  void globalize(size_t shard, std::vector<Sensor> *sensors) const;
+
+  std::vector<std::unique_ptr<Database>> _owned;
+  std::vector<Database *> _shards;
+  // Held while a sensor is added, which keeps the shards balanced
+  std::mutex _add_sensor_mutex;
+};
+} // namespace smartwater
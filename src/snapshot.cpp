@@ -0,0 +1,138 @@
+#include "snapshot.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "logger.h"
+
+namespace smartwater {
+
+namespace {
+const uint64_t FNV_PRIME = 1099511628211ull;
+} // namespace
+
+uint64_t updateChecksum(uint64_t checksum, const void *data, size_t size) {
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; i++) {
+    checksum = (checksum ^ bytes[i]) * FNV_PRIME;
+  }
+  return checksum;
+}
+
+SnapshotWriter::SnapshotWriter(const std::string &path)
+    : _path(path), _tmp_path(path + ".tmp"), _file(nullptr),
+      _checksum(CHECKSUM_SEED), _committed(false) {
+  _file = fopen(_tmp_path.c_str(), "wb");
+  if (_file == nullptr) {
+    throw std::runtime_error("Unable to create the snapshot " + _tmp_path);
+  }
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  if (_file != nullptr) {
+    fclose(_file);
+  }
+  if (!_committed) {
+    unlink(_tmp_path.c_str());
+  }
+}
+
+void SnapshotWriter::write(const void *data, size_t size) {
+  if (fwrite(data, 1, size, _file) != size) {
+    throw std::runtime_error("Unable to write the snapshot " + _tmp_path);
+  }
+  _checksum = updateChecksum(_checksum, data, size);
+}
+
+void SnapshotWriter::writeString(const std::string &s) {
+  write<uint64_t>(s.size());
+  write(s.data(), s.size());
+}
+
+void SnapshotWriter::commit() {
+  uint64_t checksum = _checksum;
+  write(checksum);
+  if (fflush(_file) != 0 || fsync(fileno(_file)) != 0) {
+    throw std::runtime_error("Unable to sync the snapshot " + _tmp_path);
+  }
+  fclose(_file);
+  _file = nullptr;
+  if (rename(_tmp_path.c_str(), _path.c_str()) != 0) {
+    throw std::runtime_error("Unable to replace the snapshot " + _path);
+  }
+  _committed = true;
+  // Make the rename durable
+  std::vector<char> dir(_path.begin(), _path.end());
+  dir.push_back('\0');
+  int fd = open(dirname(dir.data()), O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+SnapshotReader::SnapshotReader(const std::string &path)
+    : _data(nullptr), _size(0), _mapped_size(0), _offset(0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat s;
+  if (fstat(fd, &s) != 0 || s.st_size < static_cast<off_t>(sizeof(uint64_t))) {
+    close(fd);
+    return;
+  }
+  void *data = mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    LOG_WARN << "Unable to map the snapshot " << path << LOG_END;
+    return;
+  }
+  _data = reinterpret_cast<const char *>(data);
+  _mapped_size = s.st_size;
+  // The snapshot is read front to back
+  madvise(data, _mapped_size, MADV_SEQUENTIAL);
+
+  size_t size = _mapped_size - sizeof(uint64_t);
+  uint64_t checksum;
+  std::memcpy(&checksum, _data + size, sizeof(checksum));
+  if (updateChecksum(CHECKSUM_SEED, _data, size) != checksum) {
+    LOG_WARN << "The snapshot " << path << " is corrupt" << LOG_END;
+    return;
+  }
+  _size = size;
+}
+
+SnapshotReader::~SnapshotReader() {
+  if (_data != nullptr) {
+    munmap(const_cast<char *>(_data), _mapped_size);
+  }
+}
+
+bool SnapshotReader::valid() const { return _size > 0; }
+
+void SnapshotReader::read(void *data, size_t size) {
+  if (size > _size - _offset) {
+    throw std::runtime_error("Unexpected end of the snapshot");
+  }
+  std::memcpy(data, _data + _offset, size);
+  _offset += size;
+}
+
+std::string SnapshotReader::readString() {
+  uint64_t size = read<uint64_t>();
+  if (size > _size - _offset) {
+    throw std::runtime_error("Unexpected end of the snapshot");
+  }
+  std::string s(_data + _offset, size);
+  _offset += size;
+  return s;
+}
+
+} // namespace smartwater
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <type_traits>
+
+namespace smartwater {
+
+// The start value of the FNV-1a checksums that protect snapshots and log
+// records
+const uint64_t CHECKSUM_SEED = 14695981039346656037ull;
+// Continues the checksum with the given data
+uint64_t updateChecksum(uint64_t checksum, const void *data, size_t size);
+
+// Writes a snapshot file. The data is written to a temporary file, which
+// atomically replaces the snapshot once it is complete. A checksum over the
+// content is appended, so partially written snapshots are never used.
+class SnapshotWriter {
+public:
+  // Throws if the temporary file can not be created.
+  explicit SnapshotWriter(const std::string &path);
+  // Removes the temporary file unless the snapshot was committed.
+  ~SnapshotWriter();
+
+  SnapshotWriter(const SnapshotWriter &other) = delete;
+  SnapshotWriter &operator=(const SnapshotWriter &other) = delete;
+
+  void write(const void *data, size_t size);
+  template <typename T> void write(const T &value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be written as is");
+    write(&value, sizeof(T));
+  }
+  void writeString(const std::string &s);
+
+  // Syncs the snapshot to disk and moves it into place. Throws on failure.
+  void commit();
+
+private:
+  std::string _path;
+  std::string _tmp_path;
+  FILE *_file;
+  uint64_t _checksum;
+  bool _committed;
+};
+
+// Reads a snapshot file written by SnapshotWriter from a read only mapping.
+class SnapshotReader {
+public:
+  // Missing or corrupt snapshots are not valid.
+  explicit SnapshotReader(const std::string &path);
+  ~SnapshotReader();
+
+  SnapshotReader(const SnapshotReader &other) = delete;
+  SnapshotReader &operator=(const SnapshotReader &other) = delete;
+
+  bool valid() const;
+
+  // Reading past the end of the snapshot throws.
+  void read(void *data, size_t size);
+  template <typename T> T read() {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be read as is");
+    T value;
+    read(&value, sizeof(T));
+    return value;
+  }
+  std::string readString();
+
+private:
+  const char *_data;
+  // The size without the checksum
+  size_t _size;
+  size_t _mapped_size;
+  size_t _offset;
+};
+
+} // namespace smartwater
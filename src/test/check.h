@@ -0,0 +1,32 @@
+#pragma once
+
+#include <iostream>
+
+// The tests are plain executables run by ctest. A failed check prints its
+// location and the test goes on, main returns the result of testResult().
+
+namespace smartwater {
+namespace test {
+inline int &numFailures() {
+  static int num_failures = 0;
+  return num_failures;
+}
+
+inline int testResult() {
+  if (numFailures() > 0) {
+    std::cerr << numFailures() << " checks failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+} // namespace test
+} // namespace smartwater
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: "           \
+                << #condition << std::endl;                                    \
+      smartwater::test::numFailures()++;                                       \
+    }                                                                          \
+  } while (false)
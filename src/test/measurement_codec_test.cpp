@@ -0,0 +1,149 @@
+#include "measurement_codec.h"
+
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "check.h"
+
+using namespace smartwater;
+
+namespace {
+double fromBits(uint64_t bits) {
+  double value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+uint64_t toBits(double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+// Encodes the measurements into one buffer like a chunk, then decodes them
+// with a fresh codec and compares them bit by bit
+void checkRoundTrip(const std::vector<Measurement> &measurements) {
+  MeasurementCodec encoder;
+  std::vector<char> data(measurements.size() *
+                         MeasurementCodec::MAX_ENCODED_SIZE);
+  std::vector<size_t> sizes;
+  size_t offset = 0;
+  for (const Measurement &m : measurements) {
+    char encoded[MeasurementCodec::MAX_ENCODED_SIZE];
+    size_t size = encoder.encode(m, encoded);
+    CHECK(size > 0 && size <= MeasurementCodec::MAX_ENCODED_SIZE);
+    std::memcpy(data.data() + offset, encoded, size);
+    sizes.push_back(size);
+    offset += size;
+  }
+
+  MeasurementCodec decoder;
+  offset = 0;
+  for (size_t i = 0; i < measurements.size(); i++) {
+    Measurement m;
+    size_t size = decoder.decode(data.data() + offset, &m);
+    CHECK(size == sizes[i]);
+    CHECK(m.timestamp == measurements[i].timestamp);
+    CHECK(toBits(m.height) == toBits(measurements[i].height));
+    offset += size;
+  }
+}
+
+void testRegularSeries() {
+  // Every 15 minutes with a few late uplinks, the common case
+  std::vector<Measurement> measurements;
+  uint64_t timestamp = 1500000000;
+  for (int i = 0; i < 1000; i++) {
+    timestamp += 900 + (i % 7 == 0 ? i % 13 : 0);
+    measurements.push_back({timestamp, 1.5 + (i % 10) * 0.01});
+  }
+  checkRoundTrip(measurements);
+}
+
+void testOutOfOrderTimestamps() {
+  // The deltas wrap around when a timestamp goes back
+  checkRoundTrip({{1000, 1},
+                  {900, 2},
+                  {900, 3},
+                  {2000, 4},
+                  {0, 5},
+                  {std::numeric_limits<uint64_t>::max(), 6},
+                  {1, 7},
+                  {std::numeric_limits<uint64_t>::max() / 2, 8},
+                  {5, 9}});
+  // Delta of deltas at the limits of every size class
+  std::vector<Measurement> measurements = {{100000, 0}, {100000, 0}};
+  for (int64_t dod : {-64, 63, -65, 64, -256, 255, -257, 256, -2048, 2047,
+                      -2049, 2048}) {
+    uint64_t delta = measurements.back().timestamp -
+                     measurements[measurements.size() - 2].timestamp;
+    measurements.push_back(
+        {measurements.back().timestamp + delta + dod, 0});
+  }
+  checkRoundTrip(measurements);
+}
+
+void testXors() {
+  // A xor with all 64 bits meaningful, then windows that do and do not fit
+  // into the previous one
+  checkRoundTrip({{1, fromBits(0x0000000000000001)},
+                  {2, fromBits(0xfffffffffffffffe)},
+                  {3, fromBits(0xfffffffffffffff0)},
+                  {4, fromBits(0x8000000000000000)},
+                  {5, fromBits(0x0000000000000001)},
+                  {6, fromBits(0x0000000000000001)},
+                  {7, fromBits(0x7fffffffffffffff)}});
+  // Special values of doubles
+  checkRoundTrip({{1, 0.0},
+                  {2, -0.0},
+                  {3, std::numeric_limits<double>::infinity()},
+                  {4, -std::numeric_limits<double>::infinity()},
+                  {5, std::numeric_limits<double>::quiet_NaN()},
+                  {6, std::numeric_limits<double>::denorm_min()},
+                  {7, std::numeric_limits<double>::max()},
+                  {8, std::numeric_limits<double>::lowest()}});
+}
+
+void testRandomSeries() {
+  std::mt19937_64 random(42);
+  for (int round = 0; round < 100; round++) {
+    std::vector<Measurement> measurements;
+    for (int i = 0; i < 200; i++) {
+      Measurement m;
+      m.timestamp = random();
+      // Mostly small deltas, some random timestamps and bit patterns
+      if (i > 0 && random() % 4 != 0) {
+        m.timestamp = measurements.back().timestamp + random() % 5000;
+      }
+      m.height = random() % 3 == 0 ? fromBits(random())
+                                   : double(random() % 1000) / 100;
+      measurements.push_back(m);
+    }
+    checkRoundTrip(measurements);
+  }
+}
+
+void testReset() {
+  // A reset codec encodes the first measurement as is again, like the first
+  // one of every chunk
+  MeasurementCodec encoder;
+  char first[MeasurementCodec::MAX_ENCODED_SIZE];
+  char again[MeasurementCodec::MAX_ENCODED_SIZE];
+  size_t size = encoder.encode({10, 1}, first);
+  encoder.encode({20, 2}, again);
+  encoder.reset();
+  CHECK(encoder.encode({10, 1}, again) == size);
+  CHECK(std::memcmp(first, again, size) == 0);
+}
+} // namespace
+
+int main() {
+  testRegularSeries();
+  testOutOfOrderTimestamps();
+  testXors();
+  testRandomSeries();
+  testReset();
+  return smartwater::test::testResult();
+}
@@ -0,0 +1,143 @@
+#include "prefix_index.h"
+
+#include <algorithm>
+#include <cctype>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "check.h"
+
+using namespace smartwater;
+
+namespace {
+std::string lowercase(const std::string &s) {
+  std::string lower = s;
+  for (char &c : lower) {
+    c = std::tolower(static_cast<unsigned char>(c));
+  }
+  return lower;
+}
+
+// A small alphabet makes strings that are prefixes of each other and splits
+// many edges. The bytes of an umlaut sort after the letters.
+std::string randomString(std::mt19937 *random, size_t max_length) {
+  static const std::string alphabet = "abAB \xc3\xb6";
+  std::string s;
+  size_t length = (*random)() % (max_length + 1);
+  for (size_t i = 0; i < length; i++) {
+    s += alphabet[(*random)() % alphabet.size()];
+  }
+  return s;
+}
+
+struct Entry {
+  // The string as it was first added
+  std::string text;
+  std::set<uint64_t> ids;
+};
+
+// The completions of the prefix among the lowercased strings, shorter ones
+// first and alphabetically among strings of the same length
+std::vector<PrefixIndex::Completion>
+bruteForceComplete(const std::map<std::string, Entry> &strings,
+                   const std::string &prefix, size_t limit) {
+  std::string key = lowercase(prefix);
+  std::vector<std::string> keys;
+  for (const std::pair<const std::string, Entry> &s : strings) {
+    if (s.first.compare(0, key.size(), key) == 0) {
+      keys.push_back(s.first);
+    }
+  }
+  std::sort(keys.begin(), keys.end(),
+            [](const std::string &k1, const std::string &k2) {
+              return k1.size() < k2.size() ||
+                     (k1.size() == k2.size() && k1 < k2);
+            });
+  std::vector<PrefixIndex::Completion> completions;
+  for (size_t i = 0; i < keys.size() && i < limit; i++) {
+    const Entry &entry = strings.at(keys[i]);
+    completions.push_back(PrefixIndex::Completion{
+        entry.text, std::vector<uint64_t>(entry.ids.begin(), entry.ids.end())});
+  }
+  return completions;
+}
+
+void checkComplete(const PrefixIndex &index,
+                   const std::map<std::string, Entry> &strings,
+                   const std::string &prefix, size_t limit) {
+  std::vector<PrefixIndex::Completion> completions =
+      index.complete(prefix, limit);
+  std::vector<PrefixIndex::Completion> expected =
+      bruteForceComplete(strings, prefix, limit);
+  CHECK(completions.size() == expected.size());
+  for (size_t i = 0; i < completions.size() && i < expected.size(); i++) {
+    CHECK(completions[i].text == expected[i].text);
+    CHECK(completions[i].ids == expected[i].ids);
+  }
+}
+
+void testOrdering() {
+  PrefixIndex index;
+  std::map<std::string, Entry> strings;
+  uint64_t id = 0;
+  for (const char *s : {"Bonn", "Bochum", "bonn", "Bo", "Bottrop", "Berlin",
+                        "Bremen", "Bad Honnef", "Bad Ems", "Aachen"}) {
+    index.insert(s, id);
+    Entry &entry = strings[lowercase(s)];
+    if (entry.ids.empty()) {
+      entry.text = s;
+    }
+    entry.ids.insert(id++);
+  }
+  std::vector<PrefixIndex::Completion> completions = index.complete("bo", 10);
+  std::vector<std::string> texts;
+  for (const PrefixIndex::Completion &completion : completions) {
+    texts.push_back(completion.text);
+  }
+  // Case is ignored, the first spelling is kept and gets the ids of both
+  CHECK((texts ==
+         std::vector<std::string>{"Bo", "Bonn", "Bochum", "Bottrop"}));
+  CHECK(completions.size() == 4 &&
+        (completions[1].ids == std::vector<uint64_t>{0, 2}));
+  CHECK(index.complete("BAD ", 1).size() == 1 &&
+        index.complete("BAD ", 1)[0].text == "Bad Ems");
+  CHECK(index.complete("x", 10).empty());
+  CHECK(index.complete("bo", 0).empty());
+  CHECK(index.complete("", 100).size() == index.size());
+  checkComplete(index, strings, "b", 3);
+}
+
+void testRandomStrings() {
+  std::mt19937 random(13);
+  PrefixIndex index;
+  std::map<std::string, Entry> strings;
+  for (uint64_t i = 0; i < 2000; i++) {
+    std::string s = randomString(&random, 10);
+    // Some strings are added for several ids, out of order
+    uint64_t id = random() % 1500;
+    index.insert(s, id);
+    if (s.empty()) {
+      continue;
+    }
+    Entry &entry = strings[lowercase(s)];
+    if (entry.ids.empty()) {
+      entry.text = s;
+    }
+    entry.ids.insert(id);
+  }
+  CHECK(index.size() == strings.size());
+  for (int i = 0; i < 500; i++) {
+    size_t limit = random() % 2 == 0 ? random() % 10 : 10000;
+    checkComplete(index, strings, randomString(&random, 5), limit);
+  }
+}
+} // namespace
+
+int main() {
+  testOrdering();
+  testRandomStrings();
+  return smartwater::test::testResult();
+}
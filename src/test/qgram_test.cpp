@@ -0,0 +1,257 @@
+#include "qgram.h"
+
+#include <algorithm>
+#include <cctype>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "edit_distance.h"
+
+using namespace smartwater;
+
+namespace {
+const int Q = 3;
+
+std::string lowercase(const std::string &s) {
+  std::string lower = s;
+  for (char &c : lower) {
+    c = std::tolower(static_cast<unsigned char>(c));
+  }
+  return lower;
+}
+
+// The q-grams of the lowercased string padded by Q - 1 '$' on both sides
+std::set<std::string> grams(const std::string &s) {
+  std::string padded =
+      std::string(Q - 1, '$') + lowercase(s) + std::string(Q - 1, '$');
+  std::set<std::string> grams;
+  for (size_t i = 0; i + Q <= padded.size(); i++) {
+    grams.insert(padded.substr(i, Q));
+  }
+  return grams;
+}
+
+// Random strings over a small alphabet share many grams, the capitals and
+// the bytes of umlauts check the lowercasing and the byte handling
+std::string randomString(std::mt19937 *random, size_t max_length) {
+  static const std::string alphabet = "abcdeABC -\xc3\xb6";
+  std::string s;
+  size_t length = (*random)() % (max_length + 1);
+  for (size_t i = 0; i < length; i++) {
+    s += alphabet[(*random)() % alphabet.size()];
+  }
+  return s;
+}
+
+struct Corpus {
+  // The strings of every id
+  std::vector<std::vector<std::string>> strings;
+  QGramIndex<Q> index;
+};
+
+Corpus randomCorpus(std::mt19937 *random, size_t num_ids) {
+  Corpus corpus;
+  corpus.strings.resize(num_ids);
+  for (uint64_t id = 0; id < num_ids; id++) {
+    // Like the name and the location name of a sensor
+    for (int i = 0; i < 2; i++) {
+      std::string s = randomString(random, 12);
+      corpus.strings[id].push_back(s);
+      corpus.index.addMapping(s, id);
+    }
+  }
+  return corpus;
+}
+
+// Ranks every id by the number of distinct grams of the query that any of
+// its strings contains, like QGramIndex::query
+std::vector<std::pair<size_t, uint64_t>> bruteForceQuery(const Corpus &corpus,
+                                                         const std::string &s) {
+  std::set<std::string> query_grams = grams(s);
+  std::vector<std::pair<size_t, uint64_t>> ranked;
+  for (uint64_t id = 0; id < corpus.strings.size(); id++) {
+    std::set<std::string> id_grams;
+    for (const std::string &string : corpus.strings[id]) {
+      std::set<std::string> g = grams(string);
+      id_grams.insert(g.begin(), g.end());
+    }
+    size_t shared = 0;
+    for (const std::string &gram : query_grams) {
+      shared += id_grams.count(gram);
+    }
+    if (shared > 0) {
+      ranked.emplace_back(shared, id);
+    }
+  }
+  std::sort(ranked.begin(), ranked.end(),
+            [](const std::pair<size_t, uint64_t> &m1,
+               const std::pair<size_t, uint64_t> &m2) {
+              return m1.first > m2.first ||
+                     (m1.first == m2.first && m1.second < m2.second);
+            });
+  return ranked;
+}
+
+void checkQuery(const Corpus &corpus, const std::string &s, size_t limit) {
+  std::vector<std::pair<size_t, uint64_t>> expected =
+      bruteForceQuery(corpus, s);
+  size_t num_candidates = 0;
+  std::vector<size_t> num_shared;
+  std::vector<uint64_t> ids =
+      corpus.index.query(s, limit, &num_candidates, &num_shared);
+  CHECK(num_candidates == (limit == 0 ? 0 : expected.size()));
+  CHECK(ids.size() == std::min(limit, expected.size()));
+  CHECK(num_shared.size() == ids.size());
+  for (size_t i = 0; i < ids.size() && i < expected.size(); i++) {
+    CHECK(ids[i] == expected[i].second);
+    CHECK(num_shared[i] == expected[i].first);
+  }
+}
+
+void testQueries() {
+  std::mt19937 random(7);
+  Corpus corpus = randomCorpus(&random, 500);
+  for (int i = 0; i < 300; i++) {
+    size_t limit = random() % 3 == 0 ? 1000 : random() % 20;
+    checkQuery(corpus, randomString(&random, 10), limit);
+    // Parts of indexed strings
+    const std::string &s = corpus.strings[random() % 500][random() % 2];
+    size_t start = s.empty() ? 0 : random() % s.size();
+    checkQuery(corpus, s.substr(start, random() % 8), limit);
+  }
+  checkQuery(corpus, "", 10);
+  checkQuery(corpus, "abc", 0);
+}
+
+void testIdsOutOfOrder() {
+  // Posting lists stay sorted and free of duplicates when ids are added out
+  // of order or twice
+  std::mt19937 random(11);
+  Corpus corpus;
+  corpus.strings.resize(200);
+  std::vector<uint64_t> ids;
+  for (uint64_t id = 0; id < 200; id++) {
+    ids.push_back(id);
+  }
+  std::shuffle(ids.begin(), ids.end(), random);
+  for (uint64_t id : ids) {
+    std::string s = randomString(&random, 10);
+    corpus.strings[id].push_back(s);
+    corpus.index.addMapping(s, id);
+    corpus.index.addMapping(s, id);
+  }
+  for (int i = 0; i < 100; i++) {
+    checkQuery(corpus, randomString(&random, 10), 50);
+  }
+}
+
+// The plain dynamic program over the bytes
+size_t levenshtein(const std::string &a, const std::string &b) {
+  std::vector<size_t> row(b.size() + 1);
+  for (size_t j = 0; j <= b.size(); j++) {
+    row[j] = j;
+  }
+  for (size_t i = 1; i <= a.size(); i++) {
+    size_t diagonal = row[0];
+    row[0] = i;
+    for (size_t j = 1; j <= b.size(); j++) {
+      size_t above = row[j];
+      row[j] = std::min({row[j] + 1, row[j - 1] + 1,
+                         diagonal + (a[i - 1] == b[j - 1] ? 0 : 1)});
+      diagonal = above;
+    }
+  }
+  return row[b.size()];
+}
+
+void testEditDistance() {
+  // Patterns up to 64 bytes use Myers' algorithm, longer ones the dynamic
+  // program
+  std::mt19937 random(3);
+  for (int i = 0; i < 3000; i++) {
+    std::string pattern = randomString(&random, i % 2 == 0 ? 20 : 90);
+    std::string text = random() % 4 == 0 ? randomString(&random, 90)
+                                         : randomString(&random, 20);
+    if (random() % 2 == 0 && !pattern.empty()) {
+      // A text close to the pattern
+      text = pattern;
+      for (int edits = random() % 4; edits > 0; edits--) {
+        size_t pos = random() % (text.size() + 1);
+        if (random() % 2 == 0 || pos == text.size()) {
+          text.insert(pos, 1, 'x');
+        } else {
+          text.erase(pos, 1);
+        }
+      }
+    }
+    size_t expected = levenshtein(pattern, text);
+    EditDistance edit_distance(pattern);
+    for (size_t max_distance : {size_t(0), size_t(1), size_t(3), size_t(100)}) {
+      size_t distance = edit_distance.distance(text, max_distance);
+      CHECK(distance == std::min(expected, max_distance + 1));
+    }
+  }
+}
+
+// Every id with a string within max_distance of the query and its smallest
+// distance, ordered by id like QGramIndex::fuzzyQuery
+std::vector<std::pair<uint64_t, size_t>>
+bruteForceFuzzyQuery(const Corpus &corpus, const std::string &s,
+                     size_t max_distance) {
+  std::vector<std::pair<uint64_t, size_t>> matches;
+  for (uint64_t id = 0; id < corpus.strings.size(); id++) {
+    size_t best = max_distance + 1;
+    for (const std::string &string : corpus.strings[id]) {
+      best = std::min(best, levenshtein(lowercase(s), lowercase(string)));
+    }
+    if (best <= max_distance) {
+      matches.emplace_back(id, best);
+    }
+  }
+  return matches;
+}
+
+void checkFuzzyQuery(const Corpus &corpus, const std::string &s,
+                     size_t max_distance) {
+  CHECK(corpus.index.fuzzyQuery(s, max_distance) ==
+        bruteForceFuzzyQuery(corpus, s, max_distance));
+}
+
+void testFuzzyQueries() {
+  std::mt19937 random(5);
+  Corpus corpus = randomCorpus(&random, 500);
+  for (int i = 0; i < 200; i++) {
+    size_t max_distance = random() % 4;
+    // Typos of indexed strings, which the gram filter has to keep
+    std::string s = corpus.strings[random() % 500][random() % 2];
+    for (int edits = random() % 3; edits > 0 && !s.empty(); edits--) {
+      s[random() % s.size()] = 'z';
+    }
+    checkFuzzyQuery(corpus, s, max_distance);
+    // Short queries, for which the filter can not rule out anything
+    checkFuzzyQuery(corpus, randomString(&random, 4), max_distance);
+    checkFuzzyQuery(corpus, randomString(&random, 12), max_distance);
+  }
+  // Queries around and beyond 64 bytes
+  for (int i = 0; i < 20; i++) {
+    std::string s = std::string(65, 'a') + randomString(&random, 5);
+    corpus.strings.push_back({s});
+    corpus.index.addMapping(s, corpus.strings.size() - 1);
+  }
+  for (size_t length = 60; length < 72; length++) {
+    checkFuzzyQuery(corpus, std::string(length, 'a') + "b", 3);
+  }
+}
+} // namespace
+
+int main() {
+  testQueries();
+  testIdsOutOfOrder();
+  testEditDistance();
+  testFuzzyQueries();
+  return smartwater::test::testResult();
+}
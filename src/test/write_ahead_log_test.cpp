@@ -0,0 +1,201 @@
+#include "write_ahead_log.h"
+
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "check.h"
+#include "database.h"
+#include "logger.h"
+
+using namespace smartwater;
+
+namespace {
+const char *LOG_PATH = "write_ahead_log_test.wal";
+const char *DATABASE_PATH = "write_ahead_log_test.db";
+
+off_t fileSize(const char *path) {
+  struct stat s;
+  return stat(path, &s) == 0 ? s.st_size : -1;
+}
+
+struct Record {
+  WriteAheadLog::RecordType type;
+  std::string data;
+};
+
+std::vector<Record> testRecords() {
+  std::vector<Record> records;
+  for (int i = 0; i < 20; i++) {
+    WriteAheadLog::RecordType type =
+        i % 3 == 0 ? WriteAheadLog::ADD_SENSOR : WriteAheadLog::ADD_MEASUREMENT;
+    records.push_back({type, std::string(i * 7, char('a' + i))});
+  }
+  return records;
+}
+
+// Writes a log with the checkpoint and the records, returns the offsets at
+// which the records end
+std::vector<off_t> writeLog(const std::string &checkpoint,
+                            const std::vector<Record> &records) {
+  std::vector<off_t> ends;
+  WriteAheadLog log(LOG_PATH);
+  log.reset(checkpoint.data(), checkpoint.size());
+  for (const Record &record : records) {
+    log.append(record.type, record.data.data(), record.data.size());
+    log.flush();
+    ends.push_back(fileSize(LOG_PATH));
+  }
+  log.sync();
+  return ends;
+}
+
+std::vector<Record> replayLog(std::string *checkpoint) {
+  std::vector<Record> records;
+  WriteAheadLog log(LOG_PATH);
+  std::vector<char> data;
+  CHECK(log.readCheckpoint(&data));
+  checkpoint->assign(data.begin(), data.end());
+  log.replay([&records](WriteAheadLog::RecordType type, const char *record,
+                        size_t size) {
+    records.push_back({type, std::string(record, size)});
+  });
+  return records;
+}
+
+// Checks that the replayed records are the first num_records records
+void checkPrefix(const std::vector<Record> &replayed,
+                 const std::vector<Record> &records, size_t num_records) {
+  CHECK(replayed.size() == num_records);
+  for (size_t i = 0; i < replayed.size() && i < records.size(); i++) {
+    CHECK(replayed[i].type == records[i].type);
+    CHECK(replayed[i].data == records[i].data);
+  }
+}
+
+void testReplay() {
+  std::vector<Record> records = testRecords();
+  writeLog("checkpoint", records);
+  std::string checkpoint;
+  checkPrefix(replayLog(&checkpoint), records, records.size());
+  CHECK(checkpoint == "checkpoint");
+}
+
+void testTruncatedRecord() {
+  std::vector<Record> records = testRecords();
+  std::vector<off_t> ends = writeLog("checkpoint", records);
+  // A crash can cut the last record anywhere
+  for (off_t end = ends[ends.size() - 2]; end < ends.back(); end++) {
+    writeLog("checkpoint", records);
+    CHECK(truncate(LOG_PATH, end) == 0);
+    std::string checkpoint;
+    checkPrefix(replayLog(&checkpoint), records, records.size() - 1);
+  }
+}
+
+void testCorruptRecord() {
+  std::vector<Record> records = testRecords();
+  std::vector<off_t> ends = writeLog("checkpoint", records);
+  // Replay stops at the first record whose checksum does not match, whichever
+  // of its bytes is broken
+  for (size_t i = 1; i < records.size(); i += 4) {
+    for (off_t offset = ends[i - 1]; offset < ends[i]; offset += 3) {
+      writeLog("checkpoint", records);
+      int fd = open(LOG_PATH, O_RDWR);
+      char c;
+      CHECK(pread(fd, &c, 1, offset) == 1);
+      c ^= 0x10;
+      CHECK(pwrite(fd, &c, 1, offset) == 1);
+      close(fd);
+      std::string checkpoint;
+      checkPrefix(replayLog(&checkpoint), records, i);
+    }
+  }
+}
+
+void testCorruptCheckpoint() {
+  WriteAheadLog missing("write_ahead_log_test.missing");
+  std::vector<char> data;
+  CHECK(!missing.readCheckpoint(&data));
+
+  writeLog("checkpoint", testRecords());
+  int fd = open(LOG_PATH, O_RDWR);
+  CHECK(pwrite(fd, "C", 1, 20) == 1);
+  close(fd);
+  WriteAheadLog log(LOG_PATH);
+  bool thrown = false;
+  try {
+    log.readCheckpoint(&data);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  CHECK(thrown);
+}
+
+void removeDatabase() {
+  std::string path = DATABASE_PATH;
+  unlink(path.c_str());
+  unlink((path + ".wal").c_str());
+  unlink((path + ".snapshot").c_str());
+}
+
+void testDatabaseRecovery() {
+  removeDatabase();
+  // The child is killed after its writes returned, the database is neither
+  // checkpointed nor closed
+  pid_t child = fork();
+  if (child == 0) {
+    Database db(DATABASE_PATH);
+    Sensor sensor;
+    sensor.name = "Pegel";
+    sensor.location_name = "Köln";
+    sensor.dev_uid = "uid";
+    uint64_t id = db.addSensor(sensor);
+    for (uint64_t i = 1; i <= 1000; i++) {
+      db.addMeasurement(id, {i, double(i)});
+    }
+    _exit(0);
+  }
+  int status;
+  CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status));
+
+  // A torn record follows the synced ones
+  int fd = open((std::string(DATABASE_PATH) + ".wal").c_str(),
+                O_WRONLY | O_APPEND);
+  CHECK(write(fd, "\x40\x00\x00\x00\x02torn", 9) == 9);
+  close(fd);
+
+  {
+    Database db(DATABASE_PATH);
+    CHECK(db.getNumSensors() == 1);
+    CHECK(db.sensorFromUID("uid") == 0);
+    MeasurementRange measurements = db.getMeasurementsCached(0);
+    CHECK(measurements.size() == 1000);
+    CHECK(db.getLastTimestamp(0) == 1000);
+    CHECK(db.getLastMeasurement(0) == 1000);
+    // The database stays writable after the recovery
+    CHECK(db.addMeasurement(0, {1001, 1001}));
+  }
+  {
+    Database db(DATABASE_PATH);
+    CHECK(db.getMeasurementsCached(0).size() == 1001);
+  }
+  removeDatabase();
+}
+} // namespace
+
+int main() {
+  // Every test drops torn records
+  Logger::setLevel(ERROR);
+  testReplay();
+  testTruncatedRecord();
+  testCorruptRecord();
+  testCorruptCheckpoint();
+  testDatabaseRecovery();
+  unlink(LOG_PATH);
+  return smartwater::test::testResult();
+}
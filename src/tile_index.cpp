@@ -0,0 +1,254 @@
+#include "tile_index.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace smartwater {
+
+namespace {
+// Web mercator can not show the poles, latitudes are clamped to this
+constexpr double MAX_LATITUDE = 85.05112878;
+
+uint64_t cellKey(uint32_t x, uint32_t y) {
+  return (static_cast<uint64_t>(x) << 32) | y;
+}
+
+// The cell coordinates of a position on the finest level. x grows to the
+// east and y to the south.
+uint32_t cellX(double longitude) {
+  double x = (longitude + 180) / 360;
+  double cells = uint64_t(1) << TileIndex::MAX_LEVEL;
+  return std::min(std::max(x * cells, 0.0), cells - 1);
+}
+
+uint32_t cellY(double latitude) {
+  double lat = std::min(std::max(latitude, -MAX_LATITUDE), MAX_LATITUDE);
+  double sin_lat = sin(lat * M_PI / 180);
+  double y = 0.5 - log((1 + sin_lat) / (1 - sin_lat)) / (4 * M_PI);
+  double cells = uint64_t(1) << TileIndex::MAX_LEVEL;
+  return std::min(std::max(y * cells, 0.0), cells - 1);
+}
+} // namespace
+
+TileIndex::TileIndex() : _levels(MAX_LEVEL + 1) {}
+
+TileIndex::TileIndex(const TileIndex &other) : _levels(MAX_LEVEL + 1) {
+  // The cells point at each other, so the grid is rebuilt
+  for (size_t id = 0; id < other._sensors.size(); id++) {
+    const SensorEntry &sensor = other._sensors[id];
+    insert(id, sensor.latitude, sensor.longitude);
+    if (sensor.measured.load(std::memory_order_relaxed)) {
+      setLastMeasurement(
+          id, sensor.last_measurement.load(std::memory_order_relaxed));
+    }
+  }
+}
+
+size_t TileIndex::size() const { return _sensors.size(); }
+
+void TileIndex::insert(uint64_t id, double latitude, double longitude) {
+  if (_sensors.size() <= id) {
+    _sensors.resize(id + 1);
+  }
+  SensorEntry &sensor = _sensors[id];
+  sensor.latitude = latitude;
+  sensor.longitude = longitude;
+  uint32_t x = cellX(longitude);
+  uint32_t y = cellY(latitude);
+  for (int level = 0; level <= MAX_LEVEL; level++) {
+    int shift = MAX_LEVEL - level;
+    Cell &cell = _levels[level][cellKey(x >> shift, y >> shift)];
+    if (cell.count == 0 || id < cell.first_id) {
+      cell.first_id = id;
+    }
+    cell.count++;
+    cell.sum_latitude += latitude;
+    cell.sum_longitude += longitude;
+    if (level == MAX_LEVEL) {
+      cell.ids.push_back(id);
+    }
+    sensor.cells[level] = &cell;
+  }
+}
+
+void TileIndex::setLastMeasurement(uint64_t id, double value) {
+  if (id >= _sensors.size()) {
+    return;
+  }
+  SensorEntry &sensor = _sensors[id];
+  // Only the writer changes the sums, so they need no read modify write
+  bool measured = sensor.measured.load(std::memory_order_relaxed);
+  double delta = value;
+  if (measured) {
+    delta -= sensor.last_measurement.load(std::memory_order_relaxed);
+  }
+  for (Cell *cell : sensor.cells) {
+    cell->sum_measurements.store(
+        cell->sum_measurements.load(std::memory_order_relaxed) + delta,
+        std::memory_order_relaxed);
+    if (!measured) {
+      cell->num_measured.store(
+          cell->num_measured.load(std::memory_order_relaxed) + 1,
+          std::memory_order_relaxed);
+    }
+  }
+  sensor.last_measurement.store(value, std::memory_order_relaxed);
+  sensor.measured.store(true, std::memory_order_relaxed);
+}
+
+void TileIndex::copyLastMeasurements(const TileIndex &other) {
+  size_t num_sensors = std::min(_sensors.size(), other._sensors.size());
+  for (size_t id = 0; id < num_sensors; id++) {
+    const SensorEntry &source = other._sensors[id];
+    if (!source.measured.load(std::memory_order_relaxed)) {
+      continue;
+    }
+    double value = source.last_measurement.load(std::memory_order_relaxed);
+    const SensorEntry &sensor = _sensors[id];
+    if (!sensor.measured.load(std::memory_order_relaxed) ||
+        sensor.last_measurement.load(std::memory_order_relaxed) != value) {
+      setLastMeasurement(id, value);
+    }
+  }
+}
+
+std::vector<TileIndex::Marker>
+TileIndex::query(double min_latitude, double min_longitude,
+                 double max_latitude, double max_longitude, int zoom) const {
+  std::vector<Marker> markers;
+  if (min_latitude > max_latitude) {
+    return markers;
+  }
+  int level = std::min(std::max(zoom + CELL_LEVELS_PER_TILE, 0), MAX_LEVEL);
+  // Beyond the finest level every sensor is shown on its own
+  bool expand = zoom + CELL_LEVELS_PER_TILE > MAX_LEVEL;
+  int shift = MAX_LEVEL - level;
+  uint32_t min_x = cellX(min_longitude) >> shift;
+  uint32_t max_x = cellX(max_longitude) >> shift;
+  // The y axis points south
+  uint32_t min_y = cellY(max_latitude) >> shift;
+  uint32_t max_y = cellY(min_latitude) >> shift;
+  if (min_longitude <= max_longitude) {
+    queryLevel(level, min_x, max_x, min_y, max_y, expand, &markers);
+  } else {
+    // Split the box at the antimeridian
+    uint32_t last_x = (uint32_t(1) << level) - 1;
+    queryLevel(level, min_x, last_x, min_y, max_y, expand, &markers);
+    queryLevel(level, 0, max_x, min_y, max_y, expand, &markers);
+  }
+  return markers;
+}
+
+std::vector<TileIndex::Marker>
+TileIndex::mergeMarkers(std::vector<Marker> markers, int zoom) {
+  if (zoom + CELL_LEVELS_PER_TILE > MAX_LEVEL) {
+    // Every sensor has its own marker
+    return markers;
+  }
+  std::sort(markers.begin(), markers.end(),
+            [](const Marker &m1, const Marker &m2) {
+              return m1.cell < m2.cell || (m1.cell == m2.cell && m1.id < m2.id);
+            });
+  std::vector<Marker> merged;
+  for (const Marker &marker : markers) {
+    if (merged.empty() || merged.back().cell != marker.cell) {
+      merged.push_back(marker);
+      continue;
+    }
+    // The markers are sorted by id, so the first one keeps its id
+    Marker &cluster = merged.back();
+    uint64_t count = cluster.count + marker.count;
+    cluster.latitude = (cluster.latitude * cluster.count +
+                        marker.latitude * marker.count) /
+                       count;
+    cluster.longitude = (cluster.longitude * cluster.count +
+                         marker.longitude * marker.count) /
+                        count;
+    cluster.count = count;
+    uint64_t num_measured = cluster.num_measured + marker.num_measured;
+    if (num_measured > 0) {
+      cluster.last_measurement =
+          (cluster.last_measurement * cluster.num_measured +
+           marker.last_measurement * marker.num_measured) /
+          num_measured;
+    }
+    cluster.num_measured = num_measured;
+  }
+  return merged;
+}
+
+void TileIndex::queryLevel(int level, uint32_t min_x, uint32_t max_x,
+                           uint32_t min_y, uint32_t max_y, bool expand,
+                           std::vector<Marker> *markers) const {
+  if (min_x > max_x) {
+    return;
+  }
+  const std::unordered_map<uint64_t, Cell> &cells = _levels[level];
+  uint64_t area =
+      static_cast<uint64_t>(max_x - min_x + 1) * (max_y - min_y + 1);
+  if (area <= cells.size()) {
+    // Look up every cell of the box
+    for (uint32_t x = min_x; x <= max_x; x++) {
+      for (uint32_t y = min_y; y <= max_y; y++) {
+        std::unordered_map<uint64_t, Cell>::const_iterator it =
+            cells.find(cellKey(x, y));
+        if (it != cells.end()) {
+          appendMarkers(it->second, it->first, expand, markers);
+        }
+      }
+    }
+    return;
+  }
+  // The box is larger than the occupied part of the level
+  for (const std::pair<const uint64_t, Cell> &entry : cells) {
+    uint32_t x = entry.first >> 32;
+    uint32_t y = static_cast<uint32_t>(entry.first);
+    if (x >= min_x && x <= max_x && y >= min_y && y <= max_y) {
+      appendMarkers(entry.second, entry.first, expand, markers);
+    }
+  }
+}
+
+void TileIndex::appendMarkers(const Cell &cell, uint64_t key, bool expand,
+                              std::vector<Marker> *markers) const {
+  if (cell.count == 1) {
+    markers->push_back(sensorMarker(cell.first_id, key));
+    return;
+  }
+  if (expand) {
+    // Only happens on the finest level, which lists its sensors
+    for (uint64_t id : cell.ids) {
+      markers->push_back(sensorMarker(id, key));
+    }
+    return;
+  }
+  uint64_t num_measured = cell.num_measured.load(std::memory_order_relaxed);
+  double sum_measurements =
+      cell.sum_measurements.load(std::memory_order_relaxed);
+  Marker marker;
+  marker.count = cell.count;
+  marker.id = cell.first_id;
+  marker.latitude = cell.sum_latitude / cell.count;
+  marker.longitude = cell.sum_longitude / cell.count;
+  marker.num_measured = num_measured;
+  marker.last_measurement =
+      num_measured == 0 ? 0 : sum_measurements / num_measured;
+  marker.cell = key;
+  markers->push_back(marker);
+}
+
+TileIndex::Marker TileIndex::sensorMarker(uint64_t id, uint64_t key) const {
+  const SensorEntry &sensor = _sensors[id];
+  Marker marker;
+  marker.count = 1;
+  marker.id = id;
+  marker.latitude = sensor.latitude;
+  marker.longitude = sensor.longitude;
+  marker.num_measured = sensor.measured.load(std::memory_order_relaxed);
+  marker.last_measurement =
+      sensor.last_measurement.load(std::memory_order_relaxed);
+  marker.cell = key;
+  return marker;
+}
+
+} // namespace smartwater
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+namespace smartwater {
+
+// A hierarchical grid over the web mercator projection used by map clients.
+// Level l divides the map into 2^l x 2^l cells and every cell keeps the
+// number of its sensors, the sum of their positions and the sum of their last
+// measurements. A viewport is answered from the cells of a single level, so
+// zoomed out views only cost as much as the number of cells they show.
+//
+// The cells are updated by a single writer. Adding sensors changes the
+// structure of the grid and has to be serialized with queries by the caller,
+// the last measurements are updated atomically and may be set concurrently
+// with queries.
+class TileIndex {
+public:
+  // The finest level, its cells are about 150m wide at the equator
+  static constexpr int MAX_LEVEL = 18;
+  // Every map tile is divided into 2^CELL_LEVELS_PER_TILE cells per side for
+  // clustering, so a cluster covers about 64 of the 256 pixels of a tile.
+  static constexpr int CELL_LEVELS_PER_TILE = 2;
+
+  // A cluster of sensors or a single sensor if count is 1
+  struct Marker {
+    uint64_t count;
+    // The id of the sensor, or of the sensor with the smallest id
+    uint64_t id;
+    // The mean position of the sensors
+    double latitude;
+    double longitude;
+    // The number of the sensors that have measurements and the mean of their
+    // last measurements
+    uint64_t num_measured;
+    double last_measurement;
+    // The key of the cell on the level of the query, markers of the same
+    // cell from several indices can be merged
+    uint64_t cell;
+  };
+
+  TileIndex();
+  // Copies the sensors and their last measurements. The copy must not run
+  // concurrently with setLastMeasurement on the other index.
+  TileIndex(const TileIndex &other);
+  TileIndex &operator=(const TileIndex &other) = delete;
+
+  // Ids are expected to be dense.
+  void insert(uint64_t id, double latitude, double longitude);
+  // Replaces the last measurement of the sensor in the aggregates
+  void setLastMeasurement(uint64_t id, double value);
+  // Takes the last measurements of the sensors in both indices from the
+  // other index
+  void copyLastMeasurements(const TileIndex &other);
+
+  // Returns the markers of the cells intersecting the bounding box as seen at
+  // the zoom level of a map. Sensors are clustered by the cells of the level
+  // for the zoom, cells with a single sensor and all sensors at zoom levels
+  // beyond the finest level are returned individually. The box may cross the
+  // antimeridian, in which case min_longitude is larger than max_longitude.
+  std::vector<Marker> query(double min_latitude, double min_longitude,
+                            double max_latitude, double max_longitude,
+                            int zoom) const;
+  // Merges the markers that indices over disjoint sets of sensors returned
+  // for the same query into the markers one index over all of them returns,
+  // apart from their order
+  static std::vector<Marker> mergeMarkers(std::vector<Marker> markers,
+                                          int zoom);
+
+  size_t size() const;
+
+private:
+  struct Cell {
+    uint64_t count = 0;
+    uint64_t first_id = 0;
+    double sum_latitude = 0;
+    double sum_longitude = 0;
+    std::atomic<uint64_t> num_measured{0};
+    std::atomic<double> sum_measurements{0};
+    // The sensors of the cell, only kept on the finest level
+    std::vector<uint64_t> ids;
+  };
+
+  struct SensorEntry {
+    double latitude;
+    double longitude;
+    // The cell of the sensor on every level. The nodes of an unordered_map
+    // never move, so the pointers stay valid.
+    Cell *cells[MAX_LEVEL + 1];
+    std::atomic<bool> measured{false};
+    std::atomic<double> last_measurement{0};
+  };
+
+  // Appends the markers of the cells of the level in the range of cell
+  // coordinates.
+  void queryLevel(int level, uint32_t min_x, uint32_t max_x, uint32_t min_y,
+                  uint32_t max_y, bool expand,
+                  std::vector<Marker> *markers) const;
+  void appendMarkers(const Cell &cell, uint64_t key, bool expand,
+                     std::vector<Marker> *markers) const;
+  Marker sensorMarker(uint64_t id, uint64_t key) const;
+
+  // The cells of every level by their packed coordinates
+  std::vector<std::unordered_map<uint64_t, Cell>> _levels;
+  // By id, a deque does not move its elements when growing
+  std::deque<SensorEntry> _sensors;
+};
+
+} // namespace smartwater
@@ -1,28 +1,24 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
 
 namespace smartwater {
 
-double greatCircleDist(double longitude1, double latitude1, double longitude2,
-                       double latitude2) {
+// Returns the distance in meters between two positions on the earths surface,
+// given in degrees.
+inline double greatCircleDist(double longitude1, double latitude1,
+                              double longitude2, double latitude2) {
   constexpr double EARTH_RADIUS = 6378000;
-  double lot1r = longitude1 * 180 / M_PI;
-  double lat1r = latitude1 * 180 / M_PI;
-
-  double lot2r = longitude2 * 180 / M_PI;
-  double lat2r = latitude2 * 180 / M_PI;
-
-  double p1x = sin(lot1r) * EARTH_RADIUS;
-  double p1y = cos(lot1r) * EARTH_RADIUS;
-  double p1z = sin(lat1r) * EARTH_RADIUS;
-
-  double p2x = sin(lot2r) * EARTH_RADIUS;
-  double p2y = cos(lot2r) * EARTH_RADIUS;
-  double p2z = sin(lat2r) * EARTH_RADIUS;
-
-  double dp = p1x * p2x + p1y * p2y + p1z * p2z;
-  return EARTH_RADIUS * acos(dp / (EARTH_RADIUS * EARTH_RADIUS));
+  double lat1 = latitude1 * M_PI / 180;
+  double lat2 = latitude2 * M_PI / 180;
+  double dlat = lat2 - lat1;
+  double dlon = (longitude2 - longitude1) * M_PI / 180;
+  // The haversine formula stays accurate for small distances, where the acos
+  // of the dot product of the unit vectors loses most of its precision.
+  double a = sin(dlat / 2) * sin(dlat / 2) +
+             cos(lat1) * cos(lat2) * sin(dlon / 2) * sin(dlon / 2);
+  return 2 * EARTH_RADIUS * asin(std::min(1.0, sqrt(a)));
 }
 
 } // namespace smartwater
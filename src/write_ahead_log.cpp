@@ -0,0 +1,199 @@
+#include "write_ahead_log.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "snapshot.h"
+
+namespace smartwater {
+
+namespace {
+// The first bytes of every log, the last two identify the version
+const char LOG_MAGIC[8] = {'S', 'W', 'W', 'A', 'L', '0', '0', '1'};
+// The buffer is written once it grows beyond this size, even without a sync
+const size_t MAX_BUFFER_SIZE = 1 << 20;
+
+// Every record starts with the size of its data and its type and ends with
+// a checksum over both.
+const size_t RECORD_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint8_t);
+const size_t RECORD_OVERHEAD = RECORD_HEADER_SIZE + sizeof(uint64_t);
+
+Counter &log_written_bytes = MetricsRegistry::global().counter(
+    "smartwater_wal_written_bytes_total",
+    "The number of bytes written to write ahead logs");
+Histogram &log_write_time = MetricsRegistry::global().histogram(
+    "smartwater_wal_write_seconds",
+    "The time it takes to hand the buffered log records to the system",
+    HistogramUnit::NANOSECONDS);
+Histogram &log_sync_time = MetricsRegistry::global().histogram(
+    "smartwater_wal_sync_seconds",
+    "The time it takes the system to make written log records durable",
+    HistogramUnit::NANOSECONDS);
+} // namespace
+
+WriteAheadLog::WriteAheadLog(const std::string &path)
+    : _path(path), _fd(-1), _recovered_offset(0), _size(0) {}
+
+WriteAheadLog::~WriteAheadLog() {
+  if (_fd >= 0) {
+    close(_fd);
+  }
+}
+
+bool WriteAheadLog::readCheckpoint(std::vector<char> *checkpoint) {
+  int fd = open(_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  std::vector<char> &data = _recovered;
+  struct stat s;
+  if (fstat(fd, &s) == 0) {
+    data.resize(s.st_size);
+  }
+  size_t num_read = 0;
+  while (num_read < data.size()) {
+    ssize_t n = ::read(fd, data.data() + num_read, data.size() - num_read);
+    if (n <= 0) {
+      break;
+    }
+    num_read += n;
+  }
+  close(fd);
+  data.resize(num_read);
+
+  // The checkpoint was written in one piece by a SnapshotWriter
+  size_t offset = sizeof(LOG_MAGIC) + sizeof(uint64_t);
+  uint64_t checkpoint_size = 0;
+  if (data.size() >= offset + sizeof(uint64_t)) {
+    std::memcpy(&checkpoint_size, data.data() + sizeof(LOG_MAGIC),
+                sizeof(checkpoint_size));
+  }
+  if (data.size() < offset + sizeof(uint64_t) ||
+      std::memcmp(data.data(), LOG_MAGIC, sizeof(LOG_MAGIC)) != 0 ||
+      checkpoint_size > data.size() - offset - sizeof(uint64_t)) {
+    throw std::runtime_error("The log " + _path + " is corrupt");
+  }
+  uint64_t checksum;
+  std::memcpy(&checksum, data.data() + offset + checkpoint_size,
+              sizeof(checksum));
+  if (updateChecksum(CHECKSUM_SEED, data.data(), offset + checkpoint_size) !=
+      checksum) {
+    throw std::runtime_error("The log " + _path + " is corrupt");
+  }
+  checkpoint->assign(data.data() + offset,
+                     data.data() + offset + checkpoint_size);
+  _recovered_offset = offset + checkpoint_size + sizeof(uint64_t);
+  return true;
+}
+
+void WriteAheadLog::replay(const RecordCallback &on_record) {
+  const std::vector<char> &data = _recovered;
+  size_t offset = _recovered_offset;
+  size_t num_records = 0;
+  while (data.size() - offset >= RECORD_OVERHEAD) {
+    uint32_t size;
+    std::memcpy(&size, data.data() + offset, sizeof(size));
+    if (size > data.size() - offset - RECORD_OVERHEAD) {
+      break;
+    }
+    uint64_t checksum;
+    std::memcpy(&checksum, data.data() + offset + RECORD_HEADER_SIZE + size,
+                sizeof(checksum));
+    if (updateChecksum(CHECKSUM_SEED, data.data() + offset,
+                       RECORD_HEADER_SIZE + size) != checksum) {
+      break;
+    }
+    RecordType type = static_cast<RecordType>(data[offset + sizeof(size)]);
+    on_record(type, data.data() + offset + RECORD_HEADER_SIZE, size);
+    offset += RECORD_OVERHEAD + size;
+    num_records++;
+  }
+  if (offset < data.size()) {
+    // Only records that were never synced can be torn
+    LOG_WARN << "Dropped a torn record at the end of " << _path << LOG_END;
+  }
+  if (!data.empty()) {
+    LOG_INFO << "Replayed " << num_records << " records from " << _path
+             << LOG_END;
+  }
+  _recovered = std::vector<char>();
+  _recovered_offset = 0;
+}
+
+void WriteAheadLog::append(RecordType type, const void *data, size_t size) {
+  size_t offset = _buffer.size();
+  _buffer.resize(offset + RECORD_OVERHEAD + size);
+  char *record = _buffer.data() + offset;
+  uint32_t record_size = size;
+  std::memcpy(record, &record_size, sizeof(record_size));
+  record[sizeof(record_size)] = type;
+  std::memcpy(record + RECORD_HEADER_SIZE, data, size);
+  uint64_t checksum =
+      updateChecksum(CHECKSUM_SEED, record, RECORD_HEADER_SIZE + size);
+  std::memcpy(record + RECORD_HEADER_SIZE + size, &checksum, sizeof(checksum));
+  _size += RECORD_OVERHEAD + size;
+  if (_buffer.size() >= MAX_BUFFER_SIZE) {
+    flush();
+  }
+}
+
+void WriteAheadLog::sync() {
+  flush();
+  if (_fd < 0) {
+    return;
+  }
+  ScopedTimer timer(&log_sync_time);
+  if (fdatasync(_fd) != 0) {
+    throw std::runtime_error("Unable to sync the log " + _path);
+  }
+}
+
+void WriteAheadLog::reset(const void *checkpoint, size_t size) {
+  _buffer.clear();
+  SnapshotWriter writer(_path);
+  writer.write(LOG_MAGIC, sizeof(LOG_MAGIC));
+  writer.write<uint64_t>(size);
+  writer.write(checkpoint, size);
+  writer.commit();
+
+  if (_fd >= 0) {
+    close(_fd);
+  }
+  _fd = open(_path.c_str(), O_WRONLY | O_APPEND);
+  if (_fd < 0) {
+    throw std::runtime_error("Unable to open the log " + _path);
+  }
+  _size = 0;
+}
+
+uint64_t WriteAheadLog::size() const { return _size; }
+
+void WriteAheadLog::flush() {
+  if (_buffer.empty()) {
+    return;
+  }
+  if (_fd < 0) {
+    throw std::runtime_error("The log " + _path + " was not created");
+  }
+  ScopedTimer timer(&log_write_time);
+  size_t num_written = 0;
+  while (num_written < _buffer.size()) {
+    ssize_t n = ::write(_fd, _buffer.data() + num_written,
+                        _buffer.size() - num_written);
+    if (n < 0) {
+      // Keep the log made of whole records
+      _buffer.erase(_buffer.begin(), _buffer.begin() + num_written);
+      throw std::runtime_error("Unable to write the log " + _path);
+    }
+    num_written += n;
+  }
+  log_written_bytes.add(num_written);
+  _buffer.clear();
+}
+
+} // namespace smartwater
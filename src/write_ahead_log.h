@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace smartwater {
+
+// An append only log of logical records. The log starts with a checkpoint,
+// an opaque description of the state the records apply to, and is replaced
+// atomically by a new, empty log whenever a new checkpoint is taken.
+//
+// Records are buffered in memory until sync is called, which writes them
+// with a single write and waits for them to reach the disk. Every record
+// carries a checksum, so a record torn by a crash ends the log.
+class WriteAheadLog {
+public:
+  enum RecordType : uint8_t { ADD_SENSOR = 1, ADD_MEASUREMENT = 2 };
+
+  typedef std::function<void(RecordType type, const char *data, size_t size)>
+      RecordCallback;
+
+  // The log is neither read nor created until readCheckpoint or reset is
+  // called.
+  explicit WriteAheadLog(const std::string &path);
+  ~WriteAheadLog();
+
+  WriteAheadLog(const WriteAheadLog &other) = delete;
+  WriteAheadLog &operator=(const WriteAheadLog &other) = delete;
+
+  // Reads an existing log and returns its checkpoint. Returns false if there
+  // is no log. Throws if the checkpoint is corrupt.
+  bool readCheckpoint(std::vector<char> *checkpoint);
+  // Passes the records of the log read by readCheckpoint to on_record, in
+  // order.
+  void replay(const RecordCallback &on_record);
+
+  // Buffers a record. Throws if the buffer can not be written.
+  void append(RecordType type, const void *data, size_t size);
+  // Hands the buffered records to the operating system, they survive a crash
+  // of the process but not of the system. Throws on failure.
+  void flush();
+  // Writes the buffered records and waits for them to be durable. Throws on
+  // failure.
+  void sync();
+  // Atomically replaces the log by an empty one starting with the given
+  // checkpoint. Buffered records are dropped. Throws on failure.
+  void reset(const void *checkpoint, size_t size);
+
+  // The number of bytes of records since the checkpoint, including buffered
+  // ones
+  uint64_t size() const;
+
+private:
+  std::string _path;
+  int _fd;
+  std::vector<char> _buffer;
+  // The content of the log read by readCheckpoint and the offset of its
+  // first record
+  std::vector<char> _recovered;
+  size_t _recovered_offset;
+  uint64_t _size;
+};
+
+} // namespace smartwater